@@ -0,0 +1,196 @@
+#pragma once
+#include "FrameBuffer.h"
+#include "Vector3.h"
+#include "Material.h"
+#include <vector>
+#include <cstdio>
+
+// Accumulates floating point pixel estimates over multiple rendering passes
+// Each pass adds one estimate (the average of that pass' samples) to every pixel it renders
+class AccumulationBuffer {
+private:
+	int width, height;
+	// Sum of all pass estimates
+	std::vector<Vector3> colorSum;
+	// Sum of squared luminance of all pass estimates (for variance)
+	std::vector<float> luminanceSquaredSum;
+	// Number of passes that have been added to each pixel
+	std::vector<int> passCount;
+
+	// Sums of the first hit features of all passes (only filled if features are added)
+	std::vector<Vector3> albedoSum;
+	std::vector<Vector3> normalSum;
+	std::vector<float> depthSum;
+	std::vector<float> coverageSum;
+	std::vector<int> featureCount;
+
+public:
+	// Create an empty accumulation buffer with dimensions [width x height]
+	AccumulationBuffer(int width, int height) {
+		this->width = width;
+		this->height = height;
+		colorSum.resize(width * height);
+		luminanceSquaredSum.resize(width * height, 0.0f);
+		passCount.resize(width * height, 0);
+	}
+
+	int GetWidth() const {
+		return width;
+	}
+
+	int GetHeight() const {
+		return height;
+	}
+
+	// Add a new estimate for pixel (x,y)
+	// Only one thread may write to a given pixel at a time
+	void AddSample(int x, int y, const Vector3& color) {
+		int index = y * width + x;
+		Vector3 c = color;
+		float luminance = c.Luminance();
+		colorSum[index] += color;
+		luminanceSquaredSum[index] += luminance * luminance;
+		passCount[index]++;
+	}
+
+	// Allocate storage for first hit features
+	// Must be called before rendering starts if features will be added
+	void EnableFeatures() {
+		albedoSum.resize(width * height);
+		normalSum.resize(width * height);
+		depthSum.resize(width * height, 0.0f);
+		coverageSum.resize(width * height, 0.0f);
+		featureCount.resize(width * height, 0);
+	}
+
+	// Add the first hit features of a pass for pixel (x,y)
+	// Only one thread may write to a given pixel at a time
+	void AddFeatures(int x, int y, const PixelFeatures& features) {
+		int index = y * width + x;
+		albedoSum[index] += features.albedo;
+		normalSum[index] += features.normal;
+		depthSum[index] += features.depth;
+		coverageSum[index] += features.coverage;
+		featureCount[index]++;
+	}
+
+	// Whether features are being stored
+	bool HasFeatures() const {
+		return !featureCount.empty();
+	}
+
+	// Get the averaged features at pixel (x,y)
+	PixelFeatures GetFeatures(int x, int y) const {
+		PixelFeatures features;
+		int index = y * width + x;
+		if (featureCount.empty() || featureCount[index] == 0)
+			return features;
+		float n = (float)featureCount[index];
+		features.albedo = albedoSum[index] / n;
+		features.coverage = coverageSum[index] / n;
+		//depth and normal are only defined where something was hit
+		if (coverageSum[index] > 0.0f) {
+			features.depth = depthSum[index] / coverageSum[index];
+			float length = normalSum[index].length();
+			features.normal = (length > 0.0f) ? normalSum[index] / length : Vector3();
+		}
+		return features;
+	}
+
+	// Get the averaged color at pixel (x,y)
+	Vector3 GetColor(int x, int y) const {
+		int index = y * width + x;
+		if (passCount[index] == 0)
+			return Vector3(0.0f, 0.0f, 0.0f);
+		return colorSum[index] / (float)passCount[index];
+	}
+
+	// Number of passes accumulated at pixel (x,y)
+	int GetPassCount(int x, int y) const {
+		return passCount[y * width + x];
+	}
+
+	// Estimated variance of the averaged luminance at pixel (x,y)
+	// Needs at least 2 passes, returns -1 otherwise
+	float GetVariance(int x, int y) const {
+		int index = y * width + x;
+		int n = passCount[index];
+		if (n < 2)
+			return -1.0f;
+		Vector3 mean = colorSum[index] / (float)n;
+		float meanLuminance = mean.Luminance();
+		//sample variance of a single pass estimate
+		float variance = (luminanceSquaredSum[index] - n * meanLuminance * meanLuminance) / (n - 1);
+		//variance of the mean of n passes
+		return max(variance, 0.0f) / n;
+	}
+
+	// Average relative standard error over the image, used to decide when an image has converged
+	// Returns -1 if there are not enough passes to tell
+	float GetRelativeError() const {
+		double totalError = 0.0;
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				float variance = GetVariance(x, y);
+				if (variance < 0.0f)
+					return -1.0f;
+				//relative to brightness, with a floor so black pixels don't dominate
+				float luminance = GetColor(x, y).Luminance();
+				totalError += sqrt(variance) / max(luminance, 0.01f);
+			}
+		}
+		return (float)(totalError / (width * height));
+	}
+
+	// Write all accumulated sums and counts to an open binary file
+	bool Write(FILE* file) const {
+		int numPixels = width * height;
+		int hasFeatures = HasFeatures() ? 1 : 0;
+		bool ok = fwrite(&width, sizeof(int), 1, file) == 1 && fwrite(&height, sizeof(int), 1, file) == 1 && fwrite(&hasFeatures, sizeof(int), 1, file) == 1;
+		ok = ok && fwrite(colorSum.data(), sizeof(Vector3), numPixels, file) == numPixels;
+		ok = ok && fwrite(luminanceSquaredSum.data(), sizeof(float), numPixels, file) == numPixels;
+		ok = ok && fwrite(passCount.data(), sizeof(int), numPixels, file) == numPixels;
+		if (hasFeatures) {
+			ok = ok && fwrite(albedoSum.data(), sizeof(Vector3), numPixels, file) == numPixels;
+			ok = ok && fwrite(normalSum.data(), sizeof(Vector3), numPixels, file) == numPixels;
+			ok = ok && fwrite(depthSum.data(), sizeof(float), numPixels, file) == numPixels;
+			ok = ok && fwrite(coverageSum.data(), sizeof(float), numPixels, file) == numPixels;
+			ok = ok && fwrite(featureCount.data(), sizeof(int), numPixels, file) == numPixels;
+		}
+		return ok;
+	}
+
+	// Replace the contents of the buffer with what Write saved
+	// The dimensions and whether features are stored must match this buffer, otherwise nothing is changed and false is returned
+	bool Read(FILE* file) {
+		int numPixels = width * height;
+		int fileWidth, fileHeight, hasFeatures;
+		if (fread(&fileWidth, sizeof(int), 1, file) != 1 || fread(&fileHeight, sizeof(int), 1, file) != 1 || fread(&hasFeatures, sizeof(int), 1, file) != 1)
+			return false;
+		if (fileWidth != width || fileHeight != height || (hasFeatures != 0) != HasFeatures())
+			return false;
+		//read into a copy so a truncated file leaves this buffer alone
+		AccumulationBuffer loaded = *this;
+		bool ok = fread(loaded.colorSum.data(), sizeof(Vector3), numPixels, file) == numPixels;
+		ok = ok && fread(loaded.luminanceSquaredSum.data(), sizeof(float), numPixels, file) == numPixels;
+		ok = ok && fread(loaded.passCount.data(), sizeof(int), numPixels, file) == numPixels;
+		if (hasFeatures) {
+			ok = ok && fread(loaded.albedoSum.data(), sizeof(Vector3), numPixels, file) == numPixels;
+			ok = ok && fread(loaded.normalSum.data(), sizeof(Vector3), numPixels, file) == numPixels;
+			ok = ok && fread(loaded.depthSum.data(), sizeof(float), numPixels, file) == numPixels;
+			ok = ok && fread(loaded.coverageSum.data(), sizeof(float), numPixels, file) == numPixels;
+			ok = ok && fread(loaded.featureCount.data(), sizeof(int), numPixels, file) == numPixels;
+		}
+		if (ok)
+			*this = loaded;
+		return ok;
+	}
+
+	// Quantize the current averaged image into a frame buffer
+	void Resolve(FrameBuffer* fb) const {
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++)
+				fb->SetColor(x, y, GetColor(x, y));
+		}
+	}
+};
@@ -0,0 +1,90 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+
+// Walker's alias method
+// Samples an index with probability proportional to its weight in constant time
+class AliasTable {
+private:
+	// Probability of keeping each bucket instead of jumping to its alias
+	std::vector<float> keep;
+	// Where to go if the bucket is not kept
+	std::vector<int> alias;
+	// Probability of each index being chosen
+	std::vector<float> pdf;
+
+public:
+	AliasTable() {}
+
+	// Build a table from non-negative weights (they do not need to be normalized)
+	AliasTable(const std::vector<float>& weights) {
+		int n = weights.size();
+		keep.resize(n);
+		alias.resize(n);
+		pdf.resize(n);
+		if (n == 0)
+			return;
+
+		float total = 0.0f;
+		for (int i = 0; i < n; i++)
+			total += weights[i];
+
+		//scale so the average bucket holds 1
+		std::vector<float> scaled(n);
+		std::vector<int> small, large;
+		for (int i = 0; i < n; i++) {
+			pdf[i] = (total > 0.0f) ? weights[i] / total : 1.0f / n;
+			scaled[i] = pdf[i] * n;
+			if (scaled[i] < 1.0f)
+				small.push_back(i);
+			else
+				large.push_back(i);
+		}
+
+		//pair each under-full bucket with an over-full one
+		while (!small.empty() && !large.empty()) {
+			int s = small.back();
+			small.pop_back();
+			int l = large.back();
+			large.pop_back();
+			keep[s] = scaled[s];
+			alias[s] = l;
+			//move the excess of l into s
+			scaled[l] = (scaled[l] + scaled[s]) - 1.0f;
+			if (scaled[l] < 1.0f)
+				small.push_back(l);
+			else
+				large.push_back(l);
+		}
+		//anything left over is full (up to rounding error)
+		for (int i = 0; i < large.size(); i++) {
+			keep[large[i]] = 1.0f;
+			alias[large[i]] = large[i];
+		}
+		for (int i = 0; i < small.size(); i++) {
+			keep[small[i]] = 1.0f;
+			alias[small[i]] = small[i];
+		}
+	}
+
+	// Pick an index using a uniform random number u in [0,1)
+	int Sample(float u, float& outPdf) const {
+		int n = keep.size();
+		//first part of u picks the bucket, the remainder decides between bucket and alias
+		float scaled = u * n;
+		int bucket = std::min((int)scaled, n - 1);
+		float remainder = scaled - bucket;
+		int index = (remainder < keep[bucket]) ? bucket : alias[bucket];
+		outPdf = pdf[index];
+		return index;
+	}
+
+	// Probability of choosing index
+	float Pdf(int index) const {
+		return pdf[index];
+	}
+
+	int Size() const {
+		return keep.size();
+	}
+};
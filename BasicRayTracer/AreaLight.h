@@ -0,0 +1,46 @@
+#pragma once
+#include "Primitive.h"
+#include "AliasTable.h"
+#include <vector>
+
+// An emissive object lighting the scene, made of its emissive primitives
+// Points on it are chosen by picking a primitive proportionally to its power (area * luminance of emission)
+// through an alias table, then a point uniformly by area on that primitive
+class AreaLight {
+private:
+	std::vector<Primitive*> primitives;
+	// Chooses primitives by power
+	AliasTable table;
+	// Sum of the power of all primitives
+	float power;
+
+public:
+	// Create a light from the emissive primitives of one object
+	AreaLight(const std::vector<Primitive*>& emissivePrimitives) : primitives(emissivePrimitives) {
+		std::vector<float> powers;
+		power = 0.0f;
+		for (int i = 0; i < primitives.size(); i++) {
+			powers.push_back(primitives[i]->GetEmission().Luminance() * primitives[i]->GetArea());
+			power += powers.back();
+		}
+		table = AliasTable(powers);
+	}
+
+	// Pick a point on the light from the uniform random numbers u (primitive) and u1,u2 (point on it)
+	// Outputs its normal, emitted radiance, and the probability density of choosing it per unit area
+	void Sample(float u, float u1, float u2, Vector3& position, Vector3& normal, Vector3& emission, float& areaPdf) const {
+		float selectPdf;
+		Primitive* primitive = primitives[table.Sample(u, selectPdf)];
+		primitive->SamplePoint(u1, u2, position, normal);
+		emission = primitive->GetEmission();
+		areaPdf = selectPdf / primitive->GetArea();
+	}
+
+	float GetPower() const {
+		return power;
+	}
+
+	int NumPrimitives() const {
+		return primitives.size();
+	}
+};
@@ -1,7 +1,14 @@
 #pragma once
 #include "Vector3.h"
+#include "FileUtil.h"
+#include <vector>
+#include <cstdio>
 
 #define NUM_SUBSCATTER_SAMPLES 32
+// Number of entries in the precomputed diffuse reflectance and sampling tables
+#define BSSRDF_TABLE_SIZE 1024
+// Tables are checked against the analytic functions in debug builds and a warning is printed above this relative error
+#define BSSRDF_TABLE_TOLERANCE 0.01f
 
 // Bidirectional
 class BSSRDF {
@@ -19,6 +26,19 @@ private:
 
 	float Rmax;
 
+	// Luminance of the coefficients used for sampling
+	float sigmaTrLuminance;
+	float sigmaTLuminance;
+	// Fraction of the exponential falloff that lies within Rmax, normalizes the diffusion pdf
+	float diffusionNormalization;
+
+	// Rd at evenly spaced radii from 0 to Rmax
+	std::vector<Vector3> RdTable;
+	// Squared radius from ImportanceSampleDiffusion at evenly spaced u from 0 to 1
+	std::vector<float> diffusionRadiusSquaredTable;
+	// Unnormalized diffusion pdf at evenly spaced squared radii from 0 to Rmax^2
+	std::vector<float> diffusionFalloffTable;
+
 	// A rational approximation of the measured diffuse reflectance
 	// Equation 5.27 from Donner's thesis
 	float FresnelDiffuseReflectance(float eta) {
@@ -61,11 +81,76 @@ public:
 
 		//Rmax
 		Rmax = sqrt(log(0.01f) / -sigmaTr.Luminance());
+
+		sigmaTrLuminance = sigmaTr.Luminance();
+		sigmaTLuminance = sigmaT.Luminance();
+		diffusionNormalization = 1.0f - exp(-sigmaTrLuminance * Rmax * Rmax);
+		createTables();
+#ifdef _DEBUG
+		float error = MaxTableError();
+		if (error > BSSRDF_TABLE_TOLERANCE)
+			printf("Warning: BSSRDF tables have a relative error of %f\n", error);
+#endif
+	}
+
+	// Fill the lookup tables from the analytic functions
+	void createTables() {
+		RdTable.resize(BSSRDF_TABLE_SIZE + 1);
+		diffusionRadiusSquaredTable.resize(BSSRDF_TABLE_SIZE + 1);
+		diffusionFalloffTable.resize(BSSRDF_TABLE_SIZE + 1);
+		for (int i = 0; i <= BSSRDF_TABLE_SIZE; i++) {
+			float t = (float)i / BSSRDF_TABLE_SIZE;
+			RdTable[i] = DiffuseReflectanceAnalytic(t * Rmax);
+			diffusionRadiusSquaredTable[i] = log(1.0f - t * diffusionNormalization) / -sigmaTrLuminance;
+			diffusionFalloffTable[i] = exp(-sigmaTrLuminance * t * Rmax * Rmax);
+		}
+	}
+
+	// Linearly interpolate a table at t in [0,1]
+	template <typename T>
+	static T lookup(const std::vector<T>& table, float t) {
+		float x = min(max(t, 0.0f), 1.0f) * BSSRDF_TABLE_SIZE;
+		int i = min((int)x, BSSRDF_TABLE_SIZE - 1);
+		float f = x - i;
+		return table[i] * (1.0f - f) + table[i + 1] * f;
+	}
+
+	// Rd -  Diffuse Reflectance due to dipole sources
+	// Looked up from a table within Rmax
+	Vector3 DiffuseReflectance(float r) const {
+		if (r >= Rmax)
+			return DiffuseReflectanceAnalytic(r);
+		return lookup(RdTable, r / Rmax);
+	}
+
+	// Largest relative error of the tables compared to the analytic functions, checked between table entries
+	float MaxTableError() const {
+		float maxError = 0.0f;
+		for (int i = 0; i < BSSRDF_TABLE_SIZE * 4; i++) {
+			float t = (i + 0.5f) / (BSSRDF_TABLE_SIZE * 4);
+			//Rd, relative to its value at the origin so the tail doesn't dominate
+			Vector3 Rd = DiffuseReflectance(t * Rmax);
+			Vector3 exact = DiffuseReflectanceAnalytic(t * Rmax);
+			Vector3 peak = DiffuseReflectanceAnalytic(0.0f);
+			for (int c = 0; c < 3; c++) {
+				if (peak.Get(c) > 0.0f)
+					maxError = max(maxError, fabsf(Rd.Get(c) - exact.Get(c)) / peak.Get(c));
+			}
+			//sampled radius
+			float r = ImportanceSampleDiffusion(0.0f, t).x;
+			float exactR = sqrt(log(1.0f - t * diffusionNormalization) / -sigmaTrLuminance);
+			maxError = max(maxError, fabsf(r - exactR) / Rmax);
+			//pdf
+			float pdf = SampleDiffusionPDF(r, 0.0f);
+			float exactPdf = 1.0f / M_PI * sigmaTrLuminance * exp(-sigmaTrLuminance * r * r) / diffusionNormalization;
+			maxError = max(maxError, fabsf(pdf - exactPdf) / exactPdf);
+		}
+		return maxError;
 	}
 
 	// Rd -  Diffuse Reflectance due to dipole sources
 	// Equation 5.35 in http://www.cs.jhu.edu/~misha/Fall11/Donner.Thesis.pdf
-	Vector3 DiffuseReflectance(float r) {
+	Vector3 DiffuseReflectanceAnalytic(float r) const {
 		//compute distances to dipole sources
 		//positive dipole distance
 		Vector3 dr = ((zr * zr) + r*r).SquareRoot();
@@ -88,32 +173,47 @@ public:
 		return Rd;
 	}
 
+	// Radius beyond which diffuse scattering is negligible
+	float MaxRadius() const {
+		return Rmax;
+	}
+
+	// Average distance light travels before scattering
+	float MeanFreePath() const {
+		return 1.0f / sigmaTPrime.Luminance();
+	}
+
+	// Hash of the input parameters, continuing from hash
+	unsigned long long Hash(unsigned long long hash) const {
+		float parameters[] = { sigmaA.x, sigmaA.y, sigmaA.z, sigmaSPrime.x, sigmaSPrime.y, sigmaSPrime.z, g, eta };
+		return FileUtil::Hash(parameters, sizeof(parameters), hash);
+	}
+
 	// Takes a uniform random from 0 to 1 and gets an exponential falloff
 	// Used for depth along refracted ray
-	float ImportanceSampleSingleScatter(float u) {
-		return -log(u) / sigmaT.Luminance();
+	float ImportanceSampleSingleScatter(float u) const {
+		return -log(u) / sigmaTLuminance;
 	}
 
 	// The PDF for ImportanceSampleSingleScatter at value x
-	float SampleSingleScatterPDF(float x) {
-		return sigmaT.Luminance() * exp(-sigmaT.Luminance() * x);
+	float SampleSingleScatterPDF(float x) const {
+		return sigmaTLuminance * exp(-sigmaTLuminance * x);
 	}
 
 	// Sample a disk with exponential falloff
 	// Within a radius Rmax
-	Vector3 ImportanceSampleDiffusion(float u1, float u2) {
-		float sigmaTrLuminance = sigmaTr.Luminance();
+	Vector3 ImportanceSampleDiffusion(float u1, float u2) const {
 		float theta = 2 * M_PI * u1;
-		//float r = sqrt(log(u2) / -sigmaTrLuminance);
-		float r = sqrt(log(1.0f - u2 * (1.0f - exp(-sigmaTrLuminance * Rmax * Rmax))) / -sigmaTrLuminance);
+		//inverted cdf: r^2 = log(1 - u2 * (1 - exp(-sigmaTr * Rmax^2))) / -sigmaTr
+		float r = sqrt(lookup(diffusionRadiusSquaredTable, u2));
 		return Vector3(r*cos(theta), r*sin(theta), 0.0f);
 	}
 
 	// The PDF for a point chosen at x, y from ImportanceSampleDiffusion
-	float SampleDiffusionPDF(float x, float y) {
-		float sigmaTrLuminance = sigmaTr.Luminance();
-		float pdf = 1.0f/M_PI * sigmaTrLuminance * exp(-sigmaTrLuminance * (x*x + y*y));
-		return pdf / (1.0f - exp(-sigmaTrLuminance * Rmax * Rmax));
+	float SampleDiffusionPDF(float x, float y) const {
+		float rSquared = x*x + y*y;
+		float falloff = (rSquared < Rmax * Rmax) ? lookup(diffusionFalloffTable, rSquared / (Rmax * Rmax)) : exp(-sigmaTrLuminance * rSquared);
+		return 1.0f/M_PI * sigmaTrLuminance * falloff / diffusionNormalization;
 	}
 
 
@@ -36,8 +36,15 @@ public:
 		return (tmax >= tmin && tmax >= 0);
 	}
 
+	// Do the two boxes overlap?
+	bool Overlaps(const BoundingBox& bounds) const {
+		return minCorner.x <= bounds.maxCorner.x && bounds.minCorner.x <= maxCorner.x
+			&& minCorner.y <= bounds.maxCorner.y && bounds.minCorner.y <= maxCorner.y
+			&& minCorner.z <= bounds.maxCorner.z && bounds.minCorner.z <= maxCorner.z;
+	}
+
 	// Get longest axis of the bounding box
-	int LongestAxis() {
+	int LongestAxis() const {
 		Vector3 delta = maxCorner - minCorner;
 		float maxLength = delta.x;
 		int axis = 0;
@@ -52,7 +59,7 @@ public:
 		return axis;
 	}
 
-	Vector3 GetMidpoint() {
+	Vector3 GetMidpoint() const {
 		return (maxCorner + minCorner) * 0.5f;
 	}
 };
\ No newline at end of file
@@ -124,6 +124,23 @@ public:
 
 	}
 
+	// Whether rays start from different points on the lens
+	bool HasDepthOfField() const {
+		return lensRadius > 0.0f;
+	}
+
+	// Get a ray through a point on the image plane from the center of the lens, the same as GetRay without depth of field
+	void GetPinholeRay(float x, float y, Vector3& origin, Vector3& direction) {
+		//convert to [0,1] floating point coordinates
+		float sx = x * (1.0f / imageWidth);
+		float sy = y * (1.0f / imageHeight);
+
+		//point on image plane, the ray goes from it through the center of projection
+		Vector3 P = imageCenter + imageHorizontal * -(2.0f * sx - 1.0f) + imageVertical * (2.0f * sy - 1.0f);
+		origin = position;
+		direction = (position - P).normalize();
+	}
+
 	// Get a ray through a point on the lens and the image plane (thin lens DoF)
 	void GetRay(float x, float y, float u, float v, Vector3& origin, Vector3& direction) {
 		//convert to [0,1] floating point coordinates
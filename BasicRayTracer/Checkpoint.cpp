@@ -0,0 +1,35 @@
+#include "Checkpoint.h"
+#include "FileUtil.h"
+#include <cstring>
+
+bool Checkpoint::Save(const AccumulationBuffer& buffer) const {
+	return FileUtil::WriteAtomically(path.c_str(), "checkpoint", [&](FILE* file) {
+		bool ok = fwrite(CHECKPOINT_MAGIC, 1, 8, file) == 8;
+		ok = ok && fwrite(&sceneHash, sizeof(sceneHash), 1, file) == 1;
+		return ok && buffer.Write(file);
+	});
+}
+
+bool Checkpoint::Load(AccumulationBuffer& buffer) const {
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file == NULL)
+		return false;
+	char magic[8];
+	unsigned long long fileHash;
+	bool ok = fread(magic, 1, 8, file) == 8 && memcmp(magic, CHECKPOINT_MAGIC, 8) == 0;
+	ok = ok && fread(&fileHash, sizeof(fileHash), 1, file) == 1;
+	if (ok && fileHash != sceneHash) {
+		printf("Checkpoint '%s' is from a different scene or settings, ignoring it\n", path.c_str());
+		fclose(file);
+		return false;
+	}
+	ok = ok && buffer.Read(file);
+	fclose(file);
+	if (!ok)
+		printf("Checkpoint '%s' is damaged, ignoring it\n", path.c_str());
+	return ok;
+}
+
+void Checkpoint::Remove() const {
+	remove(path.c_str());
+}
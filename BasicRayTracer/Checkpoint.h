@@ -0,0 +1,28 @@
+#pragma once
+#include "AccumulationBuffer.h"
+#include <string>
+
+// Identifies checkpoint files, change the version when the layout changes
+#define CHECKPOINT_MAGIC "RTCKPT01"
+
+// Saves the state of a render to disk so an interrupted render can be resumed
+// The state is the accumulation buffer: per pixel sums and pass counts, and with them which tile passes are done
+// The samplers need nothing else, the samples of a pass are determined by the pixel and the pass number
+// A hash of the scene and render settings is stored too, so a checkpoint is never resumed into a different render
+class Checkpoint {
+private:
+	std::string path;
+	unsigned long long sceneHash;
+
+public:
+	Checkpoint(const char* path, unsigned long long sceneHash) : path(path), sceneHash(sceneHash) {}
+
+	// Write the buffer to a temporary file and move it over the checkpoint, so a crash while saving leaves the last checkpoint intact
+	bool Save(const AccumulationBuffer& buffer) const;
+
+	// Load the checkpoint into buffer if there is one for the same scene and settings
+	bool Load(AccumulationBuffer& buffer) const;
+
+	// Delete the checkpoint once the render is done
+	void Remove() const;
+};
@@ -0,0 +1,167 @@
+#include "Denoiser.h"
+#include <cfloat>
+
+// Added to the albedo before dividing it out, so black surfaces don't blow up
+static const float DEMODULATE_EPSILON = 0.01f;
+// B3 spline weights of the 5 taps along each axis, from the center out
+static const float KERNEL[3] = { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+Denoiser::Denoiser(const AccumulationBuffer& buffer) {
+	width = buffer.GetWidth();
+	height = buffer.GetHeight();
+	features.resize(width * height);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++)
+			features[y * width + x] = buffer.GetFeatures(x, y);
+	}
+
+	//depth gradient, using the smaller side along each axis so silhouettes don't count
+	depthGradient.resize(width * height, 0.0f);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			int index = y * width + x;
+			float depth = features[index].depth;
+			float gradient = 0.0f;
+			for (int axis = 0; axis < 2; axis++) {
+				float smallest = FLT_MAX;
+				for (int side = -1; side <= 1; side += 2) {
+					int nx = x + (axis == 0 ? side : 0);
+					int ny = y + (axis == 1 ? side : 0);
+					if (nx < 0 || ny < 0 || nx >= width || ny >= height || features[ny * width + nx].coverage < 0.5f)
+						continue;
+					smallest = min(smallest, abs(features[ny * width + nx].depth - depth));
+				}
+				if (smallest < FLT_MAX)
+					gradient = max(gradient, smallest);
+			}
+			depthGradient[index] = gradient;
+		}
+	}
+}
+
+float Denoiser::spatialVariance(const std::vector<Vector3>& image, int x, int y) {
+	float sum = 0.0f, sumSquared = 0.0f;
+	int count = 0;
+	for (int dy = -1; dy <= 1; dy++) {
+		for (int dx = -1; dx <= 1; dx++) {
+			int nx = x + dx, ny = y + dy;
+			if (nx < 0 || ny < 0 || nx >= width || ny >= height)
+				continue;
+			float luminance = image[ny * width + nx].Luminance();
+			sum += luminance;
+			sumSquared += luminance * luminance;
+			count++;
+		}
+	}
+	float mean = sum / count;
+	return max(sumSquared / count - mean * mean, 0.0f);
+}
+
+void Denoiser::filterRows(int yStart, int yEnd, int step, const std::vector<Vector3>& input, const std::vector<float>& inputVariance,
+	std::vector<Vector3>& output, std::vector<float>& outputVariance) {
+	for (int y = yStart; y < yEnd; y++) {
+		for (int x = 0; x < width; x++) {
+			int p = y * width + x;
+			const PixelFeatures& featuresP = features[p];
+			bool backgroundP = featuresP.coverage < 0.5f;
+			float luminanceP = input[p].Luminance();
+
+			//blur the variance a little so a single noisy estimate doesn't stop the filter
+			float variance = 0.0f, varianceWeight = 0.0f;
+			for (int dy = -1; dy <= 1; dy++) {
+				for (int dx = -1; dx <= 1; dx++) {
+					int nx = x + dx, ny = y + dy;
+					if (nx < 0 || ny < 0 || nx >= width || ny >= height)
+						continue;
+					float h = KERNEL[abs(dx)] * KERNEL[abs(dy)];
+					variance += inputVariance[ny * width + nx] * h;
+					varianceWeight += h;
+				}
+			}
+			float colorScale = DENOISE_COLOR_SIGMA * sqrt(variance / varianceWeight) + 1e-4f;
+
+			Vector3 sum;
+			float weightSum = 0.0f, varianceSum = 0.0f;
+			for (int dy = -2; dy <= 2; dy++) {
+				for (int dx = -2; dx <= 2; dx++) {
+					int qx = x + dx * step, qy = y + dy * step;
+					if (qx < 0 || qy < 0 || qx >= width || qy >= height)
+						continue;
+					int q = qy * width + qx;
+					float weight = KERNEL[abs(dx)] * KERNEL[abs(dy)];
+
+					if (q != p) {
+						//never mix surfaces with the background
+						const PixelFeatures& featuresQ = features[q];
+						if (backgroundP != (featuresQ.coverage < 0.5f))
+							continue;
+						if (!backgroundP) {
+							//normal
+							weight *= pow(max(featuresP.normal.dot(featuresQ.normal), 0.0f), DENOISE_NORMAL_SIGMA);
+							//depth, allowing for the slope of the surface over the distance to the tap
+							float distance = step * sqrt((float)(dx * dx + dy * dy));
+							float depthScale = DENOISE_DEPTH_SIGMA * depthGradient[p] * distance + 1e-3f * featuresP.depth;
+							weight *= exp(-abs(featuresP.depth - featuresQ.depth) / depthScale);
+							//albedo
+							Vector3 albedoDifference = featuresP.albedo - featuresQ.albedo;
+							weight *= exp(-albedoDifference.dot(albedoDifference) / (DENOISE_ALBEDO_SIGMA * DENOISE_ALBEDO_SIGMA));
+						}
+						//brightness, relative to the noise level
+						weight *= exp(-abs(luminanceP - input[q].Luminance()) / colorScale);
+					}
+
+					sum += input[q] * weight;
+					weightSum += weight;
+					varianceSum += weight * weight * inputVariance[q];
+				}
+			}
+			//the center tap is always included so weightSum > 0
+			output[p] = sum / weightSum;
+			outputVariance[p] = varianceSum / (weightSum * weightSum);
+		}
+	}
+}
+
+void Denoiser::Denoise(const AccumulationBuffer& buffer, FrameBuffer* frameBuffer) {
+	int numPixels = width * height;
+	std::vector<Vector3> image(numPixels), filtered(numPixels);
+	std::vector<float> variance(numPixels), filteredVariance(numPixels);
+
+	//divide out the albedo, so only the lighting gets filtered
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			int index = y * width + x;
+			Vector3 albedo = features[index].albedo + DEMODULATE_EPSILON;
+			image[index] = buffer.GetColor(x, y) / albedo;
+			float albedoLuminance = albedo.Luminance();
+			variance[index] = buffer.GetVariance(x, y) / (albedoLuminance * albedoLuminance);
+		}
+	}
+	//pixels with a single pass have no variance estimate, use their neighbourhood instead
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			if (variance[y * width + x] < 0.0f)
+				variance[y * width + x] = spatialVariance(image, x, y);
+		}
+	}
+
+	//each iteration doubles the distance between taps
+	for (int iteration = 0; iteration < DENOISE_ITERATIONS; iteration++) {
+		int step = 1 << iteration;
+		int numTasks = (height + DENOISE_ROWS_PER_TASK - 1) / DENOISE_ROWS_PER_TASK;
+		TaskScheduler::Get().ParallelFor(0, numTasks, 1, [&](int task) {
+			int y = task * DENOISE_ROWS_PER_TASK;
+			filterRows(y, min(y + DENOISE_ROWS_PER_TASK, height), step, image, variance, filtered, filteredVariance);
+		});
+		image.swap(filtered);
+		variance.swap(filteredVariance);
+	}
+
+	//put the albedo back
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			int index = y * width + x;
+			frameBuffer->SetColor(x, y, image[index] * (features[index].albedo + DEMODULATE_EPSILON));
+		}
+	}
+}
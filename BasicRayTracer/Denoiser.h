@@ -0,0 +1,46 @@
+#pragma once
+#include "AccumulationBuffer.h"
+#include "TaskScheduler.h"
+#include <vector>
+
+// Number of a-trous iterations, the filter covers (4 * 2^iterations + 1) pixels across
+#define DENOISE_ITERATIONS 5
+// How strongly differences in brightness stop the filter, in standard deviations of the pixel noise
+#define DENOISE_COLOR_SIGMA 4.0f
+// Exponent of the cosine between normals, higher preserves more geometric detail
+#define DENOISE_NORMAL_SIGMA 128.0f
+// How strongly depth differences stop the filter, relative to the local depth gradient
+#define DENOISE_DEPTH_SIGMA 1.0f
+// How strongly albedo differences stop the filter
+#define DENOISE_ALBEDO_SIGMA 0.1f
+// Rows of the image filtered by one task
+#define DENOISE_ROWS_PER_TASK 16
+
+// Edge-avoiding a-trous wavelet filter guided by first hit albedo, normal and depth
+// The image is divided by the albedo first so only the lighting is blurred and texture detail is kept,
+// and the color weight is scaled by each pixel's estimated noise so converged areas are left alone
+// See Dammertz et al. 2010, "Edge-Avoiding A-Trous Wavelet Transform for fast Global Illumination Filtering"
+// and Schied et al. 2017, "Spatiotemporal Variance-Guided Filtering"
+class Denoiser {
+private:
+	int width, height;
+
+	// Features of every pixel
+	std::vector<PixelFeatures> features;
+	// Largest change in depth to a neighbouring pixel
+	std::vector<float> depthGradient;
+
+	// Filter rows [yStart, yEnd) with the given step between taps
+	void filterRows(int yStart, int yEnd, int step, const std::vector<Vector3>& input, const std::vector<float>& inputVariance,
+		std::vector<Vector3>& output, std::vector<float>& outputVariance);
+
+	// Estimate the variance at pixel (x,y) from its 3x3 neighbourhood, for pixels with a single pass
+	float spatialVariance(const std::vector<Vector3>& image, int x, int y);
+
+public:
+	// Set up the denoiser with the features of a rendered image
+	Denoiser(const AccumulationBuffer& buffer);
+
+	// Filter the image in buffer using the threads of the task scheduler and put the result in frameBuffer
+	void Denoise(const AccumulationBuffer& buffer, FrameBuffer* frameBuffer);
+};
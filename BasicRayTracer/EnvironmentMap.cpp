@@ -0,0 +1,111 @@
+#include "EnvironmentMap.h"
+#include "stb_image.h"
+#include <algorithm>
+#include <cstdio>
+#define _USE_MATH_DEFINES
+#include <cmath>
+
+Distribution1D::Distribution1D(const float* values, int n) : func(values, values + n), cdf(n + 1) {
+	cdf[0] = 0.0f;
+	for (int i = 0; i < n; i++)
+		cdf[i + 1] = cdf[i] + func[i] / n;
+	integral = cdf[n];
+	//normalize, or fall back to uniform if there is nothing to sample
+	for (int i = 1; i <= n; i++)
+		cdf[i] = (integral > 0.0f) ? cdf[i] / integral : (float)i / n;
+}
+
+float Distribution1D::Sample(float u, float& pdf, int& piece) const {
+	int n = func.size();
+	//last piece whose cdf is <= u
+	piece = std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin() - 1;
+	piece = max(0, min(piece, n - 1));
+	pdf = (integral > 0.0f) ? func[piece] / integral : 1.0f;
+	//position within the piece
+	float width = cdf[piece + 1] - cdf[piece];
+	float offset = (width > 0.0f) ? (u - cdf[piece]) / width : 0.0f;
+	return min((piece + offset) / n, 0.99999994f);
+}
+
+EnvironmentMap::EnvironmentMap(const char* filePath, float intensity) : width(0), height(0) {
+	int n;
+	float* data = stbi_loadf(filePath, &width, &height, &n, 3);
+	if (data == NULL) {
+		printf("Error loading environment map \"%s\"\n", filePath);
+		width = height = 0;
+		return;
+	}
+	pixels.resize(width * height);
+	for (int i = 0; i < width * height; i++)
+		pixels[i] = Vector3(data[i * 3 + 0], data[i * 3 + 1], data[i * 3 + 2]) * intensity;
+	stbi_image_free(data);
+
+	//rows near the poles cover less of the sphere
+	std::vector<float> weights(width), rowWeights(height);
+	for (int y = 0; y < height; y++) {
+		float sinTheta = sin(M_PI * (y + 0.5f) / height);
+		for (int x = 0; x < width; x++)
+			weights[x] = pixels[y * width + x].Luminance() * sinTheta;
+		conditional.push_back(Distribution1D(weights.data(), width));
+		rowWeights[y] = conditional.back().integral;
+	}
+	marginal = Distribution1D(rowWeights.data(), height);
+	printf("Environment map: %d x %d\n", width, height);
+}
+
+void EnvironmentMap::directionToUV(const Vector3& direction, float& u, float& v) const {
+	Vector3 d = direction.normalize();
+	float theta = acos(max(-1.0f, min(d.y, 1.0f)));
+	float phi = atan2(d.z, d.x);
+	u = phi / (2.0f * M_PI) + 0.5f;
+	v = theta / M_PI;
+}
+
+Vector3 EnvironmentMap::uvToDirection(float u, float v) const {
+	float phi = (u - 0.5f) * 2.0f * M_PI;
+	float theta = v * M_PI;
+	float sinTheta = sin(theta);
+	return Vector3(sinTheta * cos(phi), cos(theta), sinTheta * sin(phi));
+}
+
+Vector3 EnvironmentMap::Lookup(const Vector3& direction) const {
+	if (pixels.empty())
+		return Vector3();
+	float u, v;
+	directionToUV(direction, u, v);
+	int x = max(0, min((int)(u * width), width - 1));
+	int y = max(0, min((int)(v * height), height - 1));
+	return pixels[y * width + x];
+}
+
+Vector3 EnvironmentMap::Sample(float u1, float u2, Vector3& direction, float& pdf) const {
+	pdf = 0.0f;
+	if (pixels.empty() || marginal.integral <= 0.0f)
+		return Vector3();
+	//pick a row, then a pixel in it
+	float rowPdf, columnPdf;
+	int y, x;
+	float v = marginal.Sample(u1, rowPdf, y);
+	float u = conditional[y].Sample(u2, columnPdf, x);
+
+	direction = uvToDirection(u, v);
+	float sinTheta = sin(v * M_PI);
+	if (sinTheta <= 0.0f)
+		return Vector3();
+	//from density over the image to density over solid angle
+	pdf = rowPdf * columnPdf / (2.0f * M_PI * M_PI * sinTheta);
+	return pixels[y * width + x];
+}
+
+float EnvironmentMap::Pdf(const Vector3& direction) const {
+	if (pixels.empty() || marginal.integral <= 0.0f)
+		return 0.0f;
+	float u, v;
+	directionToUV(direction, u, v);
+	float sinTheta = sin(v * M_PI);
+	if (sinTheta <= 0.0f)
+		return 0.0f;
+	int x = max(0, min((int)(u * width), width - 1));
+	int y = max(0, min((int)(v * height), height - 1));
+	return conditional[y].func[x] / marginal.integral / (2.0f * M_PI * M_PI * sinTheta);
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include "Vector3.h"
+#include "FileUtil.h"
+#include <vector>
+
+// Piecewise constant distribution over [0,1) with one piece per function value
+// Sampled by inverting its CDF, so stratified random numbers stay stratified
+struct Distribution1D {
+	std::vector<float> func;
+	// cdf[i] is the probability of falling before piece i, with cdf[n] = 1
+	std::vector<float> cdf;
+	// Integral of func over [0,1)
+	float integral;
+
+	Distribution1D() : integral(0.0f) {}
+	// Build from n non-negative values, a function that is zero everywhere is sampled uniformly
+	Distribution1D(const float* values, int n);
+
+	// Map a uniform random number u in [0,1) to a point in [0,1), outputs the density there and the piece it fell in
+	float Sample(float u, float& pdf, int& piece) const;
+};
+
+// Light arriving from infinitely far away in every direction, read from a latitude-longitude image
+// +y is up: the top row of the image is straight up and the middle column of the image is +x
+// Directions are sampled proportionally to the luminance of their pixel (times sin(theta) for the area of the row on the sphere)
+// through a marginal distribution over rows and a conditional distribution over the pixels of each row
+class EnvironmentMap {
+private:
+	int width, height;
+	// Linear radiance, width * height pixels
+	std::vector<Vector3> pixels;
+
+	// Distribution over rows, and over the pixels of each row
+	Distribution1D marginal;
+	std::vector<Distribution1D> conditional;
+
+	// Image coordinates in [0,1) of a direction, and back
+	void directionToUV(const Vector3& direction, float& u, float& v) const;
+	Vector3 uvToDirection(float u, float v) const;
+
+public:
+	// Load an image stb_image can read (.hdr for high dynamic range) and scale its radiance by intensity
+	EnvironmentMap(const char* filePath, float intensity = 1.0f);
+
+	// Whether the image was loaded, an environment that failed to load is black
+	bool IsValid() const {
+		return !pixels.empty();
+	}
+
+	// Radiance arriving from direction
+	Vector3 Lookup(const Vector3& direction) const;
+
+	// Pick a direction by brightness from two uniform random numbers
+	// Outputs its radiance and solid angle pdf, the pdf is 0 for directions that can't be sampled
+	Vector3 Sample(float u1, float u2, Vector3& direction, float& pdf) const;
+
+	// Solid angle pdf of Sample choosing direction
+	float Pdf(const Vector3& direction) const;
+
+	// Hash of the image (with its intensity), continuing from hash
+	unsigned long long Hash(unsigned long long hash) const {
+		int size[] = { width, height };
+		hash = FileUtil::Hash(size, sizeof(size), hash);
+		return FileUtil::Hash(pixels.data(), pixels.size() * sizeof(Vector3), hash);
+	}
+};
@@ -0,0 +1,34 @@
+#include "FileUtil.h"
+#include <Windows.h>
+#include <string>
+
+unsigned long long FileUtil::HashFile(const char* fileName, unsigned long long hash) {
+	FILE* file = fopen(fileName, "rb");
+	if (file == NULL)
+		return hash;
+	char block[4096];
+	size_t size;
+	while ((size = fread(block, 1, sizeof(block), file)) > 0)
+		hash = Hash(block, size, hash);
+	fclose(file);
+	return hash;
+}
+
+bool FileUtil::WriteAtomically(const char* path, const char* description, const std::function<bool(FILE*)>& write) {
+	std::string tempPath = std::string(path) + ".tmp";
+	FILE* file = fopen(tempPath.c_str(), "wb");
+	if (file == NULL) {
+		printf("Could not write %s '%s'\n", description, tempPath.c_str());
+		return false;
+	}
+	bool ok = write(file);
+	ok = (fflush(file) == 0) && ok;
+	ok = (fclose(file) == 0) && ok;
+	//only replace the last file with a complete one
+	if (!ok || !MoveFileExA(tempPath.c_str(), path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+		printf("Could not write %s '%s'\n", description, path);
+		remove(tempPath.c_str());
+		return false;
+	}
+	return true;
+}
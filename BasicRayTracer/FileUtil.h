@@ -0,0 +1,29 @@
+#pragma once
+#include <cstdio>
+#include <functional>
+
+// Starting value of Hash and HashFile
+#define FNV_OFFSET_BASIS 14695981039346656037ull
+#define FNV_PRIME 1099511628211ull
+
+// Helpers shared by the files the renderer saves between runs (checkpoints, lightmaps, visibility caches)
+class FileUtil {
+public:
+	// FNV-1a hash of size bytes at data, continuing from hash
+	static unsigned long long Hash(const void* data, size_t size, unsigned long long hash = FNV_OFFSET_BASIS) {
+		const unsigned char* bytes = (const unsigned char*)data;
+		for (size_t i = 0; i < size; i++) {
+			hash ^= bytes[i];
+			hash *= FNV_PRIME;
+		}
+		return hash;
+	}
+
+	// Hash of the contents of a file, continuing from hash
+	static unsigned long long HashFile(const char* fileName, unsigned long long hash = FNV_OFFSET_BASIS);
+
+	// Write a file with write(file) into a temporary file and move it over path once it is complete,
+	// so a crash while saving leaves the previous file intact
+	// description names the file in error messages, returns false if anything failed
+	static bool WriteAtomically(const char* path, const char* description, const std::function<bool(FILE*)>& write);
+};
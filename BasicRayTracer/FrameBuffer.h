@@ -1,5 +1,6 @@
 #pragma once
 #include "stb_image_write.h"
+#include "Vector3.h"
 
 typedef unsigned char u08;
 
@@ -29,6 +30,14 @@ public:
 		return (image + (y * width + x) * 3);
 	}
 
+	// Quantize a color to 8 bits and store it at pixel (x,y)
+	void SetColor(int x, int y, const Vector3& color) {
+		u08* pixel = getPixelPtr(x, y);
+		pixel[0] = (u08)(255.0f * max(min(color.x, 1.0f), 0.0f));
+		pixel[1] = (u08)(255.0f * max(min(color.y, 1.0f), 0.0f));
+		pixel[2] = (u08)(255.0f * max(min(color.z, 1.0f), 0.0f));
+	}
+
 	// Write out image to file
 	void SaveToFile(const char* path) {
 		stbi_write_bmp(path, width, height, 3, image);
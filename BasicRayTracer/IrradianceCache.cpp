@@ -0,0 +1,104 @@
+#include "IrradianceCache.h"
+#include <mutex>
+
+IrradianceCache::Node::Node(const Vector3& center, float halfSize) : center(center), halfSize(halfSize) {
+	for (int i = 0; i < 8; i++)
+		children[i] = NULL;
+}
+
+IrradianceCache::Node::~Node() {
+	for (int i = 0; i < 8; i++)
+		delete children[i];
+}
+
+IrradianceCache::IrradianceCache(const BoundingBox& sceneBounds) : numRecords(0) {
+	//make the root a cube so children stay cubes
+	BoundingBox bounds = sceneBounds;
+	float sceneSize = (bounds.maxCorner - bounds.minCorner).MaxComponent();
+	root = new Node(bounds.GetMidpoint(), sceneSize * 0.5f);
+	minSpacing = sceneSize * IRRADIANCE_CACHE_MIN_SPACING;
+	maxSpacing = sceneSize * IRRADIANCE_CACHE_MAX_SPACING;
+}
+
+IrradianceCache::~IrradianceCache() {
+	delete root;
+}
+
+void IrradianceCache::Add(IrradianceRecord record) {
+	record.radius = min(max(record.radius, minSpacing), maxSpacing);
+	//records are used up to this distance away
+	float influence = record.radius * IRRADIANCE_CACHE_ERROR;
+
+	std::unique_lock<std::shared_timed_mutex> lock(mutex);
+	//go down to the smallest node at least as big as the area of influence
+	Node* node = root;
+	for (int depth = 0; depth < IRRADIANCE_CACHE_MAX_DEPTH && node->halfSize * 0.5f >= influence; depth++) {
+		int octant = 0;
+		Vector3 childCenter = node->center;
+		float childHalfSize = node->halfSize * 0.5f;
+		for (int axis = 0; axis < 3; axis++) {
+			if (record.position.Get(axis) >= node->center.Get(axis)) {
+				octant |= 1 << axis;
+				childCenter.Set(axis, childCenter.Get(axis) + childHalfSize);
+			}
+			else {
+				childCenter.Set(axis, childCenter.Get(axis) - childHalfSize);
+			}
+		}
+		if (node->children[octant] == NULL)
+			node->children[octant] = new Node(childCenter, childHalfSize);
+		node = node->children[octant];
+	}
+	node->records.push_back(record);
+	numRecords++;
+}
+
+bool IrradianceCache::Lookup(const Vector3& position, const Vector3& normal, Vector3& irradiance) const {
+	std::shared_lock<std::shared_timed_mutex> lock(mutex);
+	Vector3 sum;
+	float totalWeight = 0.0f;
+	lookupNode(root, position, normal, sum, totalWeight);
+	if (totalWeight <= 0.0f)
+		return false;
+	irradiance = sum / totalWeight;
+	//extrapolating with the gradients can overshoot
+	irradiance = Vector3(max(irradiance.x, 0.0f), max(irradiance.y, 0.0f), max(irradiance.z, 0.0f));
+	return true;
+}
+
+void IrradianceCache::lookupNode(const Node* node, const Vector3& position, const Vector3& normal, Vector3& irradiance, float& totalWeight) const {
+	for (int i = 0; i < node->records.size(); i++) {
+		const IrradianceRecord& record = node->records[i];
+		Vector3 offset = position - record.position;
+		float distance = offset.length();
+		//records in front of the point may be blocked from it
+		if (offset.dot(normal + record.normal) * 0.5f < -0.05f * record.radius)
+			continue;
+		//estimated error from moving and rotating away from the record
+		float error = distance / record.radius + sqrt(max(1.0f - normal.dot(record.normal), 0.0f));
+		if (error >= IRRADIANCE_CACHE_ERROR)
+			continue;
+		float weight = (error > 0.0f) ? 1.0f / error : 1e6f;
+
+		//first order extrapolation of each channel
+		Vector3 rotation = record.normal.cross(normal);
+		Vector3 extrapolated;
+		for (int channel = 0; channel < 3; channel++) {
+			float value = record.irradiance.Get(channel) + rotation.dot(record.rotationalGradient[channel]) + offset.dot(record.translationalGradient[channel]);
+			extrapolated.Set(channel, value);
+		}
+		irradiance += extrapolated * weight;
+		totalWeight += weight;
+	}
+
+	//records in a child are at most its size away from it
+	for (int i = 0; i < 8; i++) {
+		const Node* child = node->children[i];
+		if (child == NULL)
+			continue;
+		Vector3 offset = position - child->center;
+		float reach = child->halfSize * 2.0f;
+		if (abs(offset.x) <= reach && abs(offset.y) <= reach && abs(offset.z) <= reach)
+			lookupNode(child, position, normal, irradiance, totalWeight);
+	}
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include "BoundingBox.h"
+#include <vector>
+#include <shared_mutex>
+#include <atomic>
+
+// Largest interpolation error allowed, smaller values create more records
+#define IRRADIANCE_CACHE_ERROR 0.2f
+// Limits on the distance between records, as fractions of the size of the scene
+#define IRRADIANCE_CACHE_MIN_SPACING 0.002f
+#define IRRADIANCE_CACHE_MAX_SPACING 0.1f
+// Max depth of the octree
+#define IRRADIANCE_CACHE_MAX_DEPTH 20
+
+// Indirect irradiance sampled at one point, with its gradients for interpolating to nearby points
+struct IrradianceRecord {
+	Vector3 position;
+	Vector3 normal;
+	// Irradiance from all other surfaces (light sources excluded)
+	Vector3 irradiance;
+	// Harmonic mean distance to the surfaces seen from the record, controls how far it is reused
+	float radius;
+	// Change in irradiance of each color channel as the normal rotates and as the position moves
+	Vector3 rotationalGradient[3];
+	Vector3 translationalGradient[3];
+};
+
+// World-space octree of sparse irradiance records, filled lazily while rendering
+// Lookups interpolate all records whose estimated error at the point is small enough
+// Safe to use from all render threads: lookups share the tree and additions lock it
+// See Ward et al. 1988, "A Ray Tracing Solution for Diffuse Interreflection"
+// and Ward and Heckbert 1992, "Irradiance Gradients"
+class IrradianceCache {
+private:
+	struct Node {
+		Vector3 center;
+		float halfSize;
+		// Records whose area of influence fits this node but not its children
+		std::vector<IrradianceRecord> records;
+		// Children, NULL until a record is added below
+		Node* children[8];
+
+		Node(const Vector3& center, float halfSize);
+		~Node();
+	};
+
+	Node* root;
+	// Distances between records are clamped to these
+	float minSpacing, maxSpacing;
+	std::atomic<int> numRecords;
+	mutable std::shared_timed_mutex mutex;
+
+	// Recursive function to sum up the weighted records of a node and its children
+	void lookupNode(const Node* node, const Vector3& position, const Vector3& normal, Vector3& irradiance, float& totalWeight) const;
+
+public:
+	// Create an empty cache covering sceneBounds
+	IrradianceCache(const BoundingBox& sceneBounds);
+	~IrradianceCache();
+
+	// Interpolate the irradiance at position from the cached records
+	// Returns false if no record is close enough, then a new one should be computed and added
+	bool Lookup(const Vector3& position, const Vector3& normal, Vector3& irradiance) const;
+
+	// Add a record, its radius gets clamped to the allowed spacing
+	void Add(IrradianceRecord record);
+
+	int NumRecords() const {
+		return numRecords.load();
+	}
+};
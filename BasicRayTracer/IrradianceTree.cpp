@@ -0,0 +1,139 @@
+#include "IrradianceTree.h"
+
+IrradianceTree::IrradianceTree(BSSRDF* bssrdf, const std::vector<IrradianceSample>& samples) : bssrdf(bssrdf), samples(samples) {
+	if (this->samples.empty())
+		return;
+
+	//bounds of all samples, made into a cube so children stay cubes
+	BoundingBox bounds;
+	bounds.minCorner = bounds.maxCorner = this->samples[0].position;
+	for (int i = 1; i < this->samples.size(); i++) {
+		BoundingBox point;
+		point.minCorner = point.maxCorner = this->samples[i].position;
+		bounds.Expand(point);
+	}
+	Vector3 center = bounds.GetMidpoint();
+	float halfSize = (bounds.maxCorner - bounds.minCorner).MaxComponent() * 0.5f;
+	bounds.minCorner = center - halfSize;
+	bounds.maxCorner = center + halfSize;
+
+	buildNode(bounds, 0, this->samples.size(), 0);
+}
+
+int IrradianceTree::buildNode(const BoundingBox& bounds, int start, int end, int depth) {
+	int index = nodes.size();
+	nodes.push_back(Node());
+	Node node;
+	node.bounds = bounds;
+	for (int i = 0; i < 8; i++)
+		node.children[i] = -1;
+	node.firstSample = start;
+	node.numSamples = 0;
+
+	//aggregate all samples in this node
+	node.area = 0.0f;
+	Vector3 power;
+	Vector3 weightedPosition;
+	float totalWeight = 0.0f;
+	for (int i = start; i < end; i++) {
+		node.area += samples[i].area;
+		power += samples[i].irradiance * samples[i].area;
+		//weight position by the light arriving there, like Jensen and Buhler
+		float weight = samples[i].irradiance.Luminance() * samples[i].area;
+		weightedPosition += samples[i].position * weight;
+		totalWeight += weight;
+	}
+	node.irradiance = (node.area > 0.0f) ? power / node.area : Vector3();
+	if (totalWeight > 0.0f) {
+		node.position = weightedPosition / totalWeight;
+	}
+	else {
+		//unlit, any point will do
+		node.position = Vector3();
+		for (int i = start; i < end; i++)
+			node.position += samples[i].position / (float)(end - start);
+	}
+
+	if (end - start <= IRRADIANCE_TREE_LEAF_SIZE || depth >= IRRADIANCE_TREE_MAX_DEPTH) {
+		//leaf
+		node.numSamples = end - start;
+		nodes[index] = node;
+		return index;
+	}
+
+	//split into octants: partition on x, then each half on y, then each quarter on z
+	Vector3 center = node.bounds.GetMidpoint();
+	int splits[9];
+	splits[0] = start;
+	splits[8] = end;
+	splits[4] = std::partition(samples.begin() + splits[0], samples.begin() + splits[8], [&](const IrradianceSample& s) { return s.position.x < center.x; }) - samples.begin();
+	for (int half = 0; half < 2; half++) {
+		int lo = half * 4, hi = half * 4 + 4;
+		splits[lo + 2] = std::partition(samples.begin() + splits[lo], samples.begin() + splits[hi], [&](const IrradianceSample& s) { return s.position.y < center.y; }) - samples.begin();
+	}
+	for (int quarter = 0; quarter < 4; quarter++) {
+		int lo = quarter * 2, hi = quarter * 2 + 2;
+		splits[lo + 1] = std::partition(samples.begin() + splits[lo], samples.begin() + splits[hi], [&](const IrradianceSample& s) { return s.position.z < center.z; }) - samples.begin();
+	}
+
+	//create children
+	for (int octant = 0; octant < 8; octant++) {
+		if (splits[octant + 1] == splits[octant])
+			continue;
+		//bit 2 is x, bit 1 is y, bit 0 is z
+		BoundingBox childBounds;
+		for (int axis = 0; axis < 3; axis++) {
+			bool upper = (octant >> (2 - axis)) & 1;
+			childBounds.minCorner.Set(axis, upper ? center.Get(axis) : node.bounds.minCorner.Get(axis));
+			childBounds.maxCorner.Set(axis, upper ? node.bounds.maxCorner.Get(axis) : center.Get(axis));
+		}
+		node.children[octant] = buildNode(childBounds, splits[octant], splits[octant + 1], depth + 1);
+	}
+
+	nodes[index] = node;
+	return index;
+}
+
+Vector3 IrradianceTree::queryNode(int index, const Vector3& position) const {
+	const Node& node = nodes[index];
+
+	//skip nodes that are too far away to contribute
+	Vector3 closest;
+	for (int axis = 0; axis < 3; axis++)
+		closest.Set(axis, min(max(position.Get(axis), node.bounds.minCorner.Get(axis)), node.bounds.maxCorner.Get(axis)));
+	float boundsDistance = (closest - position).length();
+	if (boundsDistance > bssrdf->MaxRadius())
+		return Vector3();
+
+	//leaf: add up all samples
+	if (node.numSamples > 0) {
+		Vector3 sum;
+		for (int i = node.firstSample; i < node.firstSample + node.numSamples; i++) {
+			float r = (samples[i].position - position).length();
+			sum += bssrdf->DiffuseReflectance(r) * samples[i].irradiance * samples[i].area;
+		}
+		return sum;
+	}
+
+	//far enough away to treat as one sample?
+	if (boundsDistance > 0.0f) {
+		Vector3 offset = node.position - position;
+		float distanceSquared = offset.dot(offset);
+		if (node.area < IRRADIANCE_TREE_MAX_SOLID_ANGLE * distanceSquared)
+			return bssrdf->DiffuseReflectance(sqrt(distanceSquared)) * node.irradiance * node.area;
+	}
+
+	//no, use children
+	Vector3 sum;
+	for (int i = 0; i < 8; i++) {
+		if (node.children[i] >= 0)
+			sum += queryNode(node.children[i], position);
+	}
+	return sum;
+}
+
+Vector3 IrradianceTree::GetDiffuseExitance(const Vector3& position) const {
+	if (nodes.empty())
+		return Vector3();
+	return queryNode(0, position);
+}
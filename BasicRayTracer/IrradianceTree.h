@@ -0,0 +1,63 @@
+#pragma once
+#include "BSSRDF.h"
+#include "BoundingBox.h"
+#include <vector>
+
+// Max samples in a leaf of the tree
+#define IRRADIANCE_TREE_LEAF_SIZE 8
+// Max depth of the tree
+#define IRRADIANCE_TREE_MAX_DEPTH 20
+// A cluster is used instead of its samples when its area divided by the squared distance is below this
+#define IRRADIANCE_TREE_MAX_SOLID_ANGLE 0.5f
+
+// A point on the surface of a translucent object and the light arriving there
+struct IrradianceSample {
+	Vector3 position;
+	Vector3 normal;
+	// Irradiance transmitted into the surface (includes the Fresnel transmittance)
+	Vector3 irradiance;
+	// Surface area this sample stands for
+	float area;
+};
+
+// An octree over irradiance samples of one translucent object
+// Each node stores an aggregate of all samples below it so distant clusters can be evaluated as a single sample
+// See Jensen and Buhler 2002, "A Rapid Hierarchical Rendering Technique for Translucent Materials"
+class IrradianceTree {
+private:
+	struct Node {
+		BoundingBox bounds;
+		// Irradiance weighted center of all samples below
+		Vector3 position;
+		// Area weighted average irradiance of all samples below
+		Vector3 irradiance;
+		// Total area of all samples below
+		float area;
+		// Children (indices into nodes), -1 if empty or a leaf
+		int children[8];
+		// Samples in this node if it is a leaf
+		int firstSample, numSamples;
+	};
+
+	BSSRDF* bssrdf;
+	std::vector<IrradianceSample> samples;
+	std::vector<Node> nodes;
+
+	// Recursive function to build a node for samples[start, end)
+	int buildNode(const BoundingBox& bounds, int start, int end, int depth);
+
+	// Recursive function to sum up the contribution of a node
+	Vector3 queryNode(int index, const Vector3& position) const;
+
+public:
+	// Build the tree for the given samples
+	IrradianceTree(BSSRDF* bssrdf, const std::vector<IrradianceSample>& samples);
+
+	// Sum of Rd(r) * E * area over all samples around position
+	// Multiply by the exitant Fresnel transmittance / pi to get outgoing radiance
+	Vector3 GetDiffuseExitance(const Vector3& position) const;
+
+	int NumSamples() const {
+		return samples.size();
+	}
+};
@@ -1,7 +1,10 @@
 #include "KDTree.h"
+#include "TaskScheduler.h"
+#include <xmmintrin.h>
 
 KDTree::KDTree(const std::vector<Primitive*>& primitives) {
 	//recursively build tree
+	maxDepth = 0;
 	root = makeNode(primitives, 0);
 }
 
@@ -18,8 +21,13 @@ KDTree::~KDTree() {
 
 	//create node containing all of the triangles
 	KDNode* node = new KDNode();
-	nodePrimitives.push_back(primitives);
-	node->primitivesIndex = nodePrimitives.size() - 1;
+	{
+		std::lock_guard<std::mutex> guard(buildMutex);
+		if (depth > maxDepth)
+			maxDepth = depth;
+		nodePrimitives.push_back(primitives);
+		node->primitivesIndex = nodePrimitives.size() - 1;
+	}
 
 	//one primitive: create bounds for that primitive and finish
 	if (primitives.size() == 1) {
@@ -71,9 +79,19 @@ KDTree::~KDTree() {
 
 	//do we need to keep going?
 	if (sharedCount < STOP_PERCENT * left.size() && sharedCount < STOP_PERCENT * right.size()) {
-		//yes, create left and right nodes recursively
-		node->left = makeNode(left, depth + 1);
-		node->right = makeNode(right, depth + 1);
+		//yes, create left and right nodes recursively, side by side for large nodes
+		if (primitives.size() >= KDTREE_PARALLEL_MIN_PRIMITIVES) {
+			TaskGroup group;
+			group.Run([this, node, &left, depth]() {
+				node->left = makeNode(left, depth + 1);
+			});
+			node->right = makeNode(right, depth + 1);
+			group.Wait();
+		}
+		else {
+			node->left = makeNode(left, depth + 1);
+			node->right = makeNode(right, depth + 1);
+		}
 
 		//get overall bounds of all primitives in this node
 		node->bounds = node->left->bounds;
@@ -127,7 +145,7 @@ KDTree::~KDTree() {
 	 return false;
  }
 
- void KDTree::traceShadowNode(KDNode* node, const Vector3& origin, const Vector3& direction, const Vector3& invDirection, Vector3& shadowFactor, float maxDist) {
+ bool KDTree::traceShadowNode(KDNode* node, const Vector3& origin, const Vector3& direction, const Vector3& invDirection, Vector3& shadowFactor, float maxDist, Primitive** occluder) {
 	 //does ray intersect this node's bounds?
 	 if (node->bounds.intersects(origin, invDirection)) {
 		 //if this a leaf?
@@ -138,7 +156,9 @@ KDTree::~KDTree() {
 					 //fully opaque? block all light
 					 if (thisHitData.material.ktran < 0.01f) {
 						 shadowFactor = Vector3(0, 0, 0);
-						 return;
+						 if (occluder != NULL)
+							 *occluder = nodePrimitives[node->primitivesIndex][i];
+						 return true;
 					 }
 					 //normalize Cd
 					 float normFactor = thisHitData.material.diffColor.MaxComponent();
@@ -150,13 +170,14 @@ KDTree::~KDTree() {
 			 }
 		 }
 		 else {
-			 //not a leaf, keep traversing
-			 if (node->left != NULL)
-				 traceShadowNode(node->left, origin, direction, invDirection, shadowFactor, maxDist);
-			 if (node->right != NULL)
-				 traceShadowNode(node->right, origin, direction, invDirection, shadowFactor, maxDist);
+			 //not a leaf, keep traversing until the ray is blocked
+			 if (node->left != NULL && traceShadowNode(node->left, origin, direction, invDirection, shadowFactor, maxDist, occluder))
+				 return true;
+			 if (node->right != NULL && traceShadowNode(node->right, origin, direction, invDirection, shadowFactor, maxDist, occluder))
+				 return true;
 		 }
 	 }
+	 return false;
  }
 
  bool KDTree::GetClosestIntersection(const Vector3 & origin, const Vector3 & direction, HitData & hitData, Object** hitObject) {
@@ -170,7 +191,80 @@ KDTree::~KDTree() {
 	 return intersectsNode(root, origin, direction, invDirection, hitData, hitObject, &tMax);
  }
 
- void KDTree::TraceShadowRay(const Vector3& origin, const Vector3& direction, Vector3& shadowFactor, float maxDist) {
+ void KDTree::GetClosestIntersections(int numRays, const Vector3* origins, const Vector3* directions, HitData* hitData, Object** hitObjects) {
+	 //a path from the root holds at most one sibling per level on the stack
+	 if (maxDepth + 2 > KDTREE_MAX_STACK) {
+		 for (int ray = 0; ray < numRays; ray++) {
+			 hitObjects[ray] = NULL;
+			 GetClosestIntersection(origins[ray], directions[ray], hitData[ray], &hitObjects[ray]);
+		 }
+		 return;
+	 }
+
+	 TraversalState states[KDTREE_INTERLEAVED_RAYS];
+	 for (int first = 0; first < numRays; first += KDTREE_INTERLEAVED_RAYS) {
+		 int count = min(numRays - first, KDTREE_INTERLEAVED_RAYS);
+		 for (int r = 0; r < count; r++) {
+			 const Vector3& direction = directions[first + r];
+			 states[r].invDirection = Vector3(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+			 states[r].tMax = FLT_MAX;
+			 states[r].stack[0] = root;
+			 states[r].stackSize = 1;
+			 states[r].pendingLeaf = NULL;
+			 hitObjects[first + r] = NULL;
+		 }
+
+		 //each ray in turn takes one step, until all of them have emptied their stacks
+		 int active = count;
+		 while (active > 0) {
+			 for (int r = 0; r < count; r++) {
+				 TraversalState& state = states[r];
+				 int ray = first + r;
+				 if (state.pendingLeaf != NULL) {
+					 //primitives were prefetched on this ray's last turn, test them like intersectsNode does
+					 const std::vector<Primitive*>& primitives = nodePrimitives[state.pendingLeaf->primitivesIndex];
+					 for (int i = 0; i < primitives.size(); i++) {
+						 HitData thisHitData;
+						 if (primitives[i]->intersects(origins[ray], directions[ray], thisHitData) && thisHitData.t < state.tMax) {
+							 state.tMax = thisHitData.t;
+							 hitObjects[ray] = primitives[i]->parent;
+							 hitData[ray] = thisHitData;
+						 }
+					 }
+					 state.pendingLeaf = NULL;
+				 }
+				 else if (state.stackSize > 0) {
+					 KDNode* node = state.stack[--state.stackSize];
+					 if (node->bounds.intersects(origins[ray], state.invDirection)) {
+						 if (node->left == NULL && node->right == NULL) {
+							 //fetch the leaf's primitive list and come back to it next turn
+							 _mm_prefetch((const char*)nodePrimitives[node->primitivesIndex].data(), _MM_HINT_T0);
+							 state.pendingLeaf = node;
+						 }
+						 else {
+							 //push right first so left is visited first, the same order as intersectsNode
+							 if (node->right != NULL) {
+								 _mm_prefetch((const char*)node->right, _MM_HINT_T0);
+								 state.stack[state.stackSize++] = node->right;
+							 }
+							 if (node->left != NULL) {
+								 _mm_prefetch((const char*)node->left, _MM_HINT_T0);
+								 state.stack[state.stackSize++] = node->left;
+							 }
+						 }
+					 }
+				 }
+				 else {
+					 continue;
+				 }
+				 if (state.stackSize == 0 && state.pendingLeaf == NULL)
+					 active--;
+			 }
+		 }
+	 }
+ }
+
+ void KDTree::TraceShadowRay(const Vector3& origin, const Vector3& direction, Vector3& shadowFactor, float maxDist, Primitive** occluder) {
 	 //inverse the direction of the ray for faster bounds intersection test
 	 Vector3 invDirection = Vector3(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
 
@@ -178,7 +272,103 @@ KDTree::~KDTree() {
 	 shadowFactor = Vector3(1, 1, 1);
 
 	 //recursively traverse tree and apply all intersections
-	 return traceShadowNode(root, origin, direction, invDirection, shadowFactor, maxDist);
+	 traceShadowNode(root, origin, direction, invDirection, shadowFactor, maxDist, occluder);
+ }
+
+ void KDTree::TraceShadowRays(int numRays, const Vector3* origins, const Vector3* directions, const float* maxDists, Vector3* shadowFactors, Primitive** occluder) {
+	 ShadowPacket packet;
+	 packet.origins = origins;
+	 packet.directions = directions;
+	 packet.maxDists = maxDists;
+	 packet.shadowFactors = shadowFactors;
+	 packet.occluder = occluder;
+	 packet.invDirections.resize(numRays);
+	 for (int i = 0; i < numRays; i++) {
+		 packet.invDirections[i] = Vector3(1.0f / directions[i].x, 1.0f / directions[i].y, 1.0f / directions[i].z);
+		 //start by allowing all light
+		 shadowFactors[i] = Vector3(1, 1, 1);
+
+		 //every hit that counts lies on the segment, so inside the box around both of its ends
+		 BoundingBox segment;
+		 Vector3 end = origins[i] + directions[i] * maxDists[i];
+		 segment.minCorner = Vector3(min(origins[i].x, end.x), min(origins[i].y, end.y), min(origins[i].z, end.z));
+		 segment.maxCorner = Vector3(max(origins[i].x, end.x), max(origins[i].y, end.y), max(origins[i].z, end.z));
+		 if (i == 0)
+			 packet.bounds = segment;
+		 else
+			 packet.bounds.Expand(segment);
+	 }
+	 //pad for rounding in the primitives' hit points
+	 Vector3 padding = (packet.bounds.maxCorner - packet.bounds.minCorner) * 0.001f + Vector3(MIN_SHADOW_INTERSECT, MIN_SHADOW_INTERSECT, MIN_SHADOW_INTERSECT);
+	 packet.bounds.minCorner = packet.bounds.minCorner - padding;
+	 packet.bounds.maxCorner = packet.bounds.maxCorner + padding;
+
+	 //one list of active rays per level
+	 std::vector<int> active(numRays * (maxDepth + 2));
+	 for (int i = 0; i < numRays; i++)
+		 active[i] = i;
+	 traceShadowPacketNode(root, packet, active.data(), numRays);
+ }
+
+ void KDTree::traceShadowPacketNode(KDNode* node, ShadowPacket& packet, int* active, int numActive) {
+	 //can any of the segments reach this node?
+	 if (!node->bounds.Overlaps(packet.bounds))
+		 return;
+
+	 //rays that aren't blocked yet and hit this node's bounds
+	 int* nodeActive = active + numActive;
+	 int count = 0;
+	 for (int i = 0; i < numActive; i++) {
+		 int ray = active[i];
+		 if (packet.shadowFactors[ray].MaxComponent() > 0.0f && node->bounds.intersects(packet.origins[ray], packet.invDirections[ray]))
+			 nodeActive[count++] = ray;
+	 }
+	 if (count == 0)
+		 return;
+
+	 //too few rays left to share the work, finish them on their own
+	 if (count < SHADOW_PACKET_MIN_RAYS) {
+		 for (int i = 0; i < count; i++) {
+			 int ray = nodeActive[i];
+			 traceShadowNode(node, packet.origins[ray], packet.directions[ray], packet.invDirections[ray], packet.shadowFactors[ray], packet.maxDists[ray], packet.occluder);
+		 }
+		 return;
+	 }
+
+	 //if this a leaf?
+	 if (node->left == NULL && node->right == NULL) {
+		 const std::vector<Primitive*>& primitives = nodePrimitives[node->primitivesIndex];
+		 for (int i = 0; i < count; i++) {
+			 int ray = nodeActive[i];
+			 Vector3& shadowFactor = packet.shadowFactors[ray];
+			 //same tests as traceShadowNode
+			 for (int p = 0; p < primitives.size(); p++) {
+				 HitData thisHitData;
+				 if (primitives[p]->intersects(packet.origins[ray], packet.directions[ray], thisHitData) && thisHitData.t < packet.maxDists[ray] && thisHitData.t >= MIN_SHADOW_INTERSECT) {
+					 //fully opaque? block all light
+					 if (thisHitData.material.ktran < 0.01f) {
+						 shadowFactor = Vector3(0, 0, 0);
+						 if (packet.occluder != NULL)
+							 *packet.occluder = primitives[p];
+						 break;
+					 }
+					 //normalize Cd
+					 float normFactor = thisHitData.material.diffColor.MaxComponent();
+					 //prevent div by 0
+					 Vector3 normalizedDiffuse = (normFactor > FLT_EPSILON) ? (thisHitData.material.diffColor / normFactor) : Vector3(1, 1, 1);
+					 //attenuate shadowFactor
+					 shadowFactor = shadowFactor * thisHitData.material.ktran * normalizedDiffuse;
+				 }
+			 }
+		 }
+	 }
+	 else {
+		 //not a leaf, the rays blocked on the left drop out before the right
+		 if (node->left != NULL)
+			 traceShadowPacketNode(node->left, packet, nodeActive, count);
+		 if (node->right != NULL)
+			 traceShadowPacketNode(node->right, packet, nodeActive, count);
+	 }
  }
 
  void KDTree::deleteNode(KDNode* node) {
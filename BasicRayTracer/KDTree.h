@@ -2,11 +2,21 @@
 #include "Primitive.h"
 #include "BoundingBox.h"
 #include <vector>
+#include <mutex>
 
 // To fix a glitch caused by incorrect normals on HW3/scene1:
 // Requires that all shadow ray intersections be at least this far from the starting point
 #define MIN_SHADOW_INTERSECT 0.0001f
 
+// Number of rays GetClosestIntersections advances together
+#define KDTREE_INTERLEAVED_RAYS 8
+// Size of each ray's node stack in GetClosestIntersections, deeper trees are traced one ray at a time
+#define KDTREE_MAX_STACK 64
+// Shadow packets that reach a node with fewer rays than this finish those rays one at a time
+#define SHADOW_PACKET_MIN_RAYS 4
+// Nodes with at least this many primitives build their left child as a separate task while building the right
+#define KDTREE_PARALLEL_MIN_PRIMITIVES 2048
+
 class KDNode {
 public:
 	// Children
@@ -27,9 +37,13 @@ class KDTree {
 private:
 	// First node of the tree
 	KDNode* root;
+	// Depth of the deepest leaf
+	int maxDepth;
 
 	// Vector of vectors of primitives for each node
 	std::vector<std::vector<Primitive*>> nodePrimitives;
+	// Guards nodePrimitives and maxDepth while subtrees are built in parallel
+	std::mutex buildMutex;
 
 	// When this percentage of primtives are contained in both children, stop creating new nodes
 	const float STOP_PERCENT = 0.6f;
@@ -43,8 +57,36 @@ private:
 	// Recursive function for intersection
 	bool intersectsNode(KDNode* node, const Vector3& origin, const Vector3& direction, const Vector3& invDirection, HitData& hitData, Object** hitObject, float* tMax);
 
+	// Where one ray of GetClosestIntersections is in its traversal
+	struct TraversalState {
+		Vector3 invDirection;
+		float tMax;
+		// Nodes still to visit, the next one on top
+		KDNode* stack[KDTREE_MAX_STACK];
+		int stackSize;
+		// Leaf whose primitives are being fetched, tested on the ray's next turn
+		KDNode* pendingLeaf;
+	};
+
+	// Shadow rays traced together by TraceShadowRays
+	struct ShadowPacket {
+		const Vector3* origins;
+		const Vector3* directions;
+		const float* maxDists;
+		std::vector<Vector3> invDirections;
+		Vector3* shadowFactors;
+		// Box around all of the rays' segments
+		BoundingBox bounds;
+		Primitive** occluder;
+	};
+
+	// Recursive function for shadow packets, the rays in active[0, numActive) are those whose own bounds test passed at the parent
+	// The lists of the children are built after active, so active must have room for numActive per remaining level of the tree
+	void traceShadowPacketNode(KDNode* node, ShadowPacket& packet, int* active, int numActive);
+
 	// Recursive function for shadow ray calculation
-	void traceShadowNode(KDNode* node, const Vector3& origin, const Vector3& direction, const Vector3& invDirection, Vector3& shadowFactor, float maxDist);
+	// Returns true once the ray is fully blocked, and puts the blocking primitive in occluder
+	bool traceShadowNode(KDNode* node, const Vector3& origin, const Vector3& direction, const Vector3& invDirection, Vector3& shadowFactor, float maxDist, Primitive** occluder);
 
 public:
 	// Build a KD-Tree with all of the given primitives
@@ -54,6 +96,19 @@ public:
 	// Intersection test
 	bool GetClosestIntersection(const Vector3& origin, const Vector3& direction, HitData& hitData, Object** hitObject);
 
+	// Intersection test for numRays independent rays, hitObjects[i] is NULL for rays that hit nothing
+	// Groups of rays take turns visiting one node each, and prefetch the nodes and primitives they will visit next,
+	// so one ray's cache misses are served while the others work instead of stalling the thread
+	// Gives the same hits as calling GetClosestIntersection for each ray
+	void GetClosestIntersections(int numRays, const Vector3* origins, const Vector3* directions, HitData* hitData, Object** hitObjects);
+
 	// Trace a shadow ray
-	void TraceShadowRay(const Vector3& origin, const Vector3& direction, Vector3& shadowFactor, float maxDist);
+	// If the ray is fully blocked, the opaque primitive that blocked it is put in occluder (if not NULL)
+	void TraceShadowRay(const Vector3& origin, const Vector3& direction, Vector3& shadowFactor, float maxDist, Primitive** occluder = NULL);
+
+	// Trace numRays shadow rays toward the same point light together, with the same results as TraceShadowRay
+	// The packet visits each node once and is culled as a whole against the box around all of its segments,
+	// only the rays whose own bounds test passes go on to the children
+	// If any ray is fully blocked, the last blocking primitive found is put in occluder (if not NULL)
+	void TraceShadowRays(int numRays, const Vector3* origins, const Vector3* directions, const float* maxDists, Vector3* shadowFactors, Primitive** occluder = NULL);
 };
\ No newline at end of file
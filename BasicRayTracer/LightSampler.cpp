@@ -0,0 +1,177 @@
+#include "LightSampler.h"
+
+LightSampler::LightSampler(const std::vector<LightSource*>& lights) : lights(lights) {
+	//separate lights with a position from those without
+	std::vector<float> powers;
+	for (int i = 0; i < lights.size(); i++) {
+		if (dynamic_cast<PointLightSource*>(lights[i]) != NULL)
+			pointLights.push_back(i);
+		else
+			infiniteLights.push_back(i);
+		powers.push_back(Power(lights[i]));
+	}
+	powerTable = AliasTable(powers);
+
+	//build hierarchy over the point lights
+	std::vector<int> indices = pointLights;
+	root = indices.empty() ? -1 : buildNode(indices, 0, indices.size());
+}
+
+float LightSampler::Power(const LightSource* light) {
+	return light->color.Luminance();
+}
+
+int LightSampler::buildNode(std::vector<int>& indices, int start, int end) {
+	LightNode node;
+	node.left = node.right = -1;
+	node.light = -1;
+	node.representative = lights[indices[start]];
+
+	//get bounds and power of all lights in this node
+	node.power = 0.0f;
+	for (int i = start; i < end; i++) {
+		PointLightSource* light = (PointLightSource*)lights[indices[i]];
+		BoundingBox bounds;
+		bounds.minCorner = bounds.maxCorner = light->position;
+		if (i == start)
+			node.bounds = bounds;
+		else
+			node.bounds.Expand(bounds);
+		node.power += Power(light);
+	}
+
+	if (end - start == 1) {
+		//leaf
+		node.light = indices[start];
+		nodes.push_back(node);
+		return nodes.size() - 1;
+	}
+
+	//split at the median along the longest axis
+	int axis = node.bounds.LongestAxis();
+	int mid = (start + end) / 2;
+	std::nth_element(indices.begin() + start, indices.begin() + mid, indices.begin() + end, [&](int a, int b) {
+		return ((PointLightSource*)lights[a])->position.Get(axis) < ((PointLightSource*)lights[b])->position.Get(axis);
+	});
+
+	//children are built first, so reserve this node's index afterwards
+	node.left = buildNode(indices, start, mid);
+	node.right = buildNode(indices, mid, end);
+	nodes.push_back(node);
+	return nodes.size() - 1;
+}
+
+float LightSampler::lightImportance(int light, const Vector3& position, const Vector3& normal) const {
+	float distance = lights[light]->getDistance(position);
+	float importance = Power(lights[light]) * lights[light]->getAttenuation(distance);
+	//orientation
+	if (normal.dot(normal) > 0.0f) {
+		Vector3 lightDir;
+		lights[light]->getDirection(position, lightDir);
+		importance *= max(lightDir.dot(normal), LIGHT_ORIENTATION_FLOOR);
+	}
+	return importance;
+}
+
+float LightSampler::nodeImportance(const LightNode& node, const Vector3& position, const Vector3& normal) const {
+	//bound the node by a sphere
+	Vector3 center = node.bounds.GetMidpoint();
+	float radius = (node.bounds.maxCorner - center).length();
+	Vector3 toCenter = center - position;
+	float distance = toCenter.length();
+
+	//falloff at the closest possible distance
+	float importance = node.power * node.representative->getAttenuation(max(distance - radius, 0.0f));
+
+	//orientation: the best cosine of any direction into the bounding sphere
+	if (normal.dot(normal) > 0.0f && distance > radius) {
+		float cosTheta = toCenter.dot(normal) / distance;
+		float sinAlpha = radius / distance;
+		float cosAlpha = sqrt(max(1.0f - sinAlpha * sinAlpha, 0.0f));
+		float cosBound = 1.0f;
+		if (cosTheta < cosAlpha) {
+			//cos(theta - alpha)
+			float sinTheta = sqrt(max(1.0f - cosTheta * cosTheta, 0.0f));
+			cosBound = cosTheta * cosAlpha + sinTheta * sinAlpha;
+		}
+		importance *= max(cosBound, LIGHT_ORIENTATION_FLOOR);
+	}
+	return importance;
+}
+
+float LightSampler::choiceImportance(int choice, const Vector3& position, const Vector3& normal) const {
+	if (choice < infiniteLights.size())
+		return lightImportance(infiniteLights[choice], position, normal);
+	return (root >= 0) ? nodeImportance(nodes[root], position, normal) : 0.0f;
+}
+
+LightSource* LightSampler::Sample(const Vector3& position, const Vector3& normal, float u, float& pdf) const {
+	pdf = 0.0f;
+	if (lights.empty())
+		return NULL;
+
+	//first choose between the directional lights and the hierarchy
+	//importances are recomputed while searching rather than stored, so sampling doesn't allocate
+	int numChoices = infiniteLights.size() + 1;
+	float total = 0.0f;
+	for (int i = 0; i < numChoices; i++)
+		total += choiceImportance(i, position, normal);
+
+	//nothing contributes? fall back to choosing by power
+	if (total <= 0.0f)
+		return SampleByPower(u, pdf);
+
+	int choice = 0;
+	float cdf = 0.0f;
+	float importance = 0.0f;
+	for (choice = 0; ; choice++) {
+		importance = choiceImportance(choice, position, normal);
+		if (choice == numChoices - 1 || u * total < cdf + importance)
+			break;
+		cdf += importance;
+	}
+	//rounding can land on a choice that can't contribute, step back to one that can
+	while (importance <= 0.0f && choice > 0) {
+		choice--;
+		importance = choiceImportance(choice, position, normal);
+		cdf -= importance;
+	}
+	float choicePdf = importance / total;
+	//reuse the remainder of u for the next decision
+	u = min((u * total - cdf) / importance, 0.99999994f);
+
+	if (choice < infiniteLights.size()) {
+		pdf = choicePdf;
+		return lights[infiniteLights[choice]];
+	}
+
+	//traverse hierarchy, choosing each child proportionally to its importance
+	pdf = choicePdf;
+	int nodeIndex = root;
+	while (nodes[nodeIndex].light < 0) {
+		const LightNode& node = nodes[nodeIndex];
+		float leftImportance = nodeImportance(nodes[node.left], position, normal);
+		float rightImportance = nodeImportance(nodes[node.right], position, normal);
+		float leftProbability = (leftImportance + rightImportance > 0.0f) ? leftImportance / (leftImportance + rightImportance) : 0.5f;
+		if (u < leftProbability) {
+			u = u / leftProbability;
+			pdf *= leftProbability;
+			nodeIndex = node.left;
+		}
+		else {
+			u = (u - leftProbability) / (1.0f - leftProbability);
+			pdf *= 1.0f - leftProbability;
+			nodeIndex = node.right;
+		}
+		u = min(u, 0.99999994f);
+	}
+	return lights[nodes[nodeIndex].light];
+}
+
+LightSource* LightSampler::SampleByPower(float u, float& pdf) const {
+	if (lights.empty()) {
+		pdf = 0.0f;
+		return NULL;
+	}
+	return lights[powerTable.Sample(u, pdf)];
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include "LightSource.h"
+#include "BoundingBox.h"
+#include "AliasTable.h"
+#include <vector>
+
+// Lights facing away from a point still get this fraction of their importance,
+// so every light that could contribute (e.g. through the specular term) keeps a nonzero probability
+#define LIGHT_ORIENTATION_FLOOR 0.05f
+
+// A node of the light hierarchy
+struct LightNode {
+	// Bounds of all point lights below this node
+	BoundingBox bounds;
+	// Sum of the power of all lights below this node
+	float power;
+	// Children (indices into nodes), -1 for leaves
+	int left, right;
+	// Index into lights for leaves
+	int light;
+	// A light from this subtree, used for its distance falloff
+	const LightSource* representative;
+};
+
+// Chooses lights proportionally to their estimated contribution at a shading point
+// Point lights are kept in a bounding volume hierarchy so sampling is O(log n) in the number of lights,
+// directional lights (which have no position) are considered individually
+class LightSampler {
+private:
+	std::vector<LightSource*> lights;
+	// Lights that have a position, and those that don't
+	std::vector<int> pointLights;
+	std::vector<int> infiniteLights;
+
+	// Light hierarchy over pointLights
+	std::vector<LightNode> nodes;
+	int root;
+
+	// Power of each light, for sampling without a shading point
+	AliasTable powerTable;
+
+	// Recursive function to build the hierarchy over indices[start, end)
+	int buildNode(std::vector<int>& indices, int start, int end);
+
+	// Estimated contribution of a light or a cluster of lights to a point with the given normal
+	// A zero normal ignores orientation
+	float lightImportance(int light, const Vector3& position, const Vector3& normal) const;
+	float nodeImportance(const LightNode& node, const Vector3& position, const Vector3& normal) const;
+	// Importance of the first decision's choices: each directional light, then the whole hierarchy
+	float choiceImportance(int choice, const Vector3& position, const Vector3& normal) const;
+
+public:
+	// Build the sampler for the given lights
+	// Must be rebuilt if the lights change
+	LightSampler(const std::vector<LightSource*>& lights);
+
+	// Total power of a light, luminance of its color
+	static float Power(const LightSource* light);
+
+	// Pick a light for the point position with the given normal, using a uniform random number u in [0,1)
+	// Returns NULL if there are no lights
+	LightSource* Sample(const Vector3& position, const Vector3& normal, float u, float& pdf) const;
+
+	// Pick a light proportionally to its power only
+	LightSource* SampleByPower(float u, float& pdf) const;
+};
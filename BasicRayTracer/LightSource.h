@@ -1,6 +1,10 @@
 #pragma once
 #include "Vector3.h"
+#include "BoundingBox.h"
+#include "FileUtil.h"
 #include <cfloat>
+#define _USE_MATH_DEFINES
+#include <cmath>
 
 // A light source. Must be able to provide a direction to trace shadow rays and a distance
 class LightSource {
@@ -10,6 +14,27 @@ public:
 	virtual void getDirection(const Vector3& position, Vector3& lightDirection) const = 0;
 	virtual float getDistance(const Vector3& position) const = 0;
 	virtual float getAttenuation(float distance) const = 0;
+
+	// Fraction of the light's intensity emitted toward position, 1 for lights that shine equally in all directions
+	virtual float getFalloff(const Vector3&) const {
+		return 1.0f;
+	}
+
+	// Bounds of the region where color * attenuation * falloff is at least threshold
+	// Returns false if the light reaches everywhere
+	virtual bool getInfluenceBounds(float, BoundingBox&) const {
+		return false;
+	}
+
+	// Hash of everything that decides how the light lights the scene, continuing from hash
+	virtual unsigned long long Hash(unsigned long long hash) const = 0;
+
+protected:
+	// Hash of the kind of light and its color, for the lights' Hash
+	unsigned long long hashColor(int kind, unsigned long long hash) const {
+		float light[] = { (float)kind, color.x, color.y, color.z };
+		return FileUtil::Hash(light, sizeof(light), hash);
+	}
 };
 
 // A point light source - has a position
@@ -32,6 +57,85 @@ public:
 	float getAttenuation(float distance) const {
 		return min(1.0f, 1.0f / (0.25f + 0.1f * distance + 0.01f * distance * distance));
 	}
+
+	// Distance at which color * attenuation falls to threshold
+	float getInfluenceRadius(float threshold) const {
+		//solve 0.25 + 0.1d + 0.01d^2 = intensity / threshold
+		float ratio = color.MaxComponent() / threshold;
+		if (ratio <= 1.0f)
+			return 0.0f;
+		return (-0.1f + sqrt(0.01f - 0.04f * (0.25f - ratio))) / 0.02f;
+	}
+
+	bool getInfluenceBounds(float threshold, BoundingBox& bounds) const {
+		float radius = getInfluenceRadius(threshold);
+		bounds.minCorner = position - Vector3(radius, radius, radius);
+		bounds.maxCorner = position + Vector3(radius, radius, radius);
+		return true;
+	}
+
+	unsigned long long Hash(unsigned long long hash) const {
+		return FileUtil::Hash(&position, sizeof(position), hashColor(0, hash));
+	}
+};
+
+// A spot light - a point light that only shines into a cone around direction
+class SpotLightSource : public PointLightSource {
+public:
+	// Axis of the cone, normalized
+	Vector3 direction;
+	// Angle between the axis and the edge of the cone
+	float cutOffAngle;
+	// How quickly the intensity drops away from the axis, 0 (not at all) to 1
+	float dropOffRate;
+
+	SpotLightSource(const Vector3& position, const Vector3& direction, float cutOffAngle, float dropOffRate) : PointLightSource(position) {
+		this->direction = direction.normalize();
+		this->cutOffAngle = cutOffAngle;
+		this->dropOffRate = dropOffRate;
+		cosCutOff = cos(cutOffAngle);
+	}
+
+	// Like an OpenGL spot light, cos^exponent of the angle from the axis, with the exponent scaled to 0-128 like shininess
+	float getFalloff(const Vector3& position) const {
+		float cosAngle = (position - this->position).normalize().dot(direction);
+		if (cosAngle < cosCutOff)
+			return 0.0f;
+		return pow(max(cosAngle, 0.0f), dropOffRate * 128.0f);
+	}
+
+	bool getInfluenceBounds(float threshold, BoundingBox& bounds) const {
+		PointLightSource::getInfluenceBounds(threshold, bounds);
+		if (cutOffAngle >= M_PI * 0.5f)
+			return true;
+		//the cone up to the influence radius fits in the box around the apex and the disc closing it
+		float radius = getInfluenceRadius(threshold);
+		Vector3 discCenter = position + direction * radius;
+		float discRadius = radius * tan(cutOffAngle);
+		BoundingBox cone;
+		cone.minCorner = cone.maxCorner = position;
+		BoundingBox disc;
+		for (int axis = 0; axis < 3; axis++) {
+			float extent = discRadius * sqrt(max(1.0f - direction.Get(axis) * direction.Get(axis), 0.0f));
+			disc.minCorner.Set(axis, discCenter.Get(axis) - extent);
+			disc.maxCorner.Set(axis, discCenter.Get(axis) + extent);
+		}
+		cone.Expand(disc);
+		//and in the sphere's box
+		for (int axis = 0; axis < 3; axis++) {
+			bounds.minCorner.Set(axis, max(bounds.minCorner.Get(axis), cone.minCorner.Get(axis)));
+			bounds.maxCorner.Set(axis, min(bounds.maxCorner.Get(axis), cone.maxCorner.Get(axis)));
+		}
+		return true;
+	}
+
+	unsigned long long Hash(unsigned long long hash) const {
+		float spot[] = { position.x, position.y, position.z, direction.x, direction.y, direction.z, cutOffAngle, dropOffRate };
+		return FileUtil::Hash(spot, sizeof(spot), hashColor(1, hash));
+	}
+
+private:
+	float cosCutOff;
 };
 
 // A directional light source - has a direction
@@ -43,15 +147,19 @@ public:
 		this->direction = direction;
 	}
 
-	void getDirection(const Vector3& position, Vector3& lightDirection) const {
+	void getDirection(const Vector3&, Vector3& lightDirection) const {
 		lightDirection = -direction.normalize();
 	}
 
-	float getDistance(const Vector3& position) const {
+	float getDistance(const Vector3&) const {
 		return FLT_MAX;
 	}
 
-	float getAttenuation(float distance) const {
+	float getAttenuation(float) const {
 		return 1.0f;
 	}
+
+	unsigned long long Hash(unsigned long long hash) const {
+		return FileUtil::Hash(&direction, sizeof(direction), hashColor(2, hash));
+	}
 };
\ No newline at end of file
@@ -0,0 +1,182 @@
+#include "Lightmap.h"
+#include "FileUtil.h"
+#include <algorithm>
+#include <cstring>
+
+Lightmap::Lightmap(const std::vector<Object*>& objects, const BoundingBox& sceneBounds, unsigned long long sceneHash) : sceneHash(sceneHash) {
+	float sceneSize = max((sceneBounds.maxCorner - sceneBounds.minCorner).MaxComponent(), 1e-6f);
+	float texelsPerUnit = LIGHTMAP_RESOLUTION / sceneSize;
+
+	for (int o = 0; o < objects.size(); o++) {
+		//size each chart by the area of its primitive
+		std::vector<LightmapChart> objectCharts;
+		for (int i = 0; i < objects[o]->primitives.size(); i++) {
+			LightmapChart chart;
+			chart.primitive = objects[o]->primitives[i];
+			chart.triangle = dynamic_cast<Triangle*>(chart.primitive);
+			chart.sphere = dynamic_cast<Sphere*>(chart.primitive);
+			if (chart.triangle == NULL && chart.sphere == NULL)
+				continue;
+			chart.atlas = o;
+			//a triangle only covers half of its chart
+			float area = chart.primitive->GetArea() * (chart.triangle != NULL ? 2.0f : 1.0f);
+			chart.size = (int)ceil(sqrt(area) * texelsPerUnit);
+			chart.size = min(max(chart.size, LIGHTMAP_MIN_CHART_SIZE), LIGHTMAP_MAX_CHART_SIZE);
+			objectCharts.push_back(chart);
+		}
+
+		//pack into rows, largest first so each row is as tall as its first chart
+		std::sort(objectCharts.begin(), objectCharts.end(), [](const LightmapChart& a, const LightmapChart& b) { return a.size > b.size; });
+		LightmapAtlas atlas;
+		atlas.width = LIGHTMAP_ATLAS_WIDTH;
+		if (!objectCharts.empty())
+			atlas.width = max(atlas.width, objectCharts[0].size);
+		int rowX = 0, rowY = 0, rowHeight = 0;
+		for (int i = 0; i < objectCharts.size(); i++) {
+			if (rowX + objectCharts[i].size > atlas.width) {
+				rowY += rowHeight;
+				rowX = rowHeight = 0;
+			}
+			objectCharts[i].x = rowX;
+			objectCharts[i].y = rowY;
+			rowX += objectCharts[i].size;
+			rowHeight = max(rowHeight, objectCharts[i].size);
+			chartIndex[objectCharts[i].primitive] = charts.size();
+			charts.push_back(objectCharts[i]);
+		}
+		atlas.height = rowY + rowHeight;
+		atlas.texels.resize(atlas.width * atlas.height);
+		atlases.push_back(atlas);
+	}
+}
+
+int Lightmap::NumTexels() const {
+	int texels = 0;
+	for (int i = 0; i < atlases.size(); i++)
+		texels += atlases[i].texels.size();
+	return texels;
+}
+
+void Lightmap::GetSurfacePoint(const LightmapChart& chart, float s, float t, Vector3& position, Vector3& normal) const {
+	if (chart.triangle != NULL) {
+		//past the diagonal, move back onto the far edge
+		if (s + t > 1.0f) {
+			float sum = s + t;
+			s /= sum;
+			t /= sum;
+		}
+		const Triangle* triangle = chart.triangle;
+		position = triangle->v[0] * (1.0f - s - t) + triangle->v[1] * s + triangle->v[2] * t;
+		normal = (triangle->n[0] * (1.0f - s - t) + triangle->n[1] * s + triangle->n[2] * t).normalize();
+	}
+	else {
+		float phi = (s - 0.5f) * 2.0f * M_PI;
+		float theta = t * M_PI;
+		normal = Vector3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+		position = chart.sphere->center + normal * chart.sphere->radius;
+	}
+}
+
+void Lightmap::chartCoordinates(const LightmapChart& chart, const Vector3& position, float& s, float& t, Vector3& normal) const {
+	if (chart.triangle != NULL) {
+		//barycentric coordinates of the point
+		const Triangle* triangle = chart.triangle;
+		Vector3 edge1 = triangle->v[1] - triangle->v[0];
+		Vector3 edge2 = triangle->v[2] - triangle->v[0];
+		Vector3 toPoint = position - triangle->v[0];
+		float d11 = edge1.dot(edge1), d12 = edge1.dot(edge2), d22 = edge2.dot(edge2);
+		float p1 = toPoint.dot(edge1), p2 = toPoint.dot(edge2);
+		float denominator = d11 * d22 - d12 * d12;
+		s = (denominator != 0.0f) ? (d22 * p1 - d12 * p2) / denominator : 0.0f;
+		t = (denominator != 0.0f) ? (d11 * p2 - d12 * p1) / denominator : 0.0f;
+		s = min(max(s, 0.0f), 1.0f);
+		t = min(max(t, 0.0f), 1.0f);
+		normal = (triangle->n[0] * (1.0f - s - t) + triangle->n[1] * s + triangle->n[2] * t).normalize();
+	}
+	else {
+		normal = (position - chart.sphere->center).normalize();
+		s = 0.5f + atan2(normal.z, normal.x) / (2.0f * M_PI);
+		t = acos(min(max(normal.y, -1.0f), 1.0f)) / M_PI;
+	}
+}
+
+bool Lightmap::Lookup(const HitData& hitData, Vector3& value) const {
+	if (hitData.primitive == NULL)
+		return false;
+	auto it = chartIndex.find(hitData.primitive);
+	if (it == chartIndex.end())
+		return false;
+	const LightmapChart& chart = charts[it->second];
+
+	float s, t;
+	Vector3 normal;
+	chartCoordinates(chart, hitData.position, s, t, normal);
+	//the other side of the surface isn't stored
+	if (hitData.normal.dot(normal) <= 0.0f)
+		return false;
+
+	//bilinear filter between texel centers, clamped to the chart
+	float fx = min(max(s * chart.size - 0.5f, 0.0f), chart.size - 1.0f);
+	float fy = min(max(t * chart.size - 0.5f, 0.0f), chart.size - 1.0f);
+	int x0 = (int)fx, y0 = (int)fy;
+	int x1 = min(x0 + 1, chart.size - 1), y1 = min(y0 + 1, chart.size - 1);
+	float wx = fx - x0, wy = fy - y0;
+	const LightmapAtlas& atlas = atlases[chart.atlas];
+	const Vector3* row0 = &atlas.texels[(chart.y + y0) * atlas.width + chart.x];
+	const Vector3* row1 = &atlas.texels[(chart.y + y1) * atlas.width + chart.x];
+	value = (row0[x0] * (1.0f - wx) + row0[x1] * wx) * (1.0f - wy) + (row1[x0] * (1.0f - wx) + row1[x1] * wx) * wy;
+	return true;
+}
+
+bool Lightmap::Save(const char* path) const {
+	return FileUtil::WriteAtomically(path, "lightmap", [&](FILE* file) {
+		int numAtlases = atlases.size();
+		bool ok = fwrite(LIGHTMAP_MAGIC, 1, 8, file) == 8;
+		ok = ok && fwrite(&sceneHash, sizeof(sceneHash), 1, file) == 1;
+		ok = ok && fwrite(&numAtlases, sizeof(numAtlases), 1, file) == 1;
+		for (int i = 0; ok && i < numAtlases; i++) {
+			ok = fwrite(&atlases[i].width, sizeof(int), 1, file) == 1 && fwrite(&atlases[i].height, sizeof(int), 1, file) == 1;
+			ok = ok && fwrite(atlases[i].texels.data(), sizeof(Vector3), atlases[i].texels.size(), file) == atlases[i].texels.size();
+		}
+		return ok;
+	});
+}
+
+bool Lightmap::Load(const char* path) {
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) {
+		printf("Could not open lightmap '%s'\n", path);
+		return false;
+	}
+	char magic[8];
+	unsigned long long fileHash;
+	int numAtlases;
+	bool ok = fread(magic, 1, 8, file) == 8 && memcmp(magic, LIGHTMAP_MAGIC, 8) == 0;
+	ok = ok && fread(&fileHash, sizeof(fileHash), 1, file) == 1;
+	if (ok && fileHash != sceneHash) {
+		printf("Lightmap '%s' was baked for a different scene, ignoring it\n", path);
+		fclose(file);
+		return false;
+	}
+	ok = ok && fread(&numAtlases, sizeof(numAtlases), 1, file) == 1 && numAtlases == atlases.size();
+
+	//the layout comes from the scene, the file only has to agree with it
+	std::vector<std::vector<Vector3>> loaded(atlases.size());
+	for (int i = 0; ok && i < numAtlases; i++) {
+		int width, height;
+		ok = fread(&width, sizeof(int), 1, file) == 1 && fread(&height, sizeof(int), 1, file) == 1;
+		ok = ok && width == atlases[i].width && height == atlases[i].height;
+		if (ok) {
+			loaded[i].resize(width * height);
+			ok = fread(loaded[i].data(), sizeof(Vector3), loaded[i].size(), file) == loaded[i].size();
+		}
+	}
+	fclose(file);
+	if (!ok) {
+		printf("Lightmap '%s' is damaged, ignoring it\n", path);
+		return false;
+	}
+	for (int i = 0; i < atlases.size(); i++)
+		atlases[i].texels.swap(loaded[i]);
+	return true;
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include "Object.h"
+#include "Primitive.h"
+#include "BoundingBox.h"
+#include <vector>
+#include <unordered_map>
+#include <cstdio>
+
+// Identifies lightmap files, change the version when the layout changes
+#define LIGHTMAP_MAGIC "RTLMAP01"
+// Texels across the largest dimension of the scene
+#define LIGHTMAP_RESOLUTION 512
+// Limits on the texels along each side of a chart
+#define LIGHTMAP_MIN_CHART_SIZE 2
+#define LIGHTMAP_MAX_CHART_SIZE 256
+// Width of each atlas (wider if a chart needs it), charts are packed in rows and the height grows to fit them
+#define LIGHTMAP_ATLAS_WIDTH 1024
+
+// Square block of texels in an atlas covering one primitive
+// A triangle is mapped by its barycentric coordinates (b1, b2) to the lower left half of the block,
+// texels past the diagonal repeat the nearest edge so filtering never reads outside the triangle
+// A sphere is mapped by longitude and latitude
+struct LightmapChart {
+	Primitive* primitive;
+	// The primitive as its own type, only one is not NULL
+	Triangle* triangle;
+	Sphere* sphere;
+	// Atlas (the index of the primitive's object) and the block's corner and size in it
+	int atlas;
+	int x, y, size;
+};
+
+// Texels of all the charts of one object
+struct LightmapAtlas {
+	int width, height;
+	std::vector<Vector3> texels;
+};
+
+// View independent lighting of every surface of a static scene, stored in one texture atlas per object
+// Only one side of each surface is stored: the side the primitive's normals point to
+class Lightmap {
+private:
+	std::vector<LightmapAtlas> atlases;
+	std::vector<LightmapChart> charts;
+	// Chart of each primitive
+	std::unordered_map<const Primitive*, int> chartIndex;
+	// Geometry and lighting the lightmap was baked for
+	unsigned long long sceneHash;
+
+	// Position in [0,1]^2 within a chart of a point on its primitive, and the normal of the stored side there
+	void chartCoordinates(const LightmapChart& chart, const Vector3& position, float& s, float& t, Vector3& normal) const;
+
+public:
+	// Lay out charts for all primitives of objects, about LIGHTMAP_RESOLUTION texels across sceneBounds
+	Lightmap(const std::vector<Object*>& objects, const BoundingBox& sceneBounds, unsigned long long sceneHash);
+
+	int NumCharts() const {
+		return charts.size();
+	}
+	const LightmapChart& GetChart(int index) const {
+		return charts[index];
+	}
+	int NumTexels() const;
+
+	// Point on a chart's primitive at s,t in [0,1]^2 within the chart, with the normal of the stored side
+	void GetSurfacePoint(const LightmapChart& chart, float s, float t, Vector3& position, Vector3& normal) const;
+
+	// Texel x,y of a chart
+	Vector3& Texel(const LightmapChart& chart, int x, int y) {
+		return atlases[chart.atlas].texels[(chart.y + y) * atlases[chart.atlas].width + chart.x + x];
+	}
+
+	// Bilinearly filtered value at a hit
+	// Returns false if the primitive hit has no chart or the hit is on the side that isn't stored (its normal faces away from it)
+	bool Lookup(const HitData& hitData, Vector3& value) const;
+
+	// Write the lightmap to a temporary file and move it over path
+	bool Save(const char* path) const;
+
+	// Load the texels from path, if it was baked for the same scene and layout
+	bool Load(const char* path);
+};
@@ -2,6 +2,8 @@
 #include "Vector3.h"
 #include "BSSRDF.h"
 
+class Primitive;
+
 // Material properties of an object. Some objects may share the same material
 class Material {
 public:
@@ -9,9 +11,9 @@ public:
 	Vector3 ambColor;	/* Ambient color				*/
 	Vector3 specColor;	/* Specular color 				*/
 	Vector3 emissColor;	/* Emissive color				*/
-	float shininess;	/* Shininess: 0.0 - 1.0.  Must be scaled (multiply by 128) before use as a Phong cosine exponent (q in our equation).  */
-	float ktran;		/* Transparency: 0.0 - 1.0			*/
-	BSSRDF* bssrdf;
+	float shininess = 0.0f;	/* Shininess: 0.0 - 1.0.  Must be scaled (multiply by 128) before use as a Phong cosine exponent (q in our equation).  */
+	float ktran = 0.0f;		/* Transparency: 0.0 - 1.0			*/
+	BSSRDF* bssrdf = NULL;
 
 	// Some useful operations for interpolating materials
 	Material operator*(float scalar) const {
@@ -52,4 +54,23 @@ struct HitData {
 	Material material;
 	// texture coordinates
 	float u, v;
-};
\ No newline at end of file
+	// primitive that was hit
+	Primitive* primitive = NULL;
+};
+
+// Information about the first surface seen through a pixel, used to guide denoising
+struct PixelFeatures {
+	// Reflectance of the surface (diffuse, specular and transmitted weights combined)
+	Vector3 albedo;
+	// Normal facing the camera
+	Vector3 normal;
+	// Distance from the camera
+	float depth;
+	// Fraction of the samples that hit anything
+	float coverage;
+
+	PixelFeatures() {
+		depth = 0.0f;
+		coverage = 0.0f;
+	}
+};
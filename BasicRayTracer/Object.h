@@ -1,6 +1,7 @@
 #pragma once
 #include "Shader.h"
 #include "Primitive.h"
+#include "KDTree.h"
 #include <vector>
 
 // An object contains 1 or more primitives and is considered a solid entity for purposes of refraction
@@ -16,10 +17,25 @@ public:
 	ColorShader* colorShader;
 	IntersectionShader* intersectionShader;
 
+	// Acceleration structure over only this object's primitives, for rays that can only hit this object
+	// NULL unless built with BuildKDTree
+	KDTree* kdtree;
+
 	Object() {
 		indexOfRefraction = 1.5f;
 		colorShader = NULL;
 		intersectionShader = NULL;
+		kdtree = NULL;
+	}
+
+	~Object() {
+		delete kdtree;
+	}
+
+	// (Re)build the object's own acceleration structure
+	void BuildKDTree() {
+		delete kdtree;
+		kdtree = new KDTree(primitives);
 	}
 
 	// Get center point of a triangle mesh
@@ -0,0 +1,310 @@
+#include "PathTracer.h"
+
+PathTracer::PathTracer(Scene* scene, int samplesPerPixel) : Renderer(scene, samplesPerPixel) {
+	//find emissive primitives to use as area lights
+	std::vector<Primitive*> emissive;
+	const std::vector<Primitive*>& primitives = scene->GetPrimitives();
+	for (int i = 0; i < primitives.size(); i++) {
+		if (primitives[i]->GetEmission().Luminance() * primitives[i]->GetArea() > 0.0f)
+			emissive.push_back(primitives[i]);
+	}
+	emitters = new AreaLight(emissive);
+	printf("Path tracer: %d emissive primitives\n", emitters->NumPrimitives());
+}
+
+PathTracer::~PathTracer() {
+	delete emitters;
+}
+
+Vector3 PathTracer::traceCameraRay(const Vector3& origin, const Vector3& direction, HitData& firstHitData, Object* firstHitObject, const Vector3*, bool record) {
+	Vector3 radiance;
+	//product of material/pdf factors along the path so far
+	Vector3 throughput(1.0f, 1.0f, 1.0f);
+	Vector3 rayOrigin = origin;
+	Vector3 rayDirection = direction;
+	std::vector<Object*> insideStack;
+	//emission found by a perfectly specular bounce (or the camera) can't be found by light sampling, so it gets full weight
+	bool specularBounce = true;
+	//pdf of the last sampled direction, for MIS against light sampling
+	float lastPdf = 0.0f;
+
+	for (int bounce = 0; bounce <= PATH_MAX_BOUNCES; bounce++) {
+		HitData hitData;
+		Object* hitObject = NULL;
+		bool hit;
+		if (bounce == 0) {
+			//the camera ray's hit was found with the rest of its row
+			hit = firstHitObject != NULL;
+			hitData = firstHitData;
+			hitObject = firstHitObject;
+		}
+		else {
+			hit = scene->GetClosestIntersection(rayOrigin, rayDirection, hitData, &hitObject);
+		}
+		if (!hit) {
+			//the path leaves the scene, weight the environment against sampling it directly like emission
+			if (scene->environment != NULL) {
+				float weight = 1.0f;
+				if (!specularBounce)
+					weight = powerHeuristic(lastPdf, scene->environment->Pdf(rayDirection));
+				radiance += throughput * scene->environment->Lookup(rayDirection) * weight;
+			}
+			break;
+		}
+
+		//orient normal like the Whitted tracer does
+		if (!insideStack.empty() && std::find(insideStack.begin(), insideStack.end(), hitObject) != insideStack.end())
+			hitData.normal = -hitData.normal;
+		if (rayDirection.dot(hitData.normal) > 0.0f)
+			hitData.normal = -hitData.normal;
+
+		if (record)
+			recordRay(rayOrigin, hitData.position, hitData.normal);
+
+		if (hitObject->colorShader != NULL)
+			hitObject->colorShader->Shade(hitData, hitData.material);
+
+		//emission
+		Vector3 emission = hitData.material.emissColor;
+		if (emission.MaxComponent() > 0.0f) {
+			float weight = 1.0f;
+			if (!specularBounce)
+				weight = powerHeuristic(lastPdf, emitterPdf(emission, hitData.t, rayDirection, hitData.normal));
+			radiance += throughput * emission * weight;
+		}
+
+		//subsurface scattering already gathers the light around this point, end the path here
+		if (hitData.material.bssrdf != NULL) {
+			radiance += throughput * getSubsurfaceRadiance(rayDirection, hitData, hitObject);
+			break;
+		}
+
+		//next event estimation
+		radiance += throughput * (sampleDeltaLights(rayDirection, hitData) + sampleEmitters(rayDirection, hitData) + sampleEnvironment(rayDirection, hitData));
+
+		//choose how the path continues
+		float diffuseProbability, glossyProbability, refractionProbability;
+		lobeProbabilities(hitData, diffuseProbability, glossyProbability, refractionProbability);
+		float totalProbability = diffuseProbability + glossyProbability + refractionProbability;
+		if (totalProbability <= 0.0f)
+			break;
+		float u = uniform() * totalProbability;
+
+		Vector3 newDirection;
+		if (u < diffuseProbability + glossyProbability) {
+			float u1, u2;
+			uniform2D(u1, u2);
+			float phi = 2.0f * M_PI * u2;
+			Vector3 tangent, bitangent;
+			if (u < diffuseProbability) {
+				//cosine weighted hemisphere around the normal
+				hitData.normal.CreateNormalSpace(tangent, bitangent);
+				float r = sqrt(u1);
+				newDirection = tangent * (r * cos(phi)) + bitangent * (r * sin(phi)) + hitData.normal * sqrt(max(1.0f - u1, 0.0f));
+			}
+			else {
+				//phong lobe around the mirror direction
+				Vector3 reflectDir = -rayDirection.reflect(hitData.normal).normalize();
+				reflectDir.CreateNormalSpace(tangent, bitangent);
+				float cosAlpha = pow(u1, 1.0f / (hitData.material.shininess * 128.0f + 1.0f));
+				float sinAlpha = sqrt(max(1.0f - cosAlpha * cosAlpha, 0.0f));
+				newDirection = tangent * (sinAlpha * cos(phi)) + bitangent * (sinAlpha * sin(phi)) + reflectDir * cosAlpha;
+			}
+
+			//the glossy lobe can point below the surface
+			float cosTheta = newDirection.dot(hitData.normal);
+			if (cosTheta <= 0.0f)
+				break;
+			float pdf = materialPdf(rayDirection, newDirection, hitData);
+			if (pdf <= 0.0f)
+				break;
+			throughput = throughput * evaluateMaterial(rayDirection, newDirection, hitData) * (cosTheta / pdf);
+			rayOrigin = hitData.position + hitData.normal * PUSH_SPAWNED_RAYS;
+			specularBounce = false;
+			lastPdf = pdf;
+		}
+		else {
+			//perfect refraction, tracking which objects we are inside like the Whitted tracer
+			std::vector<Object*> newInsideStack = insideStack;
+			float n1, n2;
+			auto insideObject = std::find(newInsideStack.begin(), newInsideStack.end(), hitObject);
+			if (insideObject == newInsideStack.end()) {
+				//entering a new object
+				n1 = newInsideStack.empty() ? 1.0f : newInsideStack.back()->indexOfRefraction;
+				newInsideStack.push_back(hitObject);
+				n2 = hitObject->indexOfRefraction;
+			}
+			else {
+				//leaving object
+				n1 = hitObject->indexOfRefraction;
+				newInsideStack.erase(insideObject);
+				n2 = newInsideStack.empty() ? 1.0f : newInsideStack.back()->indexOfRefraction;
+			}
+			Vector3 refractDir;
+			if ((-rayDirection).refract(hitData.normal, n1 / n2, refractDir)) {
+				//total internal reflection, bounce off the inside of the surface instead
+				newDirection = -rayDirection.reflect(hitData.normal).normalize();
+				rayOrigin = hitData.position + hitData.normal * PUSH_SPAWNED_RAYS;
+			}
+			else {
+				newDirection = -refractDir;
+				rayOrigin = hitData.position - hitData.normal * PUSH_SPAWNED_RAYS;
+				insideStack = newInsideStack;
+			}
+			throughput = throughput * (hitData.material.ktran * totalProbability / refractionProbability);
+			specularBounce = true;
+		}
+		rayDirection = newDirection.normalize();
+
+		//russian roulette
+		if (bounce >= PATH_ROULETTE_BOUNCES) {
+			float survival = min(throughput.MaxComponent(), PATH_MAX_SURVIVAL);
+			if (uniform() >= survival)
+				break;
+			throughput = throughput / survival;
+		}
+	}
+	return radiance;
+}
+
+void PathTracer::lobeProbabilities(const HitData& hitData, float& diffuse, float& glossy, float& refraction) {
+	diffuse = hitData.material.diffColor.Luminance() * (1.0f - hitData.material.ktran);
+	glossy = hitData.material.specColor.Luminance();
+	refraction = hitData.material.ktran;
+}
+
+Vector3 PathTracer::evaluateMaterial(const Vector3& direction, const Vector3& lightDir, const HitData& hitData) {
+	if (lightDir.dot(hitData.normal) <= 0.0f)
+		return Vector3();
+	//lambertian
+	Vector3 diffuse = hitData.material.diffColor * ((1.0f - hitData.material.ktran) / M_PI);
+	//normalized phong
+	float exponent = hitData.material.shininess * 128.0f;
+	Vector3 reflectDir = -direction.reflect(hitData.normal).normalize();
+	float cosAlpha = max(lightDir.dot(reflectDir), 0.0f);
+	Vector3 glossy = hitData.material.specColor * ((exponent + 2.0f) / (2.0f * M_PI) * pow(cosAlpha, exponent));
+	return diffuse + glossy;
+}
+
+float PathTracer::materialPdf(const Vector3& direction, const Vector3& lightDir, const HitData& hitData) {
+	float cosTheta = lightDir.dot(hitData.normal);
+	if (cosTheta <= 0.0f)
+		return 0.0f;
+	float diffuseProbability, glossyProbability, refractionProbability;
+	lobeProbabilities(hitData, diffuseProbability, glossyProbability, refractionProbability);
+	float totalProbability = diffuseProbability + glossyProbability + refractionProbability;
+	if (totalProbability <= 0.0f)
+		return 0.0f;
+
+	float exponent = hitData.material.shininess * 128.0f;
+	Vector3 reflectDir = -direction.reflect(hitData.normal).normalize();
+	float cosAlpha = max(lightDir.dot(reflectDir), 0.0f);
+	float pdf = diffuseProbability * cosTheta / M_PI + glossyProbability * (exponent + 1.0f) / (2.0f * M_PI) * pow(cosAlpha, exponent);
+	return pdf / totalProbability;
+}
+
+Vector3 PathTracer::sampleDeltaLights(const Vector3& direction, const HitData& hitData) {
+	Vector3 radiance;
+	if (LIGHT_SAMPLES_PER_HIT <= 0 || scene->lights.size() <= LIGHT_SAMPLES_PER_HIT) {
+		for (int i = 0; i < scene->lights.size(); i++)
+			radiance += getDeltaLightRadiance(direction, scene->lights[i], hitData);
+		return radiance;
+	}
+
+	//sample a few lights by their estimated contribution
+	for (int i = 0; i < LIGHT_SAMPLES_PER_HIT; i++) {
+		float lightPdf;
+		LightSource* light = pickLight(hitData.position, hitData.normal, lightPdf);
+		radiance += getDeltaLightRadiance(direction, light, hitData) / (lightPdf * LIGHT_SAMPLES_PER_HIT);
+	}
+	return radiance;
+}
+
+Vector3 PathTracer::getDeltaLightRadiance(const Vector3& direction, const LightSource* light, const HitData& hitData) {
+	Vector3 lightDir;
+	light->getDirection(hitData.position, lightDir);
+	//facing away? skip the shadow ray
+	float cosTheta = lightDir.dot(hitData.normal);
+	if (cosTheta <= 0.0f)
+		return Vector3();
+
+	float lightDist = light->getDistance(hitData.position);
+	//outside a spot light's cone? skip the shadow ray
+	float attenuation = light->getAttenuation(lightDist) * light->getFalloff(hitData.position);
+	if (attenuation <= 0.0f)
+		return Vector3();
+
+	Vector3 shadowFactor = traceShadowRay(light, hitData, lightDir, lightDist);
+	if (shadowFactor.MaxComponent() <= 0.0f)
+		return Vector3();
+
+	return evaluateMaterial(direction, lightDir, hitData) * shadowFactor * light->color * (cosTheta * attenuation * M_PI);
+}
+
+Vector3 PathTracer::sampleEmitters(const Vector3& direction, const HitData& hitData) {
+	if (emitters->NumPrimitives() == 0)
+		return Vector3();
+
+	//pick a point on an emitter
+	float u = uniform();
+	float u1, u2;
+	uniform2D(u1, u2);
+	Vector3 lightPosition, lightNormal, emission;
+	float areaPdf;
+	emitters->Sample(u, u1, u2, lightPosition, lightNormal, emission, areaPdf);
+
+	Vector3 toLight = lightPosition - hitData.position;
+	float distance = toLight.length();
+	if (distance <= 0.0f)
+		return Vector3();
+	Vector3 lightDir = toLight / distance;
+	float cosTheta = lightDir.dot(hitData.normal);
+	float cosLight = abs(lightDir.dot(lightNormal));
+	if (cosTheta <= 0.0f || cosLight <= 0.0f)
+		return Vector3();
+
+	//convert the area pdf to solid angle
+	float pdf = areaPdf * distance * distance / cosLight;
+
+	//stop just short of the emitter so it doesn't shadow itself
+	Vector3 shadowFactor;
+	Vector3 shadowOrigin = hitData.position + hitData.normal * PUSH_SPAWNED_RAYS;
+	scene->TraceShadowRay(shadowOrigin, lightDir, shadowFactor, distance * 0.999f);
+	if (shadowFactor.MaxComponent() <= 0.0f)
+		return Vector3();
+
+	float weight = powerHeuristic(pdf, materialPdf(direction, lightDir, hitData));
+	return evaluateMaterial(direction, lightDir, hitData) * emission * shadowFactor * (cosTheta * weight / pdf);
+}
+
+Vector3 PathTracer::sampleEnvironment(const Vector3& direction, const HitData& hitData) {
+	if (scene->environment == NULL)
+		return Vector3();
+
+	//pick a direction by brightness
+	float u1, u2;
+	uniform2D(u1, u2);
+	Vector3 lightDir;
+	float pdf;
+	Vector3 emission = scene->environment->Sample(u1, u2, lightDir, pdf);
+	float cosTheta = lightDir.dot(hitData.normal);
+	if (pdf <= 0.0f || cosTheta <= 0.0f)
+		return Vector3();
+
+	Vector3 shadowFactor;
+	Vector3 shadowOrigin = hitData.position + hitData.normal * PUSH_SPAWNED_RAYS;
+	scene->TraceShadowRay(shadowOrigin, lightDir, shadowFactor, FLT_MAX);
+	if (shadowFactor.MaxComponent() <= 0.0f)
+		return Vector3();
+
+	float weight = powerHeuristic(pdf, materialPdf(direction, lightDir, hitData));
+	return evaluateMaterial(direction, lightDir, hitData) * emission * shadowFactor * (cosTheta * weight / pdf);
+}
+
+float PathTracer::emitterPdf(const Vector3& emission, float distance, const Vector3& lightDir, const Vector3& emitterNormal) {
+	float cosLight = abs(lightDir.dot(emitterNormal));
+	if (emitters->GetPower() <= 0.0f || cosLight <= 0.0f)
+		return 0.0f;
+	//emitters are chosen by area * luminance, then uniformly by area, so the area pdf is luminance / total power
+	return emission.Luminance() / emitters->GetPower() * distance * distance / cosLight;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include "Renderer.h"
+#include "AreaLight.h"
+
+// Maximum number of bounces of a path
+#define PATH_MAX_BOUNCES 16
+// Paths are continued with Russian roulette after this many bounces
+#define PATH_ROULETTE_BOUNCES 3
+// Highest survival probability for Russian roulette, so bright paths still terminate eventually
+#define PATH_MAX_SURVIVAL 0.95f
+
+// Unidirectional path tracer
+// Shares the scene, camera and lights with the Whitted renderer but estimates full global illumination:
+// at every hit the lights are sampled directly (next event estimation) and the path continues in a direction sampled from the material
+// Materials are interpreted as a Lambertian lobe (diffColor), a normalized Phong lobe (specColor, shininess) and perfect refraction (ktran)
+// Point and directional lights are scaled by pi so diffuse direct lighting matches the Whitted renderer
+class PathTracer : public Renderer {
+private:
+	// All primitives with a nonzero emissColor as one light, so emitters are chosen proportionally to their power
+	AreaLight* emitters;
+
+	// Trace a full path starting with the camera ray
+	Vector3 traceCameraRay(const Vector3& origin, const Vector3& direction, HitData& firstHitData, Object* firstHitObject, const Vector3* shadowFactors, bool record);
+	// Next event estimation traces its own shadow rays, so traceCameraRay gets no shadowFactors
+	bool traceCameraShadowRays(int, const Vector3*, const HitData*, Object* const*, Vector3*) {
+		return false;
+	}
+
+	// Evaluate the material at a hit for light arriving from lightDir and leaving towards -direction (cosine not included)
+	Vector3 evaluateMaterial(const Vector3& direction, const Vector3& lightDir, const HitData& hitData);
+	// Solid angle pdf of sampling lightDir when continuing the path, for the lobes that are not perfectly specular
+	float materialPdf(const Vector3& direction, const Vector3& lightDir, const HitData& hitData);
+	// Probabilities of choosing the diffuse, glossy and refraction lobes
+	void lobeProbabilities(const HitData& hitData, float& diffuse, float& glossy, float& refraction);
+
+	// Direct light from point and directional lights (no MIS needed, they can't be hit by chance)
+	Vector3 sampleDeltaLights(const Vector3& direction, const HitData& hitData);
+	Vector3 getDeltaLightRadiance(const Vector3& direction, const LightSource* light, const HitData& hitData);
+	// Direct light from one emissive primitive, weighted against material sampling with the power heuristic
+	Vector3 sampleEmitters(const Vector3& direction, const HitData& hitData);
+	// Direct light from the scene's environment map, weighted against material sampling with the power heuristic
+	Vector3 sampleEnvironment(const Vector3& direction, const HitData& hitData);
+	// Solid angle pdf of sampleEmitters choosing the point hit with the given emission, seen from distance along lightDir
+	float emitterPdf(const Vector3& emission, float distance, const Vector3& lightDir, const Vector3& emitterNormal);
+
+	// Power heuristic for combining two sampling techniques
+	static float powerHeuristic(float pdf, float otherPdf) {
+		return (pdf * pdf) / (pdf * pdf + otherPdf * otherPdf);
+	}
+
+public:
+	PathTracer(Scene* scene, int samplesPerPixel = 1);
+	~PathTracer();
+};
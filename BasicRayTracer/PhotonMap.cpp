@@ -0,0 +1,100 @@
+#include "PhotonMap.h"
+#define _USE_MATH_DEFINES
+#include <cmath>
+
+PhotonMap::PhotonMap(const std::vector<Photon>& photons) : photons(photons) {
+	//the two sides of each split are disjoint ranges, so they can be built independently
+	TaskGroup group;
+	buildNode(0, (int)this->photons.size(), 0, group);
+	group.Wait();
+}
+
+int PhotonMap::splitRange(int start, int end) {
+	//split along the longest axis of the photons' bounds
+	BoundingBox bounds;
+	bounds.minCorner = bounds.maxCorner = photons[start].position;
+	for (int i = start + 1; i < end; i++) {
+		BoundingBox point;
+		point.minCorner = point.maxCorner = photons[i].position;
+		bounds.Expand(point);
+	}
+	int axis = bounds.LongestAxis();
+
+	int mid = (start + end) / 2;
+	std::nth_element(photons.begin() + start, photons.begin() + mid, photons.begin() + end, [axis](const Photon& a, const Photon& b) {
+		return a.position.Get(axis) < b.position.Get(axis);
+	});
+	photons[mid].axis = axis;
+	return mid;
+}
+
+void PhotonMap::buildNode(int start, int end, int depth, TaskGroup& group) {
+	if (start >= end)
+		return;
+	int mid = splitRange(start, end);
+	if (depth < PHOTON_MAP_PARALLEL_DEPTH) {
+		group.Run([this, start, mid, depth, &group]() {
+			buildNode(start, mid, depth + 1, group);
+		});
+	}
+	else {
+		buildNode(start, mid, depth + 1, group);
+	}
+	buildNode(mid + 1, end, depth + 1, group);
+}
+
+void PhotonMap::locateNearest(int start, int end, const Vector3& position, int k, float& maxDistanceSquared, std::vector<std::pair<float, int>>& nearest) const {
+	if (start >= end)
+		return;
+	int mid = (start + end) / 2;
+	const Photon& photon = photons[mid];
+
+	//search the side of the splitting plane the point is on first, then the other side if it is close enough
+	float delta = position.Get(photon.axis) - photon.position.Get(photon.axis);
+	if (delta < 0.0f) {
+		locateNearest(start, mid, position, k, maxDistanceSquared, nearest);
+		if (delta * delta < maxDistanceSquared)
+			locateNearest(mid + 1, end, position, k, maxDistanceSquared, nearest);
+	}
+	else {
+		locateNearest(mid + 1, end, position, k, maxDistanceSquared, nearest);
+		if (delta * delta < maxDistanceSquared)
+			locateNearest(start, mid, position, k, maxDistanceSquared, nearest);
+	}
+
+	Vector3 offset = photon.position - position;
+	float distanceSquared = offset.dot(offset);
+	if (distanceSquared < maxDistanceSquared) {
+		//nearest is a max heap on distance, so the farthest photon is replaced first
+		if (nearest.size() == k) {
+			std::pop_heap(nearest.begin(), nearest.end());
+			nearest.pop_back();
+		}
+		nearest.push_back(std::make_pair(distanceSquared, mid));
+		std::push_heap(nearest.begin(), nearest.end());
+		if (nearest.size() == k)
+			maxDistanceSquared = nearest.front().first;
+	}
+}
+
+Vector3 PhotonMap::GetIrradiance(const Vector3& position, const Vector3& normal, int k, float maxDistance) const {
+	std::vector<std::pair<float, int>> nearest;
+	nearest.reserve(k);
+	float maxDistanceSquared = maxDistance * maxDistance;
+	locateNearest(0, photons.size(), position, k, maxDistanceSquared, nearest);
+	if (nearest.empty())
+		return Vector3();
+
+	//cone filter, weight falls off linearly to 0 at the radius of the search
+	float radius = sqrt(maxDistanceSquared);
+	Vector3 flux;
+	for (int i = 0; i < nearest.size(); i++) {
+		const Photon& photon = photons[nearest[i].second];
+		if (photon.direction.dot(normal) >= 0.0f)
+			continue;
+		float weight = 1.0f - sqrt(nearest[i].first) / radius;
+		flux += photon.power * weight;
+	}
+	//the cone filter integrates to 1/3 of the disc
+	return flux / ((M_PI / 3.0f) * maxDistanceSquared);
+}
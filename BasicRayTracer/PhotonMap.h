@@ -0,0 +1,47 @@
+#pragma once
+#include "BoundingBox.h"
+#include "TaskScheduler.h"
+#include <vector>
+
+// Subtrees down to this depth are built as separate tasks
+#define PHOTON_MAP_PARALLEL_DEPTH 4
+
+// Light carried to a surface by one photon
+struct Photon {
+	Vector3 position;
+	// Direction the photon was travelling in when it hit
+	Vector3 direction;
+	// Flux
+	Vector3 power;
+	// Splitting axis of the kd-tree node this photon is
+	int axis;
+};
+
+// Balanced kd-tree over photons for k-nearest-neighbour density estimation
+// The tree is implicit: every range of photons is split at its median, which is the node for that range
+// See Jensen 1996, "Global Illumination using Photon Maps"
+class PhotonMap {
+private:
+	std::vector<Photon> photons;
+
+	// Recursive function to build the tree over photons[start, end), spawning the subtrees of nodes above PHOTON_MAP_PARALLEL_DEPTH into group
+	void buildNode(int start, int end, int depth, TaskGroup& group);
+	// Split photons[start, end) at its median and return the median's index
+	int splitRange(int start, int end);
+
+	// Recursive function to find the k nearest photons to position in photons[start, end)
+	// maxDistanceSquared shrinks to the distance of the k-th nearest photon once k are found
+	void locateNearest(int start, int end, const Vector3& position, int k, float& maxDistanceSquared, std::vector<std::pair<float, int>>& nearest) const;
+
+public:
+	// Build the tree using the threads of the task scheduler
+	PhotonMap(const std::vector<Photon>& photons);
+
+	// Irradiance at position estimated from the k nearest photons within maxDistance, with a cone filter
+	// Only photons arriving at the side normal points to are counted
+	Vector3 GetIrradiance(const Vector3& position, const Vector3& normal, int k, float maxDistance) const;
+
+	int NumPhotons() const {
+		return photons.size();
+	}
+};
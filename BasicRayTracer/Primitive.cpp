@@ -21,6 +21,7 @@ bool Sphere::intersects(const Vector3& origin, const Vector3& direction, HitData
 
 		//set HitData
 		hitData.t = t;
+		hitData.primitive = this;
 		hitData.position = origin + direction * t;
 		hitData.normal = (hitData.position - center).normalize();
 		hitData.material = *material;
@@ -52,6 +53,7 @@ bool Sphere::intersects(const Vector3& origin, const Vector3& direction, HitData
 
 		//set HitData
 		hitData.t = t;
+		hitData.primitive = this;
 		hitData.position = origin + direction * t;
 		hitData.normal = (hitData.position - center).normalize();
 		hitData.material = *material;
@@ -115,6 +117,7 @@ bool Triangle::intersects(const Vector3& origin, const Vector3& direction, HitDa
 	if (t > FLT_EPSILON) {
 		//set HitData
 		hitData.t = t;
+		hitData.primitive = this;
 		hitData.position = origin + direction * t;
 		//interpolate normals, material, and texture coords using u & v
 		hitData.normal = ((n[0] * (1.0f - (u + v))) + (n[1] * u) + (n[2] * v)).normalize();
@@ -158,4 +161,31 @@ Vector3 Sphere::GetMidpoint() {
 
 Vector3 Triangle::GetMidpoint() {
 	return (v[0] + v[1] + v[2]) * (1.0f / 3.0f);
+}
+
+float Sphere::GetArea() {
+	return 4.0f * M_PI * radius * radius;
+}
+
+float Triangle::GetArea() {
+	return (v[1] - v[0]).cross(v[2] - v[0]).length() * 0.5f;
+}
+
+void Sphere::SamplePoint(float u1, float u2, Vector3& position, Vector3& normal) {
+	//uniform direction
+	float z = 1.0f - 2.0f * u1;
+	float r = sqrt(max(1.0f - z * z, 0.0f));
+	float phi = 2.0f * M_PI * u2;
+	normal = Vector3(r * cos(phi), r * sin(phi), z);
+	position = center + normal * radius;
+}
+
+void Triangle::SamplePoint(float u1, float u2, Vector3& position, Vector3& normal) {
+	//uniform barycentric coordinates
+	float su = sqrt(u1);
+	float b1 = 1.0f - su;
+	float b2 = u2 * su;
+	float b0 = 1.0f - b1 - b2;
+	position = v[0] * b0 + v[1] * b1 + v[2] * b2;
+	normal = (n[0] * b0 + n[1] * b1 + n[2] * b2).normalize();
 }
\ No newline at end of file
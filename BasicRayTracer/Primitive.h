@@ -25,6 +25,19 @@ public:
 	virtual Vector3 GetMidpoint() = 0;
 
 	virtual void SetBSSRDF(BSSRDF* bssrdf) = 0;
+	virtual BSSRDF* GetBSSRDF() = 0;
+
+	// Surface area
+	virtual float GetArea() = 0;
+
+	// Uniformly pick a point on the surface using two uniform random numbers in [0,1)
+	virtual void SamplePoint(float u1, float u2, Vector3& position, Vector3& normal) = 0;
+
+	// Emitted radiance, averaged over the surface
+	virtual Vector3 GetEmission() = 0;
+
+	// Material averaged over the surface
+	virtual Material GetMaterial() = 0;
 };
 
 // A sphere
@@ -45,6 +58,17 @@ public:
 	void SetBSSRDF(BSSRDF* bssrdf) {
 		this->material->bssrdf = bssrdf;
 	}
+	BSSRDF* GetBSSRDF() {
+		return this->material->bssrdf;
+	}
+	float GetArea();
+	void SamplePoint(float u1, float u2, Vector3& position, Vector3& normal);
+	Vector3 GetEmission() {
+		return this->material->emissColor;
+	}
+	Material GetMaterial() {
+		return *this->material;
+	}
 };
 
 // Triangle primitive
@@ -89,4 +113,15 @@ public:
 	void SetBSSRDF(BSSRDF* bssrdf) {
 		this->m[0]->bssrdf = this->m[1]->bssrdf = this->m[2]->bssrdf = bssrdf;
 	}
+	BSSRDF* GetBSSRDF() {
+		return this->m[0]->bssrdf;
+	}
+	float GetArea();
+	void SamplePoint(float u1, float u2, Vector3& position, Vector3& normal);
+	Vector3 GetEmission() {
+		return (this->m[0]->emissColor + this->m[1]->emissColor + this->m[2]->emissColor) / 3.0f;
+	}
+	Material GetMaterial() {
+		return (*this->m[0] + *this->m[1] + *this->m[2]) * (1.0f / 3.0f);
+	}
 };
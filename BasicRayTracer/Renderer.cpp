@@ -1,54 +1,592 @@
 #include "Renderer.h"
+#include "FileUtil.h"
+#include "TaskScheduler.h"
+#include <atomic>
+#include <unordered_map>
+#include <memory>
+#include <cfloat>
+
+// Source of unique renderer ids
+static std::atomic<int> nextRendererId(0);
+
+// Per-thread cache of the last primitive that blocked a shadow ray toward each light
+struct ShadowOccluderCache {
+	// Renderer the cache was filled for, -1 if unused
+	int rendererId = -1;
+	std::unordered_map<const LightSource*, Primitive*> lastOccluder;
+};
+static thread_local ShadowOccluderCache shadowOccluderCache;
+
+// Per-thread sampler
+struct SamplerCache {
+	// Renderer the sampler was made for, -1 if unused
+	int rendererId = -1;
+	std::unique_ptr<Sampler> sampler;
+};
+static thread_local SamplerCache samplerCache;
 
 Renderer::Renderer(Scene* scene, int samplesPerPixel) : samplesPerPixel(samplesPerPixel), scene(scene) {
-	createSamplingPatterns();
+	id = nextRendererId++;
+#ifdef SAMPLER_SOBOL
+	samplerPrototype = new SobolSampler();
+#else
+	samplerPrototype = new IndependentSampler();
+#endif
+	lightSampler = new LightSampler(scene->lights);
+	//where each light can contribute
+	for (int i = 0; i < scene->lights.size(); i++) {
+		BoundingBox bounds;
+		lightBounded.push_back(scene->lights[i]->getInfluenceBounds(LIGHT_CULL_THRESHOLD / MAX_SURFACE_RESPONSE, bounds));
+		lightInfluence.push_back(bounds);
+		lightIndices[scene->lights[i]] = i;
+	}
+	lightmap = NULL;
+	visibilityCache = NULL;
+#ifdef VISIBILITY_CACHE
+	//intersection shaders cut holes the hash of the geometry can't see, so the cache would be reused after they change
+	bool intersectionShaders = false;
+	for (int i = 0; i < scene->GetObjects().size(); i++)
+		intersectionShaders = intersectionShaders || scene->GetObjects()[i]->intersectionShader != NULL;
+	if (intersectionShaders)
+		printf("Visibility cache: disabled, the scene has intersection shaders\n");
+	if (!scene->GetPrimitives().empty() && !intersectionShaders) {
+		visibilityCache = new VisibilityCache(getSceneBounds(), getVisibilityHash());
+		if (visibilityCache->Load(VISIBILITY_CACHE_FILE))
+			printf("Visibility cache: %d cells loaded\n", visibilityCache->NumCells());
+	}
+#endif
+#ifdef AREA_LIGHTS
+	findAreaLights();
+#endif
+	chooseKernels();
+	irradianceCache = NULL;
+#ifdef IRRADIANCE_CACHE
+	//the cache covers the whole scene
+	if (!scene->GetPrimitives().empty())
+		irradianceCache = new IrradianceCache(getSceneBounds());
+#endif
+	causticMap = NULL;
+	causticTransmission = false;
+#ifdef PHOTON_CAUSTICS
+	std::map<Object*, BoundingBox> causticTargets;
+	findCausticTargets(causticTargets);
+	causticTransmission = !causticTargets.empty() && !scene->lights.empty();
+#endif
+}
+
+void Renderer::Preprocess() {
+#ifdef PHOTON_CAUSTICS
+	if (causticMap == NULL)
+		buildCausticPhotonMap();
+#endif
+#ifdef SUBSURFACE_IRRADIANCE_TREE
+	if (irradianceTrees.empty())
+		buildIrradianceTrees();
+#endif
+}
+
+Renderer::~Renderer() {
+	delete lightSampler;
+	delete samplerPrototype;
+	if (irradianceCache != NULL)
+		printf("Irradiance cache: %d records\n", irradianceCache->NumRecords());
+	delete irradianceCache;
+	if (visibilityCache != NULL) {
+		visibilityCache->Flush();
+		printf("Visibility cache: %d cells\n", visibilityCache->NumCells());
+		visibilityCache->Save(VISIBILITY_CACHE_FILE);
+	}
+	delete visibilityCache;
+	delete lightmap;
+	delete causticMap;
+	for (auto it = irradianceTrees.begin(); it != irradianceTrees.end(); it++)
+		delete it->second;
+	for (int i = 0; i < areaLights.size(); i++)
+		delete areaLights[i];
+}
+
+void Renderer::findAreaLights() {
+	//group the emissive primitives by object
+	std::map<Object*, std::vector<Primitive*>> emitters;
+	const std::vector<Primitive*>& primitives = scene->GetPrimitives();
+	for (int i = 0; i < primitives.size(); i++) {
+		if (primitives[i]->GetEmission().Luminance() * primitives[i]->GetArea() > 0.0f)
+			emitters[primitives[i]->parent].push_back(primitives[i]);
+	}
+	if (emitters.empty())
+		return;
+
+	int numPrimitives = 0;
+	for (auto it = emitters.begin(); it != emitters.end(); it++) {
+		areaLights.push_back(new AreaLight(it->second));
+		numPrimitives += it->second.size();
+	}
+	printf("Area lights: %d emissive objects, %d primitives\n", (int)areaLights.size(), numPrimitives);
+}
+
+void Renderer::buildIrradianceTrees() {
+	//find the surfaces that use each BSSRDF, in the order of their first primitive (not of the BSSRDFs' addresses,
+	//which change between runs)
+	std::vector<BSSRDF*> bssrdfs;
+	std::vector<std::vector<Primitive*>> surfaces;
+	std::map<BSSRDF*, int> surfaceIndices;
+	const std::vector<Primitive*>& primitives = scene->GetPrimitives();
+	for (int i = 0; i < primitives.size(); i++) {
+		BSSRDF* bssrdf = primitives[i]->GetBSSRDF();
+		if (bssrdf == NULL)
+			continue;
+		auto surfaceIndex = surfaceIndices.find(bssrdf);
+		if (surfaceIndex == surfaceIndices.end()) {
+			surfaceIndex = surfaceIndices.insert(std::make_pair(bssrdf, (int)surfaces.size())).first;
+			bssrdfs.push_back(bssrdf);
+			surfaces.push_back(std::vector<Primitive*>());
+		}
+		surfaces[surfaceIndex->second].push_back(primitives[i]);
+	}
+	if (surfaces.empty())
+		return;
+
+	Timer timer;
+	timer.startTimer();
+	//each BSSRDF's samples are placed here, then computed and built into a tree by a task that spreads its samples
+	//over the workers too
+	TaskGroup group;
+	std::vector<std::vector<IrradianceSample>> bssrdfSamples(surfaces.size());
+	std::vector<IrradianceTree*> trees(surfaces.size());
+	for (int index = 0; index < surfaces.size(); index++) {
+		BSSRDF* bssrdf = bssrdfs[index];
+		std::vector<Primitive*>& surface = surfaces[index];
+
+		//choose primitives proportionally to their area
+		std::vector<float> areas;
+		float totalArea = 0.0f;
+		for (int i = 0; i < surface.size(); i++) {
+			areas.push_back(surface[i]->GetArea());
+			totalArea += areas.back();
+		}
+		AliasTable areaTable(areas);
+
+		//place samples about a mean free path apart
+		float spacing = bssrdf->MeanFreePath() * IRRADIANCE_SAMPLE_SPACING;
+		float idealSamples = totalArea / (spacing * spacing);
+		int numSamples = (int)min(max(idealSamples, (float)IRRADIANCE_MIN_SAMPLES), (float)IRRADIANCE_MAX_SAMPLES);
+		std::vector<IrradianceSample>& samples = bssrdfSamples[index];
+		samples.resize(numSamples);
+		//each surface has its own sequence, the same every run (row -1 keeps it apart from the pixels' and photons' sequences)
+		Sampler* sampler = getSampler();
+		for (int i = 0; i < numSamples; i++) {
+			sampler->StartSample(index, -1, i);
+			float pdf, u, v;
+			Primitive* primitive = surface[areaTable.Sample(sampler->Get1D(), pdf)];
+			sampler->Get2D(u, v);
+			primitive->SamplePoint(u, v, samples[i].position, samples[i].normal);
+			samples[i].area = totalArea / numSamples;
+		}
+
+		group.Run([this, bssrdf, &samples, &trees, index]() {
+			//compute irradiance of all samples in parallel
+			const int CHUNK_SIZE = 1024;
+			TaskScheduler::Get().ParallelFor(0, (int)samples.size(), CHUNK_SIZE, [this, bssrdf, &samples](int i) {
+				computeIrradiance(bssrdf, samples[i]);
+			});
+			trees[index] = new IrradianceTree(bssrdf, samples);
+		});
+	}
+	group.Wait();
+
+	for (int index = 0; index < surfaces.size(); index++) {
+		irradianceTrees[bssrdfs[index]] = trees[index];
+		printf("Irradiance tree: %d samples\n", (int)bssrdfSamples[index].size());
+	}
+	timer.stopTimer();
+	printf("Irradiance preprocess time: %.5lf secs\n", timer.getTime());
 }
 
-void Renderer::createSamplingPatterns() {
-	//create sampling patterns
-	if (samplesPerPixel == 1) {
-		//for 1 spp, always go through center of pixel
-		SamplePoint p;
-		p.x = 0.5f;
-		p.y = 0.5f;
-		samplePatterns.resize(1);
-		samplePatterns[0].push_back(p);
+void Renderer::computeIrradiance(BSSRDF* bssrdf, IrradianceSample& sample) {
+	//treat the point as perfectly diffuse and white
+	HitData hitData;
+	hitData.position = sample.position;
+	hitData.normal = sample.normal;
+	hitData.material.specColor = Vector3(0, 0, 0);
+	hitData.material.diffColor = Vector3(1, 1, 1);
+	hitData.material.ktran = 0.0f;
+
+	float oneovereta = 1.0f / bssrdf->eta;
+	sample.irradiance = Vector3();
+	for (int i = 0; i < scene->lights.size(); i++) {
+		Vector3 lightDir;
+		scene->lights[i]->getDirection(sample.position, lightDir);
+		//only the light transmitted through the surface scatters
+		float FtIncident = 1.0f - bssrdf->FresnelReflectance(abs(lightDir.dot(sample.normal)), oneovereta);
+		sample.irradiance += getLightRadiance(-sample.normal, scene->lights[i], hitData) * FtIncident;
+	}
+}
+
+void Renderer::BakeLightmap(const char* path) {
+	delete lightmap;
+	lightmap = NULL;
+	if (scene->GetPrimitives().empty())
+		return;
+#ifdef SUBSURFACE_IRRADIANCE_TREE
+	//the subsurface light is baked from the irradiance trees, the caustic photon map isn't needed
+	if (irradianceTrees.empty())
+		buildIrradianceTrees();
+#endif
+	Lightmap* baked = new Lightmap(scene->GetObjects(), getSceneBounds(), getLightmapHash());
+	printf("Baking lightmap: %d charts, %d texels\n", baked->NumCharts(), baked->NumTexels());
+
+	Timer timer;
+	timer.startTimer();
+	//a task for each chart, which splits large charts into tasks of a few rows
+	const int ROWS_PER_TASK = 16;
+	TaskScheduler& scheduler = TaskScheduler::Get();
+	scheduler.ParallelFor(0, baked->NumCharts(), 1, [this, baked, &scheduler](int c) {
+		const LightmapChart& chart = baked->GetChart(c);
+		scheduler.ParallelFor(0, chart.size, ROWS_PER_TASK, [this, baked, &chart](int y) {
+			for (int x = 0; x < chart.size; x++)
+				baked->Texel(chart, x, y) = bakeTexel(baked, chart, x, y);
+		});
+	});
+	timer.stopTimer();
+	printf("Lightmap bake time: %.5lf secs\n", timer.getTime());
+
+	baked->Save(path);
+	lightmap = baked;
+}
+
+bool Renderer::LoadLightmap(const char* path) {
+	delete lightmap;
+	lightmap = NULL;
+	if (scene->GetPrimitives().empty())
+		return false;
+	Lightmap* loaded = new Lightmap(scene->GetObjects(), getSceneBounds(), getLightmapHash());
+	if (!loaded->Load(path)) {
+		delete loaded;
+		return false;
+	}
+	printf("Lightmap: %d charts, %d texels loaded\n", loaded->NumCharts(), loaded->NumTexels());
+	lightmap = loaded;
+	return true;
+}
+
+Vector3 Renderer::bakeTexel(Lightmap* baked, const LightmapChart& chart, int x, int y) {
+	BSSRDF* bssrdf = chart.primitive->GetBSSRDF();
+	Vector3 value;
+	for (int n = 0; n < LIGHTMAP_SAMPLES_PER_TEXEL; n++) {
+		//a jittered point in the texel
+		getSampler()->StartSample(chart.x + x, chart.y + y, n);
+		float u1, u2;
+		uniform2D(u1, u2);
+		HitData hitData;
+		baked->GetSurfacePoint(chart, (x + u1) / chart.size, (y + u2) / chart.size, hitData.position, hitData.normal);
+		hitData.primitive = chart.primitive;
+		//treat the point as perfectly diffuse and white, so the light reflected is the irradiance
+		hitData.material.specColor = Vector3(0, 0, 0);
+		hitData.material.diffColor = Vector3(1, 1, 1);
+		hitData.material.ktran = 0.0f;
+		hitData.material.bssrdf = bssrdf;
+		if (bssrdf != NULL)
+			value += getSubsurfaceDiffuseExitance(hitData);
+		else
+			value += getLighting(-hitData.normal, hitData);
+	}
+	return value / LIGHTMAP_SAMPLES_PER_TEXEL;
+}
+
+unsigned long long Renderer::getLightmapHash() {
+	int settings[] = { LIGHTMAP_RESOLUTION, LIGHTMAP_SAMPLES_PER_TEXEL, (int)areaLights.size(), scene->environment != NULL, causticTransmission };
+	return scene->HashLighting(FileUtil::Hash(settings, sizeof(settings), getVisibilityHash()));
+}
+
+BoundingBox Renderer::getSceneBounds() {
+	const std::vector<Primitive*>& primitives = scene->GetPrimitives();
+	BoundingBox bounds = primitives[0]->GetBounds();
+	for (int i = 1; i < primitives.size(); i++)
+		bounds.Expand(primitives[i]->GetBounds());
+	return bounds;
+}
+
+void Renderer::findCausticTargets(std::map<Object*, BoundingBox>& targetBounds) {
+	//anything reflective or refractive can focus light
+	const std::vector<Primitive*>& primitives = scene->GetPrimitives();
+	for (int i = 0; i < primitives.size(); i++) {
+		Material material = primitives[i]->GetMaterial();
+		if (material.specColor.MaxComponent() <= MIN_SHININESS && material.ktran <= MIN_TRANSPARENCY)
+			continue;
+		auto target = targetBounds.find(primitives[i]->parent);
+		if (target == targetBounds.end())
+			targetBounds[primitives[i]->parent] = primitives[i]->GetBounds();
+		else
+			target->second.Expand(primitives[i]->GetBounds());
+	}
+}
+
+void Renderer::buildCausticPhotonMap() {
+	//aim photons at the bounding sphere of each object that can focus light
+	std::map<Object*, BoundingBox> targetBounds;
+	findCausticTargets(targetBounds);
+	if (targetBounds.empty() || scene->lights.empty())
+		return;
+	std::vector<Object*> targetObjects;
+	std::vector<Vector3> targetCenters;
+	std::vector<float> targetRadii;
+	for (auto it = targetBounds.begin(); it != targetBounds.end(); it++) {
+		targetObjects.push_back(it->first);
+		targetCenters.push_back(it->second.GetMidpoint());
+		targetRadii.push_back((it->second.maxCorner - it->second.minCorner).length() * 0.5f);
+	}
+
+	BoundingBox sceneBounds = getSceneBounds();
+	float sceneSize = (sceneBounds.maxCorner - sceneBounds.minCorner).length();
+	causticRadius = sceneSize * CAUSTIC_MAX_RADIUS;
+
+	Timer timer;
+	timer.startTimer();
+	//split the photons evenly between every light and target, each task stores its photons separately
+	struct PhotonTask {
+		int lightIndex, targetIndex, start, end;
+	};
+	int photonsPerTarget = max(CAUSTIC_PHOTONS / (int)(scene->lights.size() * targetCenters.size()), 1);
+	std::vector<PhotonTask> tasks;
+	for (int lightIndex = 0; lightIndex < scene->lights.size(); lightIndex++) {
+		for (int targetIndex = 0; targetIndex < targetCenters.size(); targetIndex++) {
+			for (int start = 0; start < photonsPerTarget; start += CAUSTIC_PHOTONS_PER_TASK) {
+				PhotonTask task = { lightIndex, targetIndex, start, min(start + CAUSTIC_PHOTONS_PER_TASK, photonsPerTarget) };
+				tasks.push_back(task);
+			}
+		}
+	}
+	std::vector<std::vector<Photon>> taskPhotons(tasks.size());
+	TaskScheduler::Get().ParallelFor(0, (int)tasks.size(), 1, [&](int t) {
+		const PhotonTask& task = tasks[t];
+		const LightSource* light = scene->lights[task.lightIndex];
+		Sampler* sampler = getSampler();
+		for (int n = task.start; n < task.end; n++) {
+			//photons of each light and target form one sample sequence
+			sampler->StartSample(task.lightIndex, task.targetIndex, n);
+			Vector3 origin, direction, power;
+			bool firstHitAttenuation;
+			emitCausticPhoton(light, targetCenters[task.targetIndex], targetRadii[task.targetIndex], sceneSize, photonsPerTarget, origin, direction, power, firstHitAttenuation);
+			tracePhoton(origin, direction, power, light, firstHitAttenuation, targetObjects[task.targetIndex], taskPhotons[t]);
+		}
+	});
+
+	std::vector<Photon> photons;
+	for (int i = 0; i < taskPhotons.size(); i++)
+		photons.insert(photons.end(), taskPhotons[i].begin(), taskPhotons[i].end());
+	if (!photons.empty())
+		causticMap = new PhotonMap(photons);
+	timer.stopTimer();
+	printf("Caustic photon map: %d photons stored\n", (int)photons.size());
+	printf("Photon tracing time: %.5lf secs\n", timer.getTime());
+}
+
+void Renderer::emitCausticPhoton(const LightSource* light, const Vector3& targetCenter, float targetRadius, float sceneSize, int numPhotons,
+	Vector3& origin, Vector3& direction, Vector3& power, bool& firstHitAttenuation) {
+	float u1, u2;
+	uniform2D(u1, u2);
+	float phi = 2.0f * M_PI * u2;
+	Vector3 tangent, bitangent;
+
+	//lights are scaled by pi like in the path tracer, so photons match the diffuse lighting of the Whitted renderer
+	const PointLightSource* pointLight = dynamic_cast<const PointLightSource*>(light);
+	if (pointLight != NULL) {
+		//uniformly inside the cone around the target, or every direction if the light is inside it
+		Vector3 toTarget = targetCenter - pointLight->position;
+		float distance = toTarget.length();
+		float cosMax = -1.0f;
+		Vector3 axis(0.0f, 0.0f, 1.0f);
+		if (distance > targetRadius) {
+			cosMax = sqrt(1.0f - (targetRadius * targetRadius) / (distance * distance));
+			axis = toTarget / distance;
+		}
+		axis.CreateNormalSpace(tangent, bitangent);
+		float cosTheta = 1.0f - u1 * (1.0f - cosMax);
+		float sinTheta = sqrt(max(1.0f - cosTheta * cosTheta, 0.0f));
+		origin = pointLight->position;
+		direction = tangent * (sinTheta * cos(phi)) + bitangent * (sinTheta * sin(phi)) + axis * cosTheta;
+		float solidAngle = 2.0f * M_PI * (1.0f - cosMax);
+		power = light->color * (M_PI * solidAngle * light->getFalloff(origin + direction) / numPhotons);
+		firstHitAttenuation = true;
 	}
 	else {
-		//make sure samplesPerPixel is a power of 2
-		if ((samplesPerPixel & (samplesPerPixel - 1)) != 0) {
-			printf("Samples per pixel must be a power of 2.\n");
-			exit(0);
+		//uniformly over a disc covering the target, starting outside the scene
+		Vector3 lightDirection;
+		light->getDirection(targetCenter, lightDirection);
+		direction = -lightDirection;
+		direction.CreateNormalSpace(tangent, bitangent);
+		float r = targetRadius * sqrt(u1);
+		origin = targetCenter + tangent * (r * cos(phi)) + bitangent * (r * sin(phi)) + lightDirection * sceneSize;
+		power = light->color * (M_PI * M_PI * targetRadius * targetRadius / numPhotons);
+		firstHitAttenuation = false;
+	}
+}
+
+void Renderer::tracePhoton(Vector3 origin, Vector3 direction, Vector3 power, const LightSource* light, bool firstHitAttenuation, const Object* target, std::vector<Photon>& photons) {
+	std::vector<Object*> insideStack;
+	bool specularPath = false;
+	for (int bounce = 0; bounce <= MAX_BOUNCES; bounce++) {
+		HitData hitData;
+		Object* hitObject = NULL;
+		if (!scene->GetClosestIntersection(origin, direction, hitData, &hitObject))
+			return;
+		//light reaching another target first is carried by that target's photons, the cones can overlap
+		if (bounce == 0 && hitObject != target)
+			return;
+		//point lights fall off like the light's attenuation, as intensity * attenuation * distance^2 / distance^2
+		if (bounce == 0 && firstHitAttenuation)
+			power = power * (light->getAttenuation(hitData.t) * hitData.t * hitData.t);
+
+		//orient normal like traceRay does
+		if (!insideStack.empty() && std::find(insideStack.begin(), insideStack.end(), hitObject) != insideStack.end())
+			hitData.normal = -hitData.normal;
+		if (direction.dot(hitData.normal) > 0.0f)
+			hitData.normal = -hitData.normal;
+		if (hitObject->colorShader != NULL)
+			hitObject->colorShader->Shade(hitData, hitData.material);
+		if (hitData.material.bssrdf != NULL)
+			return;
+
+		//store caustic photons on diffuse surfaces
+		if (specularPath && hitData.material.diffColor.MaxComponent() > 0.0f && hitData.material.ktran < 1.0f) {
+			Photon photon;
+			photon.position = hitData.position;
+			photon.direction = direction;
+			photon.power = power;
+			photon.axis = 0;
+			photons.push_back(photon);
 		}
 
-		int size = (int)sqrt(samplesPerPixel);
-		//generate sample points
-		samplePatterns.resize(NUM_SAMPLING_PATTERNS);
-		for (int i = 0; i < NUM_SAMPLING_PATTERNS; i++) {
-			for (int x = 0; x < size; x++) {
-				for (int y = 0; y < size; y++) {
-					//find bounds of this sample point
-					float xMin = (float)x / size;
-					float yMin = (float)y / size;
-					float xMax = (float)(x + 1) / size;
-					float yMax = (float)(y + 1) / size;
-
-					//randomly choose values between bounds
-					SamplePoint p;
-					p.x = ((float)rand() / RAND_MAX) * (xMax - xMin) + xMin;
-					p.y = ((float)rand() / RAND_MAX) * (yMax - yMin) + yMin;
-
-					//add to array
-					samplePatterns[i].push_back(p);
-				}
+		//continue along a specular bounce chosen with russian roulette
+		float reflectProbability = (hitData.material.specColor.MaxComponent() > MIN_SHININESS) ? hitData.material.specColor.Luminance() : 0.0f;
+		float refractProbability = (hitData.material.ktran > MIN_TRANSPARENCY) ? hitData.material.ktran : 0.0f;
+		float scale = max(reflectProbability + refractProbability, 1.0f);
+		reflectProbability /= scale;
+		refractProbability /= scale;
+		float u = uniform();
+		if (u < reflectProbability) {
+			power = power * hitData.material.specColor / reflectProbability;
+			origin = hitData.position + hitData.normal * PUSH_SPAWNED_RAYS;
+			direction = -direction.reflect(hitData.normal).normalize();
+		}
+		else if (u < reflectProbability + refractProbability) {
+			power = power * (hitData.material.ktran / refractProbability);
+			std::vector<Object*> newInsideStack = insideStack;
+			float n1, n2;
+			auto insideObject = std::find(newInsideStack.begin(), newInsideStack.end(), hitObject);
+			if (insideObject == newInsideStack.end()) {
+				//entering a new object
+				n1 = newInsideStack.empty() ? 1.0f : newInsideStack.back()->indexOfRefraction;
+				newInsideStack.push_back(hitObject);
+				n2 = hitObject->indexOfRefraction;
+			}
+			else {
+				//leaving object
+				n1 = hitObject->indexOfRefraction;
+				newInsideStack.erase(insideObject);
+				n2 = newInsideStack.empty() ? 1.0f : newInsideStack.back()->indexOfRefraction;
+			}
+			Vector3 refractDir;
+			if ((-direction).refract(hitData.normal, n1 / n2, refractDir)) {
+				//total internal reflection
+				origin = hitData.position + hitData.normal * PUSH_SPAWNED_RAYS;
+				direction = -direction.reflect(hitData.normal).normalize();
+			}
+			else {
+				origin = hitData.position - hitData.normal * PUSH_SPAWNED_RAYS;
+				direction = (-refractDir).normalize();
+				insideStack = newInsideStack;
 			}
 		}
+		else {
+			return;
+		}
+		specularPath = true;
+	}
+}
+
+Sampler* Renderer::getSampler() {
+	//make a sampler the first time this thread renders for this renderer
+	if (samplerCache.rendererId != id) {
+		samplerCache.sampler.reset(samplerPrototype->Clone());
+		samplerCache.rendererId = id;
 	}
+	return samplerCache.sampler.get();
+}
+
+float Renderer::uniform() {
+	return getSampler()->Get1D();
+}
+
+void Renderer::uniform2D(float& u, float& v) {
+	getSampler()->Get2D(u, v);
 }
 
-void Renderer::ColorPixel(int i, int j, Vector3& outputColor) {
-	//record this ray?
-	bool record = (j == RECORD_J && i == RECORD_I && samplesPerPixel == 1);
+void Renderer::chooseKernels() {
+	kernelFeatures = KERNEL_ALL & ~KERNEL_RECORD;
+#ifdef SPECIALIZED_KERNELS
+	kernelFeatures = 0;
+	const std::vector<Object*>& objects = scene->GetObjects();
+	for (int i = 0; i < objects.size(); i++) {
+		//shaders can change any part of the material, e.g. GlassColorShader makes surfaces transparent
+		if (objects[i]->colorShader != NULL)
+			kernelFeatures |= KERNEL_SHADERS | KERNEL_TRANSPARENCY;
+	}
+	const std::vector<Primitive*>& primitives = scene->GetPrimitives();
+	for (int i = 0; i < primitives.size(); i++) {
+		if (primitives[i]->GetBSSRDF() != NULL)
+			kernelFeatures |= KERNEL_BSSRDF;
+		if (primitives[i]->GetMaterial().ktran > MIN_TRANSPARENCY)
+			kernelFeatures |= KERNEL_TRANSPARENCY;
+	}
+	if (scene->camera->HasDepthOfField())
+		kernelFeatures |= KERNEL_DOF;
+#endif
+	//the kernel with every feature is always correct
+	colorPixelsKernel = &Renderer::colorPixels<KERNEL_ALL>;
+	shadeHitKernel = &Renderer::shadeHit<KERNEL_ALL>;
+	selectKernels<0>(kernelFeatures);
+	printf("Trace kernel:%s%s%s%s\n", (kernelFeatures & KERNEL_SHADERS) ? " shaders" : "", (kernelFeatures & KERNEL_BSSRDF) ? " bssrdf" : "",
+		(kernelFeatures & KERNEL_TRANSPARENCY) ? " transparency" : "", (kernelFeatures & KERNEL_DOF) ? " dof" : "");
+}
+
+// Recording only happens for one pixel, which always uses the kernel with every feature
+template <>
+void Renderer::selectKernels<KERNEL_RECORD>(int) {
+}
+
+template <int Features>
+void Renderer::selectKernels(int features) {
+	if (features != Features) {
+		selectKernels<Features + 1>(features);
+		return;
+	}
+	colorPixelsKernel = &Renderer::colorPixels<Features>;
+	shadeHitKernel = &Renderer::shadeHit<Features>;
+}
+
+void Renderer::ColorPixel(int i, int j, Vector3& outputColor, int pass, PixelFeatures* features) {
+	ColorPixels(i, i + 1, j, &outputColor, pass, features);
+}
+
+void Renderer::ColorPixels(int iStart, int iEnd, int j, Vector3* outputColors, int pass, PixelFeatures* features) {
+	//the recorded pixel is traced on its own with the kernel that has every feature
+	if (j == RECORD_J && iStart <= RECORD_I && RECORD_I < iEnd && samplesPerPixel == 1 && pass == 0) {
+		int offset = RECORD_I - iStart;
+		if (iStart < RECORD_I)
+			ColorPixels(iStart, RECORD_I, j, outputColors, pass, features);
+		colorPixels<KERNEL_ALL>(RECORD_I, RECORD_I + 1, j, outputColors + offset, pass, (features != NULL) ? features + offset : NULL);
+		if (RECORD_I + 1 < iEnd)
+			ColorPixels(RECORD_I + 1, iEnd, j, outputColors + offset + 1, pass, (features != NULL) ? features + offset + 1 : NULL);
+		return;
+	}
+	(this->*colorPixelsKernel)(iStart, iEnd, j, outputColors, pass, features);
+}
+
+template <int Features>
+void Renderer::colorPixels(int iStart, int iEnd, int j, Vector3* outputColors, int pass, PixelFeatures* features) {
+	//record this ray? (ColorPixels gives the recorded pixel a row of its own)
+	bool record = (Features & KERNEL_RECORD) && (j == RECORD_J && iStart == RECORD_I && samplesPerPixel == 1 && pass == 0);
 	//open file for writing
 	if (record) {
 		std::ofstream fout("recordScene.txt");
@@ -58,37 +596,91 @@ void Renderer::ColorPixel(int i, int j, Vector3& outputColor) {
 		recordNormalFile.open("recordNormal.txt");
 	}
 
-	Vector3 origin, direction;
+	Sampler* sampler = getSampler();
+	//numbers each sample draws for its camera ray
+	int cameraDimensions = (Features & KERNEL_DOF) ? 4 : 2;
 
-	//decide which sample pattern to use
-	int whichSamplePattern = (j * (int)scene->camera->imageWidth + i) % samplePatterns.size();
+	//camera rays of all samples of all pixels in the row
+	int numRays = (iEnd - iStart) * samplesPerPixel;
+	std::vector<Vector3> origins(numRays), directions(numRays);
+	for (int i = iStart; i < iEnd; i++) {
+		for (int n = 0; n < samplesPerPixel; n++) {
+			int ray = (i - iStart) * samplesPerPixel + n;
+			//each pass continues the sequence where the last one stopped
+			sampler->StartSample(i, j, pass * samplesPerPixel + n);
 
-	//take samples
-	std::vector<Vector3> sampleColors(samplesPerPixel);
-	for (int n = 0; n < samplesPerPixel; n++) {
-		//get position on image plane
-		float x = i + samplePatterns[whichSamplePattern][n].x;
-		float y = j + samplePatterns[whichSamplePattern][n].y;
+			//get position on image plane
+			float pixelX, pixelY;
+			sampler->Get2D(pixelX, pixelY);
+			//a single sample on the first pass goes through the center of the pixel
+			if (samplesPerPixel == 1 && pass == 0)
+				pixelX = pixelY = 0.5f;
+			float x = i + pixelX;
+			float y = j + pixelY;
 
-		//get position on lens plane
-		float u = rand() / (float)RAND_MAX;
-		float v = rand() / (float)RAND_MAX;
-
-		//get direction of this ray
-		scene->camera->GetRay(x, y, u, v, origin, direction);
+			//get direction of this ray, through a position on the lens plane
+			if (Features & KERNEL_DOF) {
+				float u, v;
+				sampler->Get2D(u, v);
+				scene->camera->GetRay(x, y, u, v, origins[ray], directions[ray]);
+			}
+			else {
+				scene->camera->GetPinholeRay(x, y, origins[ray], directions[ray]);
+			}
+		}
+	}
 
-		//trace
-		std::vector<Object*> insideStack;
-		traceRay(origin, direction, sampleColors[n], 0, insideStack, record);
+	//first hits
+	std::vector<HitData> hitData(numRays);
+	std::vector<Object*> hitObjects(numRays);
+#ifdef INTERLEAVED_CAMERA_RAYS
+	scene->GetClosestIntersections(numRays, origins.data(), directions.data(), hitData.data(), hitObjects.data());
+#else
+	for (int ray = 0; ray < numRays; ray++) {
+		hitObjects[ray] = NULL;
+		scene->GetClosestIntersection(origins[ray], directions[ray], hitData[ray], &hitObjects[ray]);
 	}
+#endif
+
+	//shadow rays from the first hits, numLights per ray
+	int numLights = scene->lights.size();
+	std::vector<Vector3> shadowFactors(numRays * numLights);
+	bool shadowsTraced = traceCameraShadowRays(numRays, directions.data(), hitData.data(), hitObjects.data(), shadowFactors.data());
+
+	for (int i = iStart; i < iEnd; i++) {
+		Vector3& outputColor = outputColors[i - iStart];
+		PixelFeatures* pixelFeatures = (features != NULL) ? &features[i - iStart] : NULL;
+		if (pixelFeatures != NULL)
+			*pixelFeatures = PixelFeatures();
 
-	//average samples(box filter) and output
-	outputColor = Vector3(0.0f, 0.0f, 0.0f);
-	for (int n = 0; n < samplesPerPixel; n++) {
-		outputColor += sampleColors[n];
+		//trace samples and average them (box filter)
+		outputColor = Vector3(0.0f, 0.0f, 0.0f);
+		for (int n = 0; n < samplesPerPixel; n++) {
+			int ray = (i - iStart) * samplesPerPixel + n;
+
+			//features through the same point
+			if (pixelFeatures != NULL) {
+				PixelFeatures sampleFeatures;
+				getFirstHitFeatures(directions[ray], hitData[ray], hitObjects[ray], sampleFeatures);
+				pixelFeatures->albedo += sampleFeatures.albedo / (float)samplesPerPixel;
+				pixelFeatures->normal += sampleFeatures.normal;
+				pixelFeatures->depth += sampleFeatures.depth;
+				pixelFeatures->coverage += sampleFeatures.coverage / (float)samplesPerPixel;
+			}
+
+			//carry on with the sample's numbers after the ones its camera ray used
+			sampler->StartSample(i, j, pass * samplesPerPixel + n, cameraDimensions);
+			const Vector3* rayShadowFactors = shadowsTraced ? shadowFactors.data() + ray * numLights : NULL;
+			outputColor += traceCameraRay(origins[ray], directions[ray], hitData[ray], hitObjects[ray], rayShadowFactors, record);
+		}
+		outputColor = outputColor / (float)samplesPerPixel;
+
+		//depth and normal are averaged over the samples that hit something
+		if (pixelFeatures != NULL && pixelFeatures->coverage > 0.0f) {
+			pixelFeatures->depth = pixelFeatures->depth / (pixelFeatures->coverage * samplesPerPixel);
+			pixelFeatures->normal = pixelFeatures->normal.normalize();
+		}
 	}
-	outputColor = outputColor / (float)samplesPerPixel;
-	
 
 	//close file if recording
 	if (record) {
@@ -97,115 +689,611 @@ void Renderer::ColorPixel(int i, int j, Vector3& outputColor) {
 	}
 }
 
-void Renderer::traceRay(const Vector3& origin, const Vector3& direction, Vector3& outputColor, int numBounces, std::vector<Object*> insideStack, bool record) {
+void Renderer::getFirstHitFeatures(const Vector3& direction, HitData hitData, Object* hitObject, PixelFeatures& features) {
+	features = PixelFeatures();
+	if (hitObject == NULL)
+		return;
+	if (direction.dot(hitData.normal) > 0.0f)
+		hitData.normal = -hitData.normal;
+	if (hitObject->colorShader != NULL)
+		hitObject->colorShader->Shade(hitData, hitData.material);
+
+	//everything the surface reflects or transmits, so mirrors and glass aren't treated as black
+	Vector3 albedo = hitData.material.diffColor * (1.0f - hitData.material.ktran) + hitData.material.specColor + hitData.material.ktran;
+	features.albedo = Vector3(min(albedo.x, 1.0f), min(albedo.y, 1.0f), min(albedo.z, 1.0f));
+	features.normal = hitData.normal;
+	features.depth = hitData.t;
+	features.coverage = 1.0f;
+}
+
+Vector3 Renderer::traceCameraRay(const Vector3& origin, const Vector3& direction, HitData& hitData, Object* hitObject, const Vector3* shadowFactors, bool record) {
+	Vector3 color;
+	if (hitObject == NULL)
+		return (scene->environment != NULL) ? scene->environment->Lookup(direction) : color;
+	std::vector<Object*> insideStack;
+	if (record)
+		shadeHit<KERNEL_ALL>(origin, direction, hitData, hitObject, color, 0, insideStack, record, Vector3(1.0f, 1.0f, 1.0f), shadowFactors);
+	else
+		(this->*shadeHitKernel)(origin, direction, hitData, hitObject, color, 0, insideStack, record, Vector3(1.0f, 1.0f, 1.0f), shadowFactors);
+	return color;
+}
+
+bool Renderer::traceCameraShadowRays(int numRays, const Vector3* directions, const HitData* hitData, Object* const* hitObjects, Vector3* shadowFactors) {
+#ifdef SHADOW_PACKETS
+	//sampled lights are only known once the hit is shaded
+	if (LIGHT_SAMPLES_PER_HIT > 0 && scene->lights.size() > LIGHT_SAMPLES_PER_HIT)
+		return false;
+	//with a lightmap most hits need no shadow rays at all
+	if (lightmap != NULL)
+		return false;
+
+	//bounds of the hits that use direct lighting
+	BoundingBox hitBounds;
+	bool anyHits = false;
+	for (int ray = 0; ray < numRays; ray++) {
+		//subsurface hits don't use direct lighting
+		if (hitObjects[ray] == NULL || hitData[ray].material.bssrdf != NULL)
+			continue;
+		BoundingBox point;
+		point.minCorner = point.maxCorner = hitData[ray].position;
+		if (anyHits)
+			hitBounds.Expand(point);
+		else
+			hitBounds = point;
+		anyHits = true;
+	}
+
+	//the shadow factors of lights that are culled stay 0
+	int numLights = scene->lights.size();
+	std::vector<int> rays;
+	std::vector<Vector3> origins, lightDirs, factors;
+	std::vector<float> lightDists;
+	for (int l = 0; l < numLights && anyHits; l++) {
+		const LightSource* light = scene->lights[l];
+		//light list of the row, lights that can't reach any of the hits are skipped as a whole
+		if (lightBounded[l] && !lightInfluence[l].Overlaps(hitBounds))
+			continue;
+		rays.clear();
+		origins.clear();
+		lightDirs.clear();
+		lightDists.clear();
+		for (int ray = 0; ray < numRays; ray++) {
+			if (hitObjects[ray] == NULL || hitData[ray].material.bssrdf != NULL)
+				continue;
+			//the same shadow ray getLightRadiance would trace, from the side of the surface the camera sees
+			HitData orientedHit = hitData[ray];
+			if (directions[ray].dot(orientedHit.normal) > 0.0f)
+				orientedHit.normal = -orientedHit.normal;
+			Vector3 lightDir;
+			light->getDirection(orientedHit.position, lightDir);
+			float lightDist = light->getDistance(orientedHit.position);
+			//without a shader the material is known, so getLightRadiance's culling can be done here too
+			if (hitObjects[ray]->colorShader == NULL && getUnshadowedLightRadiance(directions[ray], light, orientedHit, lightDir, lightDist).MaxComponent() < LIGHT_CULL_THRESHOLD)
+				continue;
+			//known from the visibility cache?
+			if (visibilityCache != NULL && visibilityCache->Lookup(l, orientedHit.position, shadowFactors[ray * numLights + l]))
+				continue;
+			rays.push_back(ray);
+			origins.push_back(orientedHit.position + orientedHit.normal * PUSH_SPAWNED_RAYS);
+			lightDirs.push_back(lightDir);
+			lightDists.push_back(lightDist);
+		}
+		if (rays.empty())
+			continue;
+
+#ifdef SHADOW_OCCLUDER_CACHE
+		Primitive** occluder = getCachedOccluder(light);
+#else
+		Primitive** occluder = NULL;
+#endif
+		factors.resize(rays.size());
+		if (lightDists[0] < FLT_MAX) {
+			//rays toward a point converge, so they stay together through the tree
+			scene->TraceShadowRays(rays.size(), origins.data(), lightDirs.data(), lightDists.data(), factors.data(), occluder);
+		}
+		else {
+			//parallel rays have no common end to cull the packet with
+			for (int i = 0; i < rays.size(); i++)
+				scene->TraceShadowRay(origins[i], lightDirs[i], factors[i], lightDists[i], occluder);
+		}
+		for (int i = 0; i < rays.size(); i++) {
+			shadowFactors[rays[i] * numLights + l] = factors[i];
+			if (visibilityCache != NULL)
+				visibilityCache->Add(l, hitData[rays[i]].position, factors[i]);
+		}
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+float Renderer::spawnFactor(const Vector3& weight) {
+	float maxWeight = weight.MaxComponent();
+	if (maxWeight >= MIN_RAY_WEIGHT)
+		return 1.0f;
+#ifdef RUSSIAN_ROULETTE
+	//survive with probability proportional to the weight, and boost survivors to keep the estimate unbiased
+	float survival = maxWeight / MIN_RAY_WEIGHT;
+	if (uniform() < survival)
+		return 1.0f / survival;
+#endif
+	return 0.0f;
+}
+
+template <int Features>
+void Renderer::traceRay(const Vector3& origin, const Vector3& direction, Vector3& outputColor, int numBounces, std::vector<Object*> insideStack, bool record, const Vector3& weight) {
 	if (numBounces > MAX_BOUNCES)
 		return;
 
 	HitData hitData;
 	Object* hitObject = NULL;
-	if (scene->GetClosestIntersection(origin, direction, hitData, &hitObject)) {
-		//flip normal if inside object and hitting the other side of it
-		if (!insideStack.empty() && std::find(insideStack.begin(), insideStack.end(), hitObject) != insideStack.end())
-			hitData.normal = -hitData.normal;
-		//always make normals face towards ray direction: can't rely on above for objects that use an intersection shader
-		if (direction.dot(hitData.normal) > 0.0f) // TODO: && hitObject->intersectionShader != NULL
-			hitData.normal = -hitData.normal;
+	if (scene->GetClosestIntersection(origin, direction, hitData, &hitObject))
+		shadeHit<Features>(origin, direction, hitData, hitObject, outputColor, numBounces, insideStack, record, weight, NULL);
+	else if (scene->environment != NULL)
+		outputColor = scene->environment->Lookup(direction);
+}
 
-		//record this segment for RayVisualizer
-		if (record) {
-			recordRay(origin, hitData.position, hitData.normal);
-		}
+template <int Features>
+void Renderer::shadeHit(const Vector3& origin, const Vector3& direction, HitData& hitData, Object* hitObject, Vector3& outputColor, int numBounces, std::vector<Object*> insideStack, bool record, const Vector3& weight, const Vector3* shadowFactors) {
+	//flip normal if inside object and hitting the other side of it
+	if ((Features & KERNEL_TRANSPARENCY) && !insideStack.empty() && std::find(insideStack.begin(), insideStack.end(), hitObject) != insideStack.end())
+		hitData.normal = -hitData.normal;
+	//always make normals face towards ray direction: can't rely on above for objects that use an intersection shader
+	if (direction.dot(hitData.normal) > 0.0f) // TODO: && hitObject->intersectionShader != NULL
+		hitData.normal = -hitData.normal;
 
-		// Apply color shader
-		if (hitObject->colorShader != NULL)
-			hitObject->colorShader->Shade(hitData, hitData.material);
+	//record this segment for RayVisualizer
+	if ((Features & KERNEL_RECORD) && record) {
+		recordRay(origin, hitData.position, hitData.normal);
+	}
 
-		//subsurface scattering
-		if (hitData.material.bssrdf != NULL) {
-			outputColor = getSubsurfaceRadiance(direction, hitData);
-			return;
-		}
+	// Apply color shader
+	if ((Features & KERNEL_SHADERS) && hitObject->colorShader != NULL)
+		hitObject->colorShader->Shade(hitData, hitData.material);
 
-		// Calculate lighting for this hit
-		//ambient lighitng
-		Vector3 radiance = hitData.material.ambColor * hitData.material.diffColor * (1.0f - hitData.material.ktran);
+	//subsurface scattering
+	if ((Features & KERNEL_BSSRDF) && hitData.material.bssrdf != NULL) {
+		outputColor = getSubsurfaceRadiance(direction, hitData, hitObject);
+		return;
+	}
 
-		//direct lighting: iterate over light sources
-		for (int i = 0; i < scene->lights.size(); i++) {
-			radiance += getLightRadiance(direction, scene->lights[i], hitData);
+	// Calculate lighting for this hit
+#ifdef IRRADIANCE_CACHE
+	//indirect diffuse lighting
+	Vector3 radiance;
+	if (irradianceCache != NULL && hitData.material.diffColor.MaxComponent() > 0.0f && hitData.material.ktran < 1.0f)
+		radiance = hitData.material.diffColor * getIndirectIrradiance(hitData) * ((1.0f - hitData.material.ktran) / M_PI);
+#else
+	//ambient lighitng
+	Vector3 radiance = hitData.material.ambColor * hitData.material.diffColor * (1.0f - hitData.material.ktran);
+#endif
+
+#ifdef AREA_LIGHTS
+	//emission
+	radiance += hitData.material.emissColor;
+#endif
+	//direct lighting
+	Vector3 bakedIrradiance;
+	if (lightmap != NULL && lightmap->Lookup(hitData, bakedIrradiance)) {
+		//diffuse light is baked, only the view dependent specular highlights need shadow rays
+		radiance += hitData.material.diffColor * bakedIrradiance * (1.0f - hitData.material.ktran);
+		if (hitData.material.specColor.MaxComponent() > 0.0f) {
+			HitData specularHit = hitData;
+			specularHit.material.diffColor = Vector3(0, 0, 0);
+			radiance += getLighting(direction, specularHit);
 		}
+	}
+	else {
+		radiance += getLighting(direction, hitData, shadowFactors);
+	}
+#ifdef PHOTON_CAUSTICS
+	//caustics
+	if (causticMap != NULL && hitData.material.diffColor.MaxComponent() > 0.0f && hitData.material.ktran < 1.0f) {
+		Vector3 irradiance = causticMap->GetIrradiance(hitData.position, hitData.normal, CAUSTIC_NEIGHBOURS, causticRadius);
+		radiance += hitData.material.diffColor * irradiance * ((1.0f - hitData.material.ktran) / M_PI);
+	}
+#endif
 
-		//create reflection ray
-		Vector3 radianceReflection;
-		if (hitData.material.specColor.MaxComponent() > MIN_SHININESS) {
-			//push up starting point by epsilon
-			Vector3 reflectOrigin = hitData.position + hitData.normal * PUSH_SPAWNED_RAYS;
-			//calculate direction of ray
-			Vector3 reflectDir = -direction.reflect(hitData.normal).normalize();
+	//decide which secondary rays to spawn
+	bool spawnReflection = hitData.material.specColor.MaxComponent() > MIN_SHININESS;
+	bool spawnRefraction = (Features & KERNEL_TRANSPARENCY) && hitData.material.ktran > MIN_TRANSPARENCY;
+	//compensates for only tracing one of the two rays
+	float reflectChoice = 1.0f, refractChoice = 1.0f;
+#ifdef SINGLE_BRANCH
+	if (spawnReflection && spawnRefraction) {
+		//choose proportionally to how much each ray can contribute
+		float reflectProbability = hitData.material.specColor.Luminance() / (hitData.material.specColor.Luminance() + hitData.material.ktran);
+		if (uniform() < reflectProbability) {
+			spawnRefraction = false;
+			reflectChoice = 1.0f / reflectProbability;
+		}
+		else {
+			spawnReflection = false;
+			refractChoice = 1.0f / (1.0f - reflectProbability);
+		}
+	}
+#endif
 
-			//recurse
-			traceRay(reflectOrigin, reflectDir, radianceReflection, numBounces + 1, insideStack, record);
+	//create reflection ray
+	Vector3 radianceReflection;
+	Vector3 reflectWeight = weight * hitData.material.specColor * reflectChoice;
+	float reflectFactor = 0.0f;
+	if (spawnReflection && (reflectFactor = spawnFactor(reflectWeight)) > 0.0f) {
+		//push up starting point by epsilon
+		Vector3 reflectOrigin = hitData.position + hitData.normal * PUSH_SPAWNED_RAYS;
+		//calculate direction of ray
+		Vector3 reflectDir = -direction.reflect(hitData.normal).normalize();
+
+		//recurse
+		traceRay<Features>(reflectOrigin, reflectDir, radianceReflection, numBounces + 1, insideStack, record, reflectWeight * reflectFactor);
+		radianceReflection = radianceReflection * (reflectFactor * reflectChoice);
+	}
+
+	//create refraction ray
+	Vector3 radianceRefraction;
+	bool totalInternalReflection = false;
+	Vector3 refractWeight = weight * hitData.material.ktran * refractChoice;
+	float refractFactor = 0.0f;
+	if (spawnRefraction && (refractFactor = spawnFactor(refractWeight)) > 0.0f) {
+		//push away starting point to avoid self-intersection
+		Vector3 refractOrigin;
+
+		//calculate direction of ray
+		float n1, n2;
+		Vector3 refractDir;
+		//have we entered this object before?
+		auto insideObject = std::find(insideStack.begin(), insideStack.end(), hitObject);
+		if (insideStack.empty() || insideObject == insideStack.end()) {
+			//no, entering a new object
+			refractOrigin = hitData.position - hitData.normal * PUSH_SPAWNED_RAYS;
+			n1 = insideStack.empty() ? 1.0f : insideStack.back()->indexOfRefraction;
+			insideStack.push_back(hitObject);
+			n2 = hitObject->indexOfRefraction;
+			totalInternalReflection = (-direction).refract(hitData.normal, n1 / n2, refractDir);
+		}
+		else {
+			//yes, leaving object
+			refractOrigin = hitData.position - hitData.normal * PUSH_SPAWNED_RAYS;
+			n1 = hitObject->indexOfRefraction;
+			insideStack.erase(insideObject);
+			n2 = insideStack.empty() ? 1.0f : insideStack.back()->indexOfRefraction;
+			totalInternalReflection = (-direction).refract(hitData.normal, n1 / n2, refractDir);
 		}
 
-		//create refraction ray
-		Vector3 radianceRefraction;
-		bool totalInternalReflection = false;
-		if (hitData.material.ktran > MIN_TRANSPARENCY) {
-			//push away starting point to avoid self-intersection
-			Vector3 refractOrigin;
+		//recurse
+		if (!totalInternalReflection) {
+			traceRay<Features>(refractOrigin, -refractDir, radianceRefraction, numBounces + 1, insideStack, record, refractWeight * refractFactor);
+			radianceRefraction = radianceRefraction * (refractFactor * refractChoice);
+		}
+	}
 
-			//calculate direction of ray
-			float n1, n2;
-			Vector3 refractDir;
-			//have we entered this object before?
-			auto insideObject = std::find(insideStack.begin(), insideStack.end(), hitObject);
-			if (insideStack.empty() || insideObject == insideStack.end()) {
-				//no, entering a new object
-				refractOrigin = hitData.position - hitData.normal * PUSH_SPAWNED_RAYS;
-				n1 = insideStack.empty() ? 1.0f : insideStack.back()->indexOfRefraction;
-				insideStack.push_back(hitObject);
-				n2 = hitObject->indexOfRefraction;
-				totalInternalReflection = (-direction).refract(hitData.normal, n1 / n2, refractDir);
-			}
-			else {
-				//yes, leaving object
-				refractOrigin = hitData.position - hitData.normal * PUSH_SPAWNED_RAYS;
-				n1 = hitObject->indexOfRefraction;
-				insideStack.erase(insideObject);
-				n2 = insideStack.empty() ? 1.0f : insideStack.back()->indexOfRefraction;
-				totalInternalReflection = (-direction).refract(hitData.normal, n1 / n2, refractDir);
-			}
+	//apply rendering equation
+	outputColor = radiance + radianceReflection * hitData.material.specColor + radianceRefraction * hitData.material.ktran;
+}
+
+Vector3 Renderer::getLighting(const Vector3& direction, const HitData& hitData, const Vector3* shadowFactors) {
+	Vector3 radiance = getDirectLighting(direction, hitData, shadowFactors);
+#ifdef AREA_LIGHTS
+	//light from emissive objects
+	if (!areaLights.empty())
+		radiance += getAreaLighting(hitData);
+#endif
+	//image based lighting
+	if (scene->environment != NULL)
+		radiance += getEnvironmentLighting(hitData);
+	return radiance;
+}
 
-			//recurse
-			if (!totalInternalReflection)
-				traceRay(refractOrigin, -refractDir, radianceRefraction, numBounces + 1, insideStack, record);
+Vector3 Renderer::getDirectLighting(const Vector3& direction, const HitData& hitData, const Vector3* shadowFactors) {
+	Vector3 radiance;
+	if (LIGHT_SAMPLES_PER_HIT <= 0 || scene->lights.size() <= LIGHT_SAMPLES_PER_HIT) {
+		//iterate over all light sources
+		for (int i = 0; i < scene->lights.size(); i++) {
+			radiance += getLightRadiance(direction, scene->lights[i], hitData, (shadowFactors != NULL) ? &shadowFactors[i] : NULL);
 		}
+		return radiance;
+	}
 
-		//apply rendering equation
-		outputColor = radiance + radianceReflection * hitData.material.specColor + radianceRefraction * hitData.material.ktran;
+	//sample a few lights by their estimated contribution
+	for (int i = 0; i < LIGHT_SAMPLES_PER_HIT; i++) {
+		float lightPdf;
+		LightSource* light = pickLight(hitData.position, hitData.normal, lightPdf);
+		radiance += getLightRadiance(direction, light, hitData) / (lightPdf * LIGHT_SAMPLES_PER_HIT);
 	}
+	return radiance;
 }
 
-Vector3 Renderer::getLightRadiance(const Vector3& direction, const LightSource* light, const HitData& hitData) {
+Vector3 Renderer::getLightRadiance(const Vector3& direction, const LightSource* light, const HitData& hitData, const Vector3* tracedShadowFactor) {
 	//get direction to light
 	Vector3 lightDir;
 	light->getDirection(hitData.position, lightDir);
 	float lightDist = light->getDistance(hitData.position);
+	//skip the shadow ray if the light couldn't contribute anyway
+	Vector3 radiance = getUnshadowedLightRadiance(direction, light, hitData, lightDir, lightDist);
+	if (radiance.MaxComponent() < LIGHT_CULL_THRESHOLD)
+		return Vector3();
 	//get shadow factor
 	Vector3 shadowFactor;
+	if (tracedShadowFactor != NULL)
+		shadowFactor = *tracedShadowFactor;
+	else
+		shadowFactor = traceShadowRay(light, hitData, lightDir, lightDist);
+#ifdef PHOTON_CAUSTICS
+	//light through transparent objects is carried by the caustic photons instead
+	if (causticTransmission && shadowFactor.MaxComponent() < 1.0f)
+		return Vector3();
+#endif
+	return radiance * shadowFactor;
+}
+
+Vector3 Renderer::getAreaLighting(const HitData& hitData) {
+	Vector3 radiance;
+	for (int i = 0; i < areaLights.size(); i++) {
+		Vector3 sum;
+		int numSamples = 0, numVisible = 0, numBlocked = 0;
+		for (int n = 0; n < AREA_LIGHT_MAX_SAMPLES; n++) {
+			//once the probes are in, only keep going if some saw the light and some didn't
+			if (n == AREA_LIGHT_PROBES && (numVisible == 0 || numBlocked == 0))
+				break;
+			bool contributes, visible;
+			sum += getAreaLightSample(areaLights[i], hitData, contributes, visible);
+			numSamples++;
+			if (contributes) {
+				if (visible)
+					numVisible++;
+				else
+					numBlocked++;
+			}
+		}
+		radiance += sum / numSamples;
+	}
+	return radiance;
+}
+
+Vector3 Renderer::getAreaLightSample(const AreaLight* light, const HitData& hitData, bool& contributes, bool& visible) {
+	contributes = visible = false;
+	//pick a point on the light
+	float u = uniform();
+	float u1, u2;
+	uniform2D(u1, u2);
+	Vector3 lightPosition, lightNormal, emission;
+	float areaPdf;
+	light->Sample(u, u1, u2, lightPosition, lightNormal, emission, areaPdf);
+
+	Vector3 toLight = lightPosition - hitData.position;
+	float distance = toLight.length();
+	if (distance <= 0.0f || areaPdf <= 0.0f)
+		return Vector3();
+	Vector3 lightDir = toLight / distance;
+	float cosLight = abs(lightDir.dot(lightNormal));
+	if (cosLight <= 0.0f)
+		return Vector3();
+
+	//emission * cosLight / (pi * distance^2 * pdf) takes the place of a point light's color
+	//diffuse only, reflection rays that hit the light already pick up its emission
+	Vector3 radiance = getDiffuseResponse(hitData, lightDir) * emission * (cosLight / (M_PI * distance * distance * areaPdf));
+	if (radiance.MaxComponent() <= 0.0f)
+		return Vector3();
+	contributes = true;
+
+	//stop just short of the light so it doesn't shadow itself
+	Vector3 shadowFactor;
+	Vector3 shadowOrigin = hitData.position + hitData.normal * PUSH_SPAWNED_RAYS;
+	scene->TraceShadowRay(shadowOrigin, lightDir, shadowFactor, distance * 0.999f);
+	visible = shadowFactor.MaxComponent() > 0.0f;
+	return radiance * shadowFactor;
+}
+
+Vector3 Renderer::getEnvironmentLighting(const HitData& hitData) {
+	Vector3 radiance;
+	Vector3 shadowOrigin = hitData.position + hitData.normal * PUSH_SPAWNED_RAYS;
+	for (int n = 0; n < ENVIRONMENT_LIGHT_SAMPLES; n++) {
+		//pick a direction by brightness
+		float u1, u2;
+		uniform2D(u1, u2);
+		Vector3 lightDir;
+		float pdf;
+		Vector3 emission = scene->environment->Sample(u1, u2, lightDir, pdf);
+		if (pdf <= 0.0f)
+			continue;
+		//emission / (pi * pdf) takes the place of a directional light's color
+		//diffuse only, reflection rays that leave the scene already pick up the environment
+		Vector3 sampleRadiance = getDiffuseResponse(hitData, lightDir) * emission / (M_PI * pdf);
+		if (sampleRadiance.MaxComponent() <= 0.0f)
+			continue;
+		Vector3 shadowFactor;
+		scene->TraceShadowRay(shadowOrigin, lightDir, shadowFactor, FLT_MAX);
+		radiance += sampleRadiance * shadowFactor;
+	}
+	return radiance / ENVIRONMENT_LIGHT_SAMPLES;
+}
+
+Vector3 Renderer::traceShadowRay(const LightSource* light, const HitData& hitData, const Vector3& lightDir, float lightDist) {
+	Vector3 shadowFactor;
+	int lightIndex = -1;
+	if (visibilityCache != NULL) {
+		lightIndex = lightIndices.find(light)->second;
+		if (visibilityCache->Lookup(lightIndex, hitData.position, shadowFactor))
+			return shadowFactor;
+	}
+
 	//push up starting point by epsilon
 	Vector3 shadowOrigin = hitData.position + hitData.normal * PUSH_SPAWNED_RAYS;
+#ifdef SHADOW_OCCLUDER_CACHE
+	scene->TraceShadowRay(shadowOrigin, lightDir, shadowFactor, lightDist, getCachedOccluder(light));
+#else
 	scene->TraceShadowRay(shadowOrigin, lightDir, shadowFactor, lightDist);
-	//attenuation
-	float attenuation = light->getAttenuation(lightDist);
+#endif
+	if (visibilityCache != NULL)
+		visibilityCache->Add(lightIndex, hitData.position, shadowFactor);
+	return shadowFactor;
+}
+
+unsigned long long Renderer::getVisibilityHash() {
+	const std::vector<Primitive*>& primitives = scene->GetPrimitives();
+	int settings[] = { VISIBILITY_CACHE_RESOLUTION, (int)primitives.size(), (int)scene->lights.size() };
+	unsigned long long hash = FileUtil::Hash(settings, sizeof(settings));
+	//shape and opacity of every primitive
+	for (int i = 0; i < primitives.size(); i++) {
+		BoundingBox bounds = primitives[i]->GetBounds();
+		Vector3 midpoint = primitives[i]->GetMidpoint();
+		float ktran = primitives[i]->GetMaterial().ktran;
+		float primitive[] = { bounds.minCorner.x, bounds.minCorner.y, bounds.minCorner.z, bounds.maxCorner.x, bounds.maxCorner.y, bounds.maxCorner.z,
+			midpoint.x, midpoint.y, midpoint.z, ktran };
+		hash = FileUtil::Hash(primitive, sizeof(primitive), hash);
+	}
+	//where each light is
+	for (int i = 0; i < scene->lights.size(); i++) {
+		Vector3 lightDir;
+		scene->lights[i]->getDirection(Vector3(), lightDir);
+		float light[] = { lightDir.x, lightDir.y, lightDir.z, scene->lights[i]->getDistance(Vector3()) };
+		hash = FileUtil::Hash(light, sizeof(light), hash);
+	}
+	return hash;
+}
+
+Vector3 Renderer::getUnshadowedLightRadiance(const Vector3& direction, const LightSource* light, const HitData& hitData, const Vector3& lightDir, float lightDist) {
+	//attenuation, and the cone of a spot light
+	float attenuation = light->getAttenuation(lightDist) * light->getFalloff(hitData.position);
+	if (attenuation <= 0.0f)
+		return Vector3();
+	return getSurfaceResponse(direction, hitData, lightDir) * light->color * attenuation;
+}
+
+Vector3 Renderer::getDiffuseResponse(const HitData& hitData, const Vector3& lightDir) {
+	return hitData.material.diffColor * max(lightDir.dot(hitData.normal), 0.0f) * (1.0f - hitData.material.ktran);
+}
+
+Vector3 Renderer::getSurfaceResponse(const Vector3& direction, const HitData& hitData, const Vector3& lightDir) {
 	//diffuse
-	Vector3 radianceDiffuse = hitData.material.diffColor * max(lightDir.dot(hitData.normal), 0.0f) * (1.0f - hitData.material.ktran);
+	Vector3 radianceDiffuse = getDiffuseResponse(hitData, lightDir);
 	//specular
 	Vector3 reflectDir = lightDir.reflect(hitData.normal).normalize();
 	Vector3 viewDir = (-direction).normalize();
 	Vector3 radianceSpecular = hitData.material.specColor * pow(max(reflectDir.dot(viewDir), 0.0f), hitData.material.shininess * 128.0f);
 
-	return (radianceDiffuse + radianceSpecular) * shadowFactor * light->color * attenuation;
+	return radianceDiffuse + radianceSpecular;
+}
+
+Vector3 Renderer::getIndirectIrradiance(const HitData& hitData) {
+	Vector3 irradiance;
+	if (irradianceCache->Lookup(hitData.position, hitData.normal, irradiance))
+		return irradiance;
+	//other threads may be computing a record nearby at the same time, that only costs a little extra work
+	IrradianceRecord record;
+	computeIrradianceRecord(hitData, record);
+	irradianceCache->Add(record);
+	return record.irradiance;
+}
+
+void Renderer::computeIrradianceRecord(const HitData& hitData, IrradianceRecord& record) {
+	const int M = IRRADIANCE_CACHE_THETA_STRATA;
+	const int N = IRRADIANCE_CACHE_PHI_STRATA;
+	record.position = hitData.position;
+	record.normal = hitData.normal;
+	record.irradiance = Vector3();
+	for (int channel = 0; channel < 3; channel++)
+		record.rotationalGradient[channel] = record.translationalGradient[channel] = Vector3();
+
+	Vector3 tangent, bitangent;
+	hitData.normal.CreateNormalSpace(tangent, bitangent);
+	Vector3 origin = hitData.position + hitData.normal * PUSH_SPAWNED_RAYS;
+
+	//one cosine weighted sample per stratum, stratum (j,k) is at radiance[j * N + k]
+	std::vector<Vector3> radiance(M * N);
+	std::vector<float> distance(M * N);
+	float inverseDistanceSum = 0.0f;
+	for (int j = 0; j < M; j++) {
+		for (int k = 0; k < N; k++) {
+			float u1, u2;
+			uniform2D(u1, u2);
+			float sinThetaSquared = (j + u1) / M;
+			float sinTheta = sqrt(sinThetaSquared);
+			float cosTheta = sqrt(1.0f - sinThetaSquared);
+			float phi = 2.0f * M_PI * (k + u2) / N;
+			Vector3 direction = tangent * (sinTheta * cos(phi)) + bitangent * (sinTheta * sin(phi)) + hitData.normal * cosTheta;
+
+			Vector3 sample = getGatherRadiance(origin, direction, distance[j * N + k]);
+			radiance[j * N + k] = sample;
+			record.irradiance += sample;
+			inverseDistanceSum += 1.0f / distance[j * N + k];
+
+			//rotational gradient: tilting the normal towards v_k changes the cosine of this sample
+			float phiCenter = 2.0f * M_PI * (k + 0.5f) / N;
+			Vector3 v = bitangent * cos(phiCenter) - tangent * sin(phiCenter);
+			float tanTheta = sinTheta / max(cosTheta, 1e-3f);
+			for (int channel = 0; channel < 3; channel++)
+				record.rotationalGradient[channel] += v * (-tanTheta * sample.Get(channel));
+		}
+	}
+	float scale = M_PI / (M * N);
+	record.irradiance = record.irradiance * scale;
+	for (int channel = 0; channel < 3; channel++)
+		record.rotationalGradient[channel] = record.rotationalGradient[channel] * scale;
+
+	//translational gradient from the change in radiance between neighbouring strata, using the cosine weighted form
+	for (int k = 0; k < N; k++) {
+		int kPrevious = (k + N - 1) % N;
+		float phiCenter = 2.0f * M_PI * (k + 0.5f) / N;
+		float phiEdge = 2.0f * M_PI * k / N;
+		Vector3 u = tangent * cos(phiCenter) + bitangent * sin(phiCenter);
+		Vector3 v = bitangent * cos(phiEdge) - tangent * sin(phiEdge);
+		//across theta boundaries
+		for (int j = 1; j < M; j++) {
+			float sinThetaEdge = sqrt((float)j / M);
+			float cosThetaEdgeSquared = 1.0f - (float)j / M;
+			float factor = (2.0f * M_PI / N) * sinThetaEdge * cosThetaEdgeSquared / min(distance[j * N + k], distance[(j - 1) * N + k]);
+			Vector3 difference = radiance[j * N + k] - radiance[(j - 1) * N + k];
+			for (int channel = 0; channel < 3; channel++)
+				record.translationalGradient[channel] += u * (factor * difference.Get(channel));
+		}
+		//across phi boundaries
+		for (int j = 0; j < M; j++) {
+			float factor = (sqrt((j + 1.0f) / M) - sqrt((float)j / M)) / min(distance[j * N + k], distance[j * N + kPrevious]);
+			Vector3 difference = radiance[j * N + k] - radiance[j * N + kPrevious];
+			for (int channel = 0; channel < 3; channel++)
+				record.translationalGradient[channel] += v * (factor * difference.Get(channel));
+		}
+	}
+
+	//reuse the record about as far as the surfaces it sees
+	record.radius = (inverseDistanceSum > 0.0f) ? (M * N) / inverseDistanceSum : FLT_MAX;
+	//but not so far that the gradient alone would change the irradiance completely
+	Vector3 luminanceGradient;
+	for (int axis = 0; axis < 3; axis++)
+		luminanceGradient.Set(axis, Vector3(record.translationalGradient[0].Get(axis), record.translationalGradient[1].Get(axis), record.translationalGradient[2].Get(axis)).Luminance());
+	float gradientLength = luminanceGradient.length();
+	if (gradientLength > 0.0f)
+		record.radius = min(record.radius, record.irradiance.Luminance() / gradientLength);
+}
+
+Vector3 Renderer::getGatherRadiance(const Vector3& origin, const Vector3& direction, float& distance) {
+	HitData hitData;
+	Object* hitObject = NULL;
+	if (!scene->GetClosestIntersection(origin, direction, hitData, &hitObject)) {
+		distance = FLT_MAX;
+		return Vector3();
+	}
+	distance = hitData.t;
+	if (direction.dot(hitData.normal) > 0.0f)
+		hitData.normal = -hitData.normal;
+	if (hitObject->colorShader != NULL)
+		hitObject->colorShader->Shade(hitData, hitData.material);
+
+	if (hitData.material.bssrdf != NULL)
+		return getSubsurfaceRadiance(direction, hitData, hitObject);
+	return getDirectLighting(direction, hitData);
+}
+
+Primitive** Renderer::getCachedOccluder(const LightSource* light) {
+	//throw away entries left over from another renderer, the primitives may be gone
+	if (shadowOccluderCache.rendererId != id) {
+		shadowOccluderCache.lastOccluder.clear();
+		shadowOccluderCache.rendererId = id;
+	}
+	//inserts NULL the first time a light is seen
+	return &shadowOccluderCache.lastOccluder[light];
 }
 
 void Renderer::recordRay(const Vector3& origin, const Vector3& hitPoint, const Vector3& hitNormal) {
@@ -219,11 +1307,11 @@ void Renderer::recordRay(const Vector3& origin, const Vector3& hitPoint, const V
 	recordNormalFile << (hitPoint.x + hitNormal.x) << " " << (hitPoint.y + hitNormal.y) << " " << (hitPoint.z + hitNormal.z) << std::endl;
 }
 
-Vector3 Renderer::getSubsurfaceRadiance(const Vector3& direction, const HitData& hitData) {
-	return getSubsurfaceDiffuseRadiance(direction, hitData) + getSubsurfaceSingleScatterRadiance(direction, hitData);
+Vector3 Renderer::getSubsurfaceRadiance(const Vector3& direction, const HitData& hitData, const Object* hitObject) {
+	return getSubsurfaceDiffuseRadiance(direction, hitData) + getSubsurfaceSingleScatterRadiance(direction, hitData, hitObject);
 }
 
-Vector3 Renderer::getSubsurfaceSingleScatterRadiance(const Vector3& direction, const HitData& hitData) {
+Vector3 Renderer::getSubsurfaceSingleScatterRadiance(const Vector3& direction, const HitData& hitData, const Object* hitObject) {
 	BSSRDF* bssrdf = hitData.material.bssrdf;
 
 	//refract 'outgoing' ray
@@ -242,25 +1330,19 @@ Vector3 Renderer::getSubsurfaceSingleScatterRadiance(const Vector3& direction, c
 	Vector3 singleScatter(0.0f, 0.0f, 0.0f);
 	for (int i = 0; i < NUM_SUBSCATTER_SAMPLES; i++) {
 		//sample with exponential falloff
-		float depth = bssrdf->ImportanceSampleSingleScatter(rand() / (float)RAND_MAX);
+		float depth = bssrdf->ImportanceSampleSingleScatter(1.0f - uniform());
 		//create sample at this depth along refracted ray
 		Vector3 samplePos = hitData.position + to * depth;
 
 		//pick a light source and create a ray from the sample point in the light direction
-		//TODO: pick other lights randomly
 		float lightPdf;
-		LightSource* light = pickLight(lightPdf);
+		LightSource* light = pickLight(samplePos, Vector3(), lightPdf);
 		Vector3 lightDir;
 		light->getDirection(samplePos, lightDir);
 
-		//find closest intersection along this ray
-		Object* hitObject;
+		//find where this ray leaves the object
 		HitData intersection;
-		if (scene->GetClosestIntersection(samplePos, lightDir, intersection, &hitObject)) {
-			//if this point has a different BSSRDF, then it belongs to some other object and can be skipped
-			if (intersection.material.bssrdf != bssrdf)
-				continue;
-
+		if (scene->GetClosestIntersection(samplePos, lightDir, intersection, hitObject)) {
 			//sample light at this point
 			//for now, pretend all surfaces are perfectly diffuse
 			//not sure how to handle the view direction for the specular term
@@ -302,20 +1384,36 @@ Vector3 Renderer::getSubsurfaceSingleScatterRadiance(const Vector3& direction, c
 Vector3 Renderer::getSubsurfaceDiffuseRadiance(const Vector3& direction, const HitData& hitData) {
 	BSSRDF* bssrdf = hitData.material.bssrdf;
 
+	//get fresnel transmittance of exiting ray
+	//assume we are always going from air to material
+	float FtExitant = 1.0f - bssrdf->FresnelReflectance(abs(-direction.dot(hitData.normal)), bssrdf->eta);
+	return getSubsurfaceDiffuseExitance(hitData) * FtExitant / M_PI;
+}
+
+Vector3 Renderer::getSubsurfaceDiffuseExitance(const HitData& hitData) {
+	BSSRDF* bssrdf = hitData.material.bssrdf;
+	Vector3 exitance;
+	if (lightmap != NULL && lightmap->Lookup(hitData, exitance))
+		return exitance;
+
 	//create basis for normal space for the intersected surface
 	Vector3 tangent, bitangent;
 	hitData.normal.CreateNormalSpace(tangent, bitangent);
-
-	//get fresnel transmittance of exiting ray
-	//assume we are always going from air to material
 	float oneovereta = 1.0f / bssrdf->eta;
-	float FtExitant = 1.0f - bssrdf->FresnelReflectance(abs(-direction.dot(hitData.normal)), bssrdf->eta);
+
+#ifdef SUBSURFACE_IRRADIANCE_TREE
+	//gather from the precomputed irradiance samples
+	auto tree = irradianceTrees.find(bssrdf);
+	if (tree != irradianceTrees.end())
+		return tree->second->GetDiffuseExitance(hitData.position);
+#endif
 
 	//take samples
-	Vector3 diffuseScatter;
 	for (int i = 0; i < NUM_SUBSCATTER_SAMPLES; i++) {
 		//sample disk in normal space
-		Vector3 samplePosNormalSpace = bssrdf->ImportanceSampleDiffusion(rand() / (float)RAND_MAX, rand() / (float)RAND_MAX);
+		float u1, u2;
+		uniform2D(u1, u2);
+		Vector3 samplePosNormalSpace = bssrdf->ImportanceSampleDiffusion(u1, u2);
 		//transform to world space
 		Vector3 samplePos = hitData.position + (tangent * samplePosNormalSpace.x + bitangent * samplePosNormalSpace.y);
 		//float halfProbeLength = sqrt(Rmax)
@@ -326,9 +1424,8 @@ Vector3 Renderer::getSubsurfaceDiffuseRadiance(const Vector3& direction, const H
 		intersection.position = samplePos;
 
 		//pick a light source and create a ray from the sample point in the light direction
-		//TODO: pick other lights randomly
 		float lightPdf;
-		LightSource* light = pickLight(lightPdf);
+		LightSource* light = pickLight(intersection.position, intersection.normal, lightPdf);
 		Vector3 lightDir;
 		light->getDirection(intersection.position, lightDir);
 
@@ -349,17 +1446,14 @@ Vector3 Renderer::getSubsurfaceDiffuseRadiance(const Vector3& direction, const H
 
 		//pdf of this sample is the pdf of choosing this light and of choosing this sample point
 		float pdf = lightPdf * bssrdf->SampleDiffusionPDF(samplePosNormalSpace.x, samplePosNormalSpace.y);
-		float F = FtExitant * FtIncident;
-		diffuseScatter += (lightRadiance * Rd * F)/ (M_PI * pdf);
+		exitance += (lightRadiance * Rd * FtIncident) / pdf;
 	}
 
-	diffuseScatter = diffuseScatter / (float)NUM_SUBSCATTER_SAMPLES;
-	return diffuseScatter;
+	exitance = exitance / (float)NUM_SUBSCATTER_SAMPLES;
+	return exitance;
 }
 
-LightSource* Renderer::pickLight(float& pdf) {
-	//uniformly pick a random light
-	int index = rand() % scene->lights.size();
-	pdf = 1.0f / scene->lights.size();
-	return scene->lights[index];
+LightSource* Renderer::pickLight(const Vector3& position, const Vector3& normal, float& pdf) {
+	//pick a light by its estimated contribution at this point
+	return lightSampler->Sample(position, normal, uniform(), pdf);
 }
\ No newline at end of file
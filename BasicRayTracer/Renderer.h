@@ -1,6 +1,15 @@
 #pragma once
 #include "Scene.h"
+#include "LightSampler.h"
+#include "IrradianceTree.h"
+#include "IrradianceCache.h"
+#include "PhotonMap.h"
+#include "VisibilityCache.h"
+#include "AreaLight.h"
+#include "Lightmap.h"
+#include "Sampler.h"
 #include <vector>
+#include <map>
 #include <fstream>
 #define USE_MATH_DEFINES
 #include <cmath>
@@ -10,21 +19,129 @@
 #define RECORD_I 1031
 #define RECORD_J 556
 
-#define NUM_SAMPLING_PATTERNS 64
-struct SamplePoint {
-	float x;
-	float y;
+// Rays whose path weight falls below MIN_RAY_WEIGHT are continued with Russian roulette
+// Comment out to simply drop them instead (faster, but slightly darkens deep reflections)
+#define RUSSIAN_ROULETTE
+
+// At hits that are both reflective and transparent, trace only one of the two rays
+// chosen randomly by weight, so the cost of a sample grows linearly with depth instead of 2^depth
+// Needs several samples per pixel to converge
+//#define SINGLE_BRANCH
+
+// Number of lights to sample at each hit, chosen by their estimated contribution
+// 0 evaluates every light at every hit, which is exact but scales linearly with the number of lights
+#define LIGHT_SAMPLES_PER_HIT 0
+
+// Lights whose unshadowed contribution to a hit is below this get no shadow ray and are left out
+// Also sets the extent of each light's region of influence, for the light lists of each row of pixels
+#define LIGHT_CULL_THRESHOLD 0.001f
+// Largest getSurfaceResponse of any hit (diffuse plus specular, colors are at most 1 each)
+// A light is only left out of a row where light->color * attenuation * falloff * MAX_SURFACE_RESPONSE is below the threshold,
+// so the row lists never drop a light the per-hit test would keep
+#define MAX_SURFACE_RESPONSE 2.0f
+
+// Each render thread remembers the last primitive that blocked a shadow ray toward each light,
+// and tests it before traversing the scene for the next shadow ray toward that light
+#define SHADOW_OCCLUDER_CACHE
+
+// Remember which parts of the scene each light reaches on a world-space grid, and skip the shadow rays whose answer is known
+// Cells near shadow edges still trace exact shadow rays
+// The cache is saved to VISIBILITY_CACHE_FILE and reused by later renders of the same geometry and lights, from any view
+//#define VISIBILITY_CACHE
+#define VISIBILITY_CACHE_FILE "visibility.bin"
+
+// Light the scene with its emissive objects as area lights, giving soft shadows
+// Each light first gets AREA_LIGHT_PROBES shadow rays at every hit, and only if they disagree (the hit is in a penumbra)
+// does it get more, up to AREA_LIGHT_MAX_SAMPLES, so fully lit and fully shadowed regions cost little more than a point light
+#define AREA_LIGHTS
+#define AREA_LIGHT_PROBES 4
+#define AREA_LIGHT_MAX_SAMPLES 32
+
+// Shadow rays toward the scene's environment map at each hit of the Whitted renderer, in directions chosen by its brightness
+#define ENVIRONMENT_LIGHT_SAMPLES 4
+
+// Jittered points per lightmap texel when baking (see BakeLightmap)
+#define LIGHTMAP_SAMPLES_PER_TEXEL 4
+
+// Compute the diffuse subsurface term from a precomputed tree of irradiance samples on each translucent object
+// instead of sampling the lights again at every hit
+#define SUBSURFACE_IRRADIANCE_TREE
+// Irradiance samples are spaced about this many mean free paths apart
+#define IRRADIANCE_SAMPLE_SPACING 1.0f
+// Limits on the number of irradiance samples per BSSRDF
+#define IRRADIANCE_MIN_SAMPLES 1024
+#define IRRADIANCE_MAX_SAMPLES 262144
+
+// Replace the constant ambient term with indirect diffuse light interpolated from an irradiance cache
+// Records are computed on demand by sampling the hemisphere and are shared by all pixels and progressive passes
+//#define IRRADIANCE_CACHE
+// Hemisphere samples per record are split into this many strata along theta and phi
+#define IRRADIANCE_CACHE_THETA_STRATA 8
+#define IRRADIANCE_CACHE_PHI_STRATA 24
+
+// Add caustics (light focused onto diffuse surfaces by reflective and refractive objects) from a photon map traced before rendering
+// Light passing through transparent objects then arrives only as caustic photons instead of as tinted shadows
+//#define PHOTON_CAUSTICS
+// Number of photons emitted toward reflective and refractive objects
+#define CAUSTIC_PHOTONS 500000
+// Photons emitted by one task
+#define CAUSTIC_PHOTONS_PER_TASK 8192
+// Photons used for each density estimate, and how far to search for them as a fraction of the size of the scene
+#define CAUSTIC_NEIGHBOURS 100
+#define CAUSTIC_MAX_RADIUS 0.02f
+
+// Draw all random numbers of a camera sample from Owen-scrambled Sobol points
+// Comment out to use independent random numbers instead
+#define SAMPLER_SOBOL
+
+// Trace with kernels specialized for the features the scene uses (see KernelFeature)
+// Comment out to always use the kernel that handles every feature
+#define SPECIALIZED_KERNELS
+
+// Find the first hits of the camera rays of a row of pixels together, interleaving their traversal of the KD-tree
+// so the cache misses of one ray overlap with work on the others
+// Comment out to trace each camera ray on its own
+#define INTERLEAVED_CAMERA_RAYS
+
+// Trace the shadow rays from the first hits of a row of pixels toward each point light together, as a packet
+// Comment out to trace each of them when its hit is shaded
+#define SHADOW_PACKETS
+
+// Scene features the trace kernels are compiled for
+// A kernel without a feature has none of its checks
+enum KernelFeature {
+	// Some object has a color shader (shaders may also make surfaces transparent)
+	KERNEL_SHADERS = 1,
+	// Some surface has subsurface scattering
+	KERNEL_BSSRDF = 2,
+	// Some surface is transparent
+	KERNEL_TRANSPARENCY = 4,
+	// The camera has a lens
+	KERNEL_DOF = 8,
+	// Rays of the pixel RECORD_I,RECORD_J are saved for RayVisualizer
+	KERNEL_RECORD = 16,
+	KERNEL_ALL = 31
 };
 
 class Renderer {
-private:
+protected:
 	// The scene to sample from
 	Scene* scene;
+	// Chooses which lights to sample
+	LightSampler* lightSampler;
+	// Unique id of this renderer, so per-thread caches can tell which renderer they belong to
+	int id;
 
 	// Number of samples to take per pixel
 	int samplesPerPixel;
-	// Precomputed sample patterns
-	std::vector<std::vector<SamplePoint>> samplePatterns;
+	// Each render thread gets its own copy of this sampler
+	Sampler* samplerPrototype;
+
+	// The calling thread's sampler, positioned at its current camera sample
+	Sampler* getSampler();
+	// Next random number(s) of the current camera sample
+	float uniform();
+	void uniform2D(float& u, float& v);
 
 	// Some constant internal parameters
 	// Maximum bounces before recursion terminates
@@ -35,21 +152,135 @@ private:
 	const float MIN_TRANSPARENCY = 0.01f;
 	// How far to extrude/intrude spawned reflection and refraction rays along the normal
 	const float PUSH_SPAWNED_RAYS = 0.0001f;
+	// Path weight (product of specColor/ktran factors) below which a ray is pruned or rouletted
+	const float MIN_RAY_WEIGHT = 0.01f;
+
+
+	// Features of the scene, and the kernels compiled for them
+	int kernelFeatures;
+	void (Renderer::*colorPixelsKernel)(int iStart, int iEnd, int j, Vector3* outputColors, int pass, PixelFeatures* features);
+	void (Renderer::*shadeHitKernel)(const Vector3& origin, const Vector3& direction, HitData& hitData, Object* hitObject, Vector3& outputColor, int numBounces, std::vector<Object*> insideStack, bool record, const Vector3& weight, const Vector3* shadowFactors);
+	// Find the features the scene uses and pick the kernels for them
+	void chooseKernels();
+	// Point the kernels at the specialization for features, trying Features and up
+	template <int Features> void selectKernels(int features);
+
+	// ColorPixels specialized for a set of KernelFeatures
+	template <int Features> void colorPixels(int iStart, int iEnd, int j, Vector3* outputColors, int pass, PixelFeatures* features);
 
+	// Radiance arriving at the camera along a camera ray
+	// hitData and hitObject are its first hit (hitObject is NULL if it hit nothing), found with the other camera rays of its row
+	// shadowFactors are from traceCameraShadowRays, or NULL
+	// Integrators other than the Whitted tracer override this
+	virtual Vector3 traceCameraRay(const Vector3& origin, const Vector3& direction, HitData& hitData, Object* hitObject, const Vector3* shadowFactors, bool record);
 
-	// Recursive function to trace a ray from origin in the given direction
-	void traceRay(const Vector3& origin, const Vector3& direction, Vector3& outputColor, int numBounces, std::vector<Object*> insideStack, bool record);
+	// Shadow factors toward every light from the first hits of numRays camera rays, one per light for each ray
+	// Returns false if they were not traced, then each hit traces its own shadow rays
+	virtual bool traceCameraShadowRays(int numRays, const Vector3* directions, const HitData* hitData, Object* const* hitObjects, Vector3* shadowFactors);
+
+	// Albedo, normal and depth at the first hit of a camera ray
+	void getFirstHitFeatures(const Vector3& direction, HitData hitData, Object* hitObject, PixelFeatures& features);
+
+	// Recursive function to trace a ray from origin in the given direction, specialized for a set of KernelFeatures
+	// weight is the factor this ray's radiance will be scaled by before reaching the pixel
+	template <int Features> void traceRay(const Vector3& origin, const Vector3& direction, Vector3& outputColor, int numBounces, std::vector<Object*> insideStack, bool record, const Vector3& weight);
+	// Radiance leaving a hit found by a ray from origin, back along direction
+	// shadowFactors toward each light are used instead of tracing shadow rays if given
+	template <int Features> void shadeHit(const Vector3& origin, const Vector3& direction, HitData& hitData, Object* hitObject, Vector3& outputColor, int numBounces, std::vector<Object*> insideStack, bool record, const Vector3& weight, const Vector3* shadowFactors);
+
+	// Decide whether to spawn a ray with the given path weight
+	// Returns the factor to scale its radiance by, or 0 if it should not be traced
+	float spawnFactor(const Vector3& weight);
 
 	// Lighting
-	LightSource* pickLight(float& lightPdf);
-	Vector3 getLightRadiance(const Vector3& direction, const LightSource* light, const HitData& hitData);
+	// Direct light of every kind (lights, area lights and the environment) reflected by a hit
+	Vector3 getLighting(const Vector3& direction, const HitData& hitData, const Vector3* shadowFactors = NULL);
+	// Picks a light for the point position with the given normal (zero to ignore orientation)
+	LightSource* pickLight(const Vector3& position, const Vector3& normal, float& lightPdf);
+	// shadowFactors (one per light) or tracedShadowFactor are used instead of tracing shadow rays if given
+	Vector3 getDirectLighting(const Vector3& direction, const HitData& hitData, const Vector3* shadowFactors = NULL);
+	Vector3 getLightRadiance(const Vector3& direction, const LightSource* light, const HitData& hitData, const Vector3* tracedShadowFactor = NULL);
+	// Diffuse and specular response of a hit to light arriving from lightDir, which every kind of light is scaled by
+	Vector3 getSurfaceResponse(const Vector3& direction, const HitData& hitData, const Vector3& lightDir);
+	// Diffuse part of getSurfaceResponse, for lights that reflection rays can hit, whose highlights are already in the reflection
+	Vector3 getDiffuseResponse(const HitData& hitData, const Vector3& lightDir);
+	// What getLightRadiance returns if nothing blocks the light
+	Vector3 getUnshadowedLightRadiance(const Vector3& direction, const LightSource* light, const HitData& hitData, const Vector3& lightDir, float lightDist);
+	// Shadow factor toward light from a hit, traced or from the visibility cache
+	Vector3 traceShadowRay(const LightSource* light, const HitData& hitData, const Vector3& lightDir, float lightDist);
+	// Bounds of the region each light of the scene can contribute to, if it is bounded
+	std::vector<BoundingBox> lightInfluence;
+	std::vector<bool> lightBounded;
+	// The calling thread's cached shadow occluder for light
+	Primitive** getCachedOccluder(const LightSource* light);
+
+	// Emissive objects, one light each
+	std::vector<AreaLight*> areaLights;
+	void findAreaLights();
+	// Light arriving at a hit from all area lights, sampled adaptively
+	Vector3 getAreaLighting(const HitData& hitData);
+	// Contribution of one point sampled on an area light
+	// contributes is false if the point couldn't light the hit anyway (no shadow ray is traced then), visible tells whether the shadow ray got through
+	Vector3 getAreaLightSample(const AreaLight* light, const HitData& hitData, bool& contributes, bool& visible);
+	// Light arriving at a hit from the environment map
+	Vector3 getEnvironmentLighting(const HitData& hitData);
 	
 	// Subsurface scattering
-	Vector3 getSubsurfaceRadiance(const Vector3& direction, const HitData& hitData);
-	Vector3 getSubsurfaceSingleScatterRadiance(const Vector3& direction, const HitData& hitData);
+	// hitObject is the translucent object that was hit, probe rays for samples inside it are only tested against it
+	Vector3 getSubsurfaceRadiance(const Vector3& direction, const HitData& hitData, const Object* hitObject);
+	Vector3 getSubsurfaceSingleScatterRadiance(const Vector3& direction, const HitData& hitData, const Object* hitObject);
 	Vector3 getSubsurfaceDiffuseRadiance(const Vector3& direction, const HitData& hitData);
+	// Diffuse light leaving the surface per unit area, before the Fresnel transmittance toward the viewer
+	Vector3 getSubsurfaceDiffuseExitance(const HitData& hitData);
 
-	void createSamplingPatterns();
+	// Precomputed irradiance on the surfaces of each BSSRDF
+	std::map<const BSSRDF*, IrradianceTree*> irradianceTrees;
+	void buildIrradianceTrees();
+	// Light transmitted into the surface at the sample's position
+	void computeIrradiance(BSSRDF* bssrdf, IrradianceSample& sample);
+
+	// Indirect diffuse lighting
+	IrradianceCache* irradianceCache;
+	// Irradiance arriving at a hit from other surfaces, from the cache or a new record
+	Vector3 getIndirectIrradiance(const HitData& hitData);
+	// Sample the hemisphere above a hit to create a new record
+	void computeIrradianceRecord(const HitData& hitData, IrradianceRecord& record);
+	// Radiance leaving the first surface along a hemisphere sample (direct and subsurface light only), and its distance
+	Vector3 getGatherRadiance(const Vector3& origin, const Vector3& direction, float& distance);
+
+	// Visibility of the lights, and the index of each light in the scene for it
+	VisibilityCache* visibilityCache;
+	std::map<const LightSource*, int> lightIndices;
+	// Hash of the geometry and lights, the visibility cache is only valid while they don't change
+	unsigned long long getVisibilityHash();
+
+	// Baked lighting, NULL unless baked or loaded
+	Lightmap* lightmap;
+	// Average of the view independent light over a texel of a chart: diffuse irradiance, or diffuse exitance on subsurface surfaces
+	Vector3 bakeTexel(Lightmap* baked, const LightmapChart& chart, int x, int y);
+	// Hash of the geometry, lights and subsurface materials a lightmap depends on
+	unsigned long long getLightmapHash();
+
+	// Caustics
+	PhotonMap* causticMap;
+	// How far to search for caustic photons
+	float causticRadius;
+	// Whether direct light through transparent objects is left to the caustic photons
+	// Decided when the renderer is created, so a lightmap bake (which builds no photon map) leaves out the same light
+	bool causticTransmission;
+	// Bounds of each object that can focus light into caustics
+	void findCausticTargets(std::map<Object*, BoundingBox>& targetBounds);
+	void buildCausticPhotonMap();
+	// Emit one of numPhotons photons from light toward the sphere at targetCenter
+	// firstHitAttenuation tells tracePhoton to apply the light's falloff where the photon first lands
+	void emitCausticPhoton(const LightSource* light, const Vector3& targetCenter, float targetRadius, float sceneSize, int numPhotons,
+		Vector3& origin, Vector3& direction, Vector3& power, bool& firstHitAttenuation);
+	// Follow a photon through specular bounces and store it wherever it lands on a diffuse surface after at least one of them
+	// Photons that don't hit target first are dropped, so light reaching a target through another target's cone isn't stored twice
+	void tracePhoton(Vector3 origin, Vector3 direction, Vector3 power, const LightSource* light, bool firstHitAttenuation, const Object* target, std::vector<Photon>& photons);
+
+	// Bounds of all primitives in the scene
+	BoundingBox getSceneBounds();
 
 	// Recording points for debugging
 	std::ofstream recordSegmentFile, recordNormalFile;
@@ -57,8 +288,28 @@ private:
 
 public:
 	// Create a renderer for the given scene
+	// The scene's lights must not change while the renderer exists
 	Renderer(Scene* scene, int samplesPerPixel = 1);
+	virtual ~Renderer();
+
+	// Build the caustic photon map and the subsurface irradiance trees, call before the first ColorPixel
+	// Baking doesn't need it, BakeLightmap only builds the irradiance trees
+	void Preprocess();
 
 	// Samples the pixel i,j and outputs the final color
-	void ColorPixel(int i, int j, Vector3& outColor);
+	// Progressive rendering calls this once per pass, each pass continues the sample sequence of the last
+	// If features is given, the first hit features averaged over the same samples are put there too
+	void ColorPixel(int i, int j, Vector3& outColor, int pass = 0, PixelFeatures* features = NULL);
+
+	// Bake the diffuse direct lighting, shadows and subsurface light of every surface into a lightmap, save it to path and render with it
+	// Only valid for the current geometry, lights and environment map
+	void BakeLightmap(const char* path);
+	// Render with a lightmap saved by BakeLightmap, so diffuse lighting needs no shadow rays
+	// Specular highlights, reflections and refractions are still traced
+	// Returns false if there is no lightmap for this scene at path
+	bool LoadLightmap(const char* path);
+
+	// ColorPixel for the pixels iStart to iEnd - 1 of row j, whose camera rays are traced together
+	// outColors (and features if given) hold one entry per pixel
+	void ColorPixels(int iStart, int iEnd, int j, Vector3* outColors, int pass = 0, PixelFeatures* features = NULL);
 };
\ No newline at end of file
@@ -0,0 +1,146 @@
+#pragma once
+#include <cstdint>
+#include <algorithm>
+
+// Largest float below 1
+#define ONE_MINUS_EPSILON 0.99999994f
+
+// Generates the random numbers consumed by one camera sample
+// Every call to Get1D or Get2D moves on to the next dimension, so the n-th number drawn by a sample
+// is always the same dimension of the underlying sequence
+class Sampler {
+protected:
+	// Current pixel, sample and dimension
+	uint32_t pixelSeed;
+	uint32_t sampleIndex;
+	uint32_t dimension;
+
+	// Integer hash with good avalanche (from "Hash Functions for GPU Rendering", Jarzynski and Olano)
+	static uint32_t hash(uint32_t x) {
+		x ^= x >> 16;
+		x *= 0x7feb352du;
+		x ^= x >> 15;
+		x *= 0x846ca68bu;
+		x ^= x >> 16;
+		return x;
+	}
+
+	static uint32_t hashCombine(uint32_t seed, uint32_t value) {
+		return seed ^ (hash(value) + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+	}
+
+	// Map 32 random bits to [0,1)
+	static float toFloat(uint32_t bits) {
+		return std::min(bits * 2.3283064365386963e-10f, ONE_MINUS_EPSILON);
+	}
+
+public:
+	Sampler() : pixelSeed(0), sampleIndex(0), dimension(0) {}
+	virtual ~Sampler() {}
+
+	// Start generating numbers for sample number index of pixel (x,y)
+	// Progressive rendering continues the index across passes
+	// firstDimension picks a sample up again after the numbers before it were already drawn
+	void StartSample(int x, int y, int index, int firstDimension = 0) {
+		pixelSeed = hashCombine(hash((uint32_t)x), (uint32_t)y);
+		sampleIndex = (uint32_t)index;
+		dimension = (uint32_t)firstDimension;
+	}
+
+	// Next dimension, in [0,1)
+	virtual float Get1D() = 0;
+
+	// Next two dimensions, stratified together (use for pixel and lens positions, points on lights, ...)
+	virtual void Get2D(float& u, float& v) = 0;
+
+	// A new sampler of the same kind, for another thread
+	virtual Sampler* Clone() const = 0;
+};
+
+// Independent uniform random numbers, hashed from the pixel, sample and dimension
+class IndependentSampler : public Sampler {
+public:
+	float Get1D() {
+		uint32_t bits = hash(hashCombine(hashCombine(pixelSeed, sampleIndex), dimension++));
+		return toFloat(bits);
+	}
+
+	void Get2D(float& u, float& v) {
+		u = Get1D();
+		v = Get1D();
+	}
+
+	Sampler* Clone() const {
+		return new IndependentSampler();
+	}
+};
+
+// Owen-scrambled Sobol points, padded across dimensions
+// Each pair of dimensions uses the first two Sobol dimensions with its own scrambling and its own shuffle of the sample index,
+// so any prefix of the samples is well stratified in every pair, for any number of samples per pixel
+// See Burley 2020, "Practical Hash-based Owen Scrambling"
+class SobolSampler : public Sampler {
+private:
+	static uint32_t reverseBits(uint32_t x) {
+		x = (x << 16) | (x >> 16);
+		x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+		x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+		x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+		x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+		return x;
+	}
+
+	// Hash where each bit only depends on itself and lower bits (Laine and Karras 2011)
+	static uint32_t laineKarrasPermutation(uint32_t x, uint32_t seed) {
+		x += seed;
+		x ^= x * 0x6c50b47cu;
+		x ^= x * 0xb82f1e52u;
+		x ^= x * 0xc7afe638u;
+		x ^= x * 0x8d22f6e6u;
+		return x;
+	}
+
+	// Owen scrambling: each bit is flipped depending on all the bits above it
+	static uint32_t nestedUniformScramble(uint32_t x, uint32_t seed) {
+		return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+	}
+
+	// First Sobol dimension (van der Corput)
+	static uint32_t sobol0(uint32_t index) {
+		return reverseBits(index);
+	}
+
+	// Second Sobol dimension
+	static uint32_t sobol1(uint32_t index) {
+		uint32_t result = 0;
+		for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+			if (index & 1)
+				result ^= v;
+		}
+		return result;
+	}
+
+	// Shuffled sample index for the current dimension
+	uint32_t shuffledIndex(uint32_t seed) {
+		return nestedUniformScramble(sampleIndex, seed);
+	}
+
+public:
+	float Get1D() {
+		uint32_t seed = hashCombine(pixelSeed, dimension++);
+		uint32_t index = shuffledIndex(seed);
+		return toFloat(nestedUniformScramble(sobol0(index), hash(seed)));
+	}
+
+	void Get2D(float& u, float& v) {
+		uint32_t seed = hashCombine(pixelSeed, dimension);
+		dimension += 2;
+		uint32_t index = shuffledIndex(seed);
+		u = toFloat(nestedUniformScramble(sobol0(index), hash(seed)));
+		v = toFloat(nestedUniformScramble(sobol1(index), hash(seed ^ 0x5bd1e995u)));
+	}
+
+	Sampler* Clone() const {
+		return new SobolSampler();
+	}
+};
@@ -1,6 +1,6 @@
 #include "Scene.h"
 
-Scene::Scene(const char* sceneFile, int width, int height, float focalLength, float lensRadius) {
+Scene::Scene(const char* sceneFile, int width, int height, float focalLength, float lensRadius) : raysTraced(TaskScheduler::Get().NumThreads() + 1), environment(NULL) {
 	//load scene
 	SceneIO* scene = readScene(sceneFile);
 	if (scene == NULL) {
@@ -56,6 +56,9 @@ void Scene::loadLights(const SceneIO* scene) {
 		else if (lightNode->type == LightType::DIRECTIONAL_LIGHT) {
 			light = new DirectionalLightSource(lightNode->direction);
 		}
+		else if (lightNode->type == LightType::SPOT_LIGHT) {
+			light = new SpotLightSource(lightNode->position, lightNode->direction, lightNode->cutOffAngle, lightNode->dropOffRate);
+		}
 		else {
 			printf("Unsupported LightType ignored.\n");
 		}
@@ -214,6 +217,11 @@ void Scene::SetObjectShader(int index, ColorShader* color, IntersectionShader* i
 void Scene::SetObjectBSSRDF(int index, BSSRDF* bssrdf) {
 	for (int i = 0; i < objects[index]->primitives.size(); i++)
 		objects[index]->primitives[i]->SetBSSRDF(bssrdf);
+#ifdef ACCELERATION
+	//subsurface probe rays only need to find this object
+	if (objects[index]->kdtree == NULL)
+		objects[index]->BuildKDTree();
+#endif
 }
 
 void Scene::RemoveObject(int index) {
@@ -228,4 +236,21 @@ void Scene::RemoveObject(int index) {
 	//rebuild kdtree
 	delete kdtree;
 	kdtree = new KDTree(primitives);
-}
\ No newline at end of file
+}
+unsigned long long Scene::HashLighting(unsigned long long hash) const {
+	for (int i = 0; i < lights.size(); i++)
+		hash = lights[i]->Hash(hash);
+	if (environment != NULL)
+		hash = environment->Hash(hash);
+	for (int i = 0; i < primitives.size(); i++) {
+		Vector3 emission = primitives[i]->GetEmission();
+		hash = FileUtil::Hash(&emission, sizeof(emission), hash);
+		//primitives without a BSSRDF still add to the hash, so moving one to another primitive changes it
+		BSSRDF* bssrdf = primitives[i]->GetBSSRDF();
+		int hasBSSRDF = bssrdf != NULL;
+		hash = FileUtil::Hash(&hasBSSRDF, sizeof(hasBSSRDF), hash);
+		if (bssrdf != NULL)
+			hash = bssrdf->Hash(hash);
+	}
+	return hash;
+}
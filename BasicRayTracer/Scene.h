@@ -7,12 +7,23 @@
 #include "LightSource.h"
 #include "Camera.h"
 #include "KDTree.h"
+#include "EnvironmentMap.h"
 #include "Timer.h"
+#include "TaskScheduler.h"
 #include <vector>
+#include <atomic>
 
 #define FULLY_OPAQUE_THRESHOLD 0.01f
 #define ACCELERATION
 
+// Rays traced by one worker, padded to its own cache line so workers don't share one
+struct RayCounter {
+	std::atomic<long long> count;
+	char padding[64 - sizeof(std::atomic<long long>)];
+
+	RayCounter() : count(0) {}
+};
+
 // Contains all of the information needed to render a scene
 class Scene {
 	// All objects in scene
@@ -25,6 +36,22 @@ class Scene {
 	// Acceleration structure
 	KDTree* kdtree;
 
+	// Number of rays (of any kind) traced through the scene, for benchmarking
+	// One counter per worker of the task scheduler, so counting doesn't contend, and one shared by threads that aren't workers
+	mutable std::vector<RayCounter> raysTraced;
+
+	// Add to the calling thread's ray count
+	void countRays(long long numRays) const {
+		int worker = TaskScheduler::Get().WorkerIndex();
+		if (worker < 0) {
+			raysTraced[0].count.fetch_add(numRays, std::memory_order_relaxed);
+			return;
+		}
+		//only this worker writes its counter, so it needs no atomic read-modify-write
+		std::atomic<long long>& count = raysTraced[worker + 1].count;
+		count.store(count.load(std::memory_order_relaxed) + numRays, std::memory_order_relaxed);
+	}
+
 	// Scene loading helper functions
 	void loadLights(const SceneIO* scene);
 	void loadObjects(const SceneIO* scene);
@@ -40,18 +67,47 @@ public:
 	std::vector<LightSource*> lights;
 	//Camera information to create rays
 	ThinLensCamera* camera;
+	//Light from rays that leave the scene, NULL for none
+	EnvironmentMap* environment;
 
 	// Loads a scene from sceneFile and sets up camera for image dimensions of [width x height]
 	Scene(const char* sceneFile, int width, int height, float focalLength, float lensRadius);
 
+	// All objects in the scene
+	const std::vector<Object*>& GetObjects() const {
+		return objects;
+	}
+
+	// All primitives in the scene
+	const std::vector<Primitive*>& GetPrimitives() const {
+		return primitives;
+	}
+
+	// Number of rays traced so far
+	long long GetRaysTraced() const {
+		long long total = 0;
+		for (int i = 0; i < raysTraced.size(); i++)
+			total += raysTraced[i].count.load(std::memory_order_relaxed);
+		return total;
+	}
+
+	// Hash of the lights, the environment and every primitive's emission and subsurface scattering, continuing from hash
+	unsigned long long HashLighting(unsigned long long hash) const;
+
 	// Set object properties
 	void SetObjectShader(int index, ColorShader* color, IntersectionShader* intersect);
 	void SetObjectBSSRDF(int index, BSSRDF* bssrdf);
 	void RemoveObject(int index);
+	// Light the scene with an environment map, the scene deletes it
+	void SetEnvironment(EnvironmentMap* environmentMap) {
+		delete environment;
+		environment = environmentMap;
+	}
 
 	~Scene() {
 		//clean up
 		delete camera;
+		delete environment;
 		//delete objects
 		for (int i = 0; i < objects.size(); i++) {
 			delete objects[i];
@@ -76,6 +132,7 @@ public:
 
 	// Find the closest object the ray intersects with and outputs hit information
 	bool GetClosestIntersection(const Vector3& origin, const Vector3& direction, HitData& hitData, Object** hitObject) const {
+		countRays(1);
 #ifdef ACCELERATION
 		return kdtree->GetClosestIntersection(origin, direction, hitData, hitObject);
 #else
@@ -97,10 +154,62 @@ public:
 #endif
 	}
 
+	// Find the closest intersections of numRays rays together, hitObjects[i] is NULL for rays that hit nothing
+	void GetClosestIntersections(int numRays, const Vector3* origins, const Vector3* directions, HitData* hitData, Object** hitObjects) const {
+#ifdef ACCELERATION
+		countRays(numRays);
+		kdtree->GetClosestIntersections(numRays, origins, directions, hitData, hitObjects);
+#else
+		for (int i = 0; i < numRays; i++) {
+			hitObjects[i] = NULL;
+			GetClosestIntersection(origins[i], directions[i], hitData[i], &hitObjects[i]);
+		}
+#endif
+	}
+
+	// Find the closest intersection with the primitives of one object, ignoring the rest of the scene
+	bool GetClosestIntersection(const Vector3& origin, const Vector3& direction, HitData& hitData, const Object* object) const {
+		countRays(1);
+#ifdef ACCELERATION
+		if (object->kdtree != NULL) {
+			Object* hitObject;
+			return object->kdtree->GetClosestIntersection(origin, direction, hitData, &hitObject);
+		}
+#endif
+		float closest = FLT_MAX;
+		bool hit = false;
+		//iterate over the object's primitives
+		for (int i = 0; i < object->primitives.size(); i++) {
+			HitData thisHitData;
+			if (object->primitives[i]->intersects(origin, direction, thisHitData) && thisHitData.t < closest) {
+				closest = thisHitData.t;
+				hit = true;
+				hitData = thisHitData;
+			}
+		}
+		return hit;
+	}
+
 	// Trace a shadow ray and output the color attenuation in shadowFactor
-	void TraceShadowRay(const Vector3& origin, const Vector3& direction, Vector3& shadowFactor, float maxDist) const {
+	// If lastOccluder is given, the primitive it points to is tested first and the traversal is skipped if it still blocks the ray
+	// lastOccluder is then updated to the primitive that blocked this ray
+	void TraceShadowRay(const Vector3& origin, const Vector3& direction, Vector3& shadowFactor, float maxDist, Primitive** lastOccluder = NULL) const {
+		countRays(1);
+		//try the cached occluder first
+		if (lastOccluder != NULL && *lastOccluder != NULL) {
+			HitData thisHitData;
+			if ((*lastOccluder)->intersects(origin, direction, thisHitData) && thisHitData.t < maxDist && thisHitData.t >= MIN_SHADOW_INTERSECT
+				&& thisHitData.material.ktran < FULLY_OPAQUE_THRESHOLD) {
+				shadowFactor = Vector3(0, 0, 0);
+				return;
+			}
+		}
 #ifdef ACCELERATION
-		return kdtree->TraceShadowRay(origin, direction, shadowFactor, maxDist);
+		Primitive* occluder = NULL;
+		kdtree->TraceShadowRay(origin, direction, shadowFactor, maxDist, &occluder);
+		//keep the previous occluder if nothing blocked this ray, neighbouring rays are likely to hit it again
+		if (lastOccluder != NULL && occluder != NULL)
+			*lastOccluder = occluder;
 #else
 		//start by allowing all light
 		shadowFactor = Vector3(1, 1, 1);
@@ -110,6 +219,8 @@ public:
 				//fully opaque? block all light
 				if (thisHitData.material.ktran < FULLY_OPAQUE_THRESHOLD) {
 					shadowFactor = Vector3(0, 0, 0);
+					if (lastOccluder != NULL)
+						*lastOccluder = primitives[i];
 					return;
 				}
 				//normalize Cd
@@ -120,6 +231,44 @@ public:
 				shadowFactor = shadowFactor * thisHitData.material.ktran * normalizedDiffuse;
 			}
 		}
+#endif
+	}
+
+	// Trace numRays shadow rays toward the same point light together and output their color attenuation in shadowFactors
+	// Same results and use of lastOccluder as calling TraceShadowRay for each ray
+	void TraceShadowRays(int numRays, const Vector3* origins, const Vector3* directions, const float* maxDists, Vector3* shadowFactors, Primitive** lastOccluder = NULL) const {
+#ifdef ACCELERATION
+		countRays(numRays);
+		//rays the cached occluder still blocks are done, the rest form the packet
+		std::vector<int> packetRays;
+		std::vector<Vector3> packetOrigins, packetDirections, packetFactors;
+		std::vector<float> packetMaxDists;
+		for (int i = 0; i < numRays; i++) {
+			if (lastOccluder != NULL && *lastOccluder != NULL) {
+				HitData thisHitData;
+				if ((*lastOccluder)->intersects(origins[i], directions[i], thisHitData) && thisHitData.t < maxDists[i] && thisHitData.t >= MIN_SHADOW_INTERSECT
+					&& thisHitData.material.ktran < FULLY_OPAQUE_THRESHOLD) {
+					shadowFactors[i] = Vector3(0, 0, 0);
+					continue;
+				}
+			}
+			packetRays.push_back(i);
+			packetOrigins.push_back(origins[i]);
+			packetDirections.push_back(directions[i]);
+			packetMaxDists.push_back(maxDists[i]);
+		}
+		if (packetRays.empty())
+			return;
+		packetFactors.resize(packetRays.size());
+		Primitive* occluder = NULL;
+		kdtree->TraceShadowRays(packetRays.size(), packetOrigins.data(), packetDirections.data(), packetMaxDists.data(), packetFactors.data(), &occluder);
+		for (int i = 0; i < packetRays.size(); i++)
+			shadowFactors[packetRays[i]] = packetFactors[i];
+		if (lastOccluder != NULL && occluder != NULL)
+			*lastOccluder = occluder;
+#else
+		for (int i = 0; i < numRays; i++)
+			TraceShadowRay(origins[i], directions[i], shadowFactors[i], maxDists[i], lastOccluder);
 #endif
 	}
 };
\ No newline at end of file
@@ -0,0 +1,174 @@
+#include "TaskScheduler.h"
+
+// Scheduler the calling thread works for and its index in it
+static thread_local TaskScheduler* CurrentScheduler = NULL;
+static thread_local int CurrentWorker = -1;
+
+int TaskScheduler::requestedThreads = 0;
+
+bool WorkStealingDeque::Push(Task* task) {
+	long long b = bottom.load(std::memory_order_relaxed);
+	long long t = top.load(std::memory_order_acquire);
+	if (b - t >= TASK_DEQUE_CAPACITY)
+		return false;
+	tasks[b & (TASK_DEQUE_CAPACITY - 1)].store(task, std::memory_order_relaxed);
+	//the task must be visible before thieves can see the new bottom
+	std::atomic_thread_fence(std::memory_order_release);
+	bottom.store(b + 1, std::memory_order_relaxed);
+	return true;
+}
+
+Task* WorkStealingDeque::Pop() {
+	long long b = bottom.load(std::memory_order_relaxed) - 1;
+	bottom.store(b, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	long long t = top.load(std::memory_order_relaxed);
+	if (t > b) {
+		//empty
+		bottom.store(b + 1, std::memory_order_relaxed);
+		return NULL;
+	}
+	Task* task = tasks[b & (TASK_DEQUE_CAPACITY - 1)].load(std::memory_order_relaxed);
+	if (t == b) {
+		//last task, race the thieves for it
+		if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			task = NULL;
+		bottom.store(b + 1, std::memory_order_relaxed);
+	}
+	return task;
+}
+
+Task* WorkStealingDeque::Steal() {
+	long long t = top.load(std::memory_order_acquire);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	long long b = bottom.load(std::memory_order_acquire);
+	if (t >= b)
+		return NULL;
+	Task* task = tasks[t & (TASK_DEQUE_CAPACITY - 1)].load(std::memory_order_relaxed);
+	//lost to the owner or another thief, the slot may already hold a newer task
+	if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+		return NULL;
+	return task;
+}
+
+TaskScheduler::TaskScheduler(int numThreads) : queuedTasks(0), sleepingWorkers(0), stopping(false) {
+	if (numThreads < 1)
+		numThreads = 1;
+	for (int i = 0; i < numThreads; i++) {
+		workers.push_back(new Worker());
+		workers[i]->random = 2654435761u * (i + 1);
+	}
+	//this thread is worker 0, it works while it waits
+	CurrentScheduler = this;
+	CurrentWorker = 0;
+	for (int i = 1; i < numThreads; i++)
+		threads.push_back(std::thread(&TaskScheduler::workerLoop, this, i));
+}
+
+TaskScheduler::~TaskScheduler() {
+	stopping = true;
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		wakeUp.notify_all();
+	}
+	for (int i = 0; i < threads.size(); i++)
+		threads[i].join();
+	for (int i = 0; i < workers.size(); i++)
+		delete workers[i];
+	if (CurrentScheduler == this) {
+		CurrentScheduler = NULL;
+		CurrentWorker = -1;
+	}
+}
+
+TaskScheduler& TaskScheduler::Get() {
+	static TaskScheduler scheduler(requestedThreads > 0 ? requestedThreads : (int)std::thread::hardware_concurrency());
+	return scheduler;
+}
+
+void TaskScheduler::SetNumThreads(int numThreads) {
+	requestedThreads = numThreads;
+}
+
+int TaskScheduler::WorkerIndex() const {
+	return (CurrentScheduler == this) ? CurrentWorker : -1;
+}
+
+void TaskScheduler::workerLoop(int index) {
+	CurrentScheduler = this;
+	CurrentWorker = index;
+	int spins = 0;
+	while (!stopping.load(std::memory_order_relaxed)) {
+		Task* task = findTask(index);
+		if (task != NULL) {
+			execute(task);
+			spins = 0;
+			continue;
+		}
+		if (++spins < TASK_IDLE_SPINS) {
+			std::this_thread::yield();
+			continue;
+		}
+		//nothing to do, sleep until something is spawned
+		//Spawn counts the task before checking for sleepers, and this checks for tasks after counting itself, so one of them sees the other
+		spins = 0;
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		sleepingWorkers++;
+		wakeUp.wait(lock, [this]() { return queuedTasks.load() > 0 || stopping.load(); });
+		sleepingWorkers--;
+	}
+}
+
+Task* TaskScheduler::findTask(int index) {
+	Worker* self = workers[index];
+	Task* task = self->deque.Pop();
+	if (task == NULL && workers.size() > 1) {
+		//try every other worker once, starting from a random one so thieves spread out
+		self->random ^= self->random << 13;
+		self->random ^= self->random >> 17;
+		self->random ^= self->random << 5;
+		int start = self->random % NumThreads();
+		for (int i = 0; i < workers.size() && task == NULL; i++) {
+			int victim = (start + i) % NumThreads();
+			if (victim != index)
+				task = workers[victim]->deque.Steal();
+		}
+	}
+	if (task != NULL)
+		queuedTasks.fetch_sub(1);
+	return task;
+}
+
+void TaskScheduler::execute(Task* task) {
+	//the task may delete itself
+	std::atomic<int>* pending = task->pending;
+	task->run(task);
+	pending->fetch_sub(1, std::memory_order_release);
+}
+
+void TaskScheduler::wakeWorkers() {
+	std::lock_guard<std::mutex> lock(sleepMutex);
+	wakeUp.notify_one();
+}
+
+void TaskScheduler::Spawn(Task* task) {
+	int index = WorkerIndex();
+	if (index < 0 || !workers[index]->deque.Push(task)) {
+		execute(task);
+		return;
+	}
+	queuedTasks.fetch_add(1);
+	if (sleepingWorkers.load() > 0)
+		wakeWorkers();
+}
+
+void TaskScheduler::WaitFor(std::atomic<int>& pending) {
+	int index = WorkerIndex();
+	while (pending.load(std::memory_order_acquire) > 0) {
+		Task* task = (index >= 0) ? findTask(index) : NULL;
+		if (task != NULL)
+			execute(task);
+		else
+			std::this_thread::yield();
+	}
+}
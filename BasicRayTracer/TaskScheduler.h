@@ -0,0 +1,196 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Tasks each worker's deque can hold, a worker that spawns more runs the extra tasks itself
+#define TASK_DEQUE_CAPACITY 4096
+// Times an idle worker looks for work before going to sleep
+#define TASK_IDLE_SPINS 64
+
+// Unit of work, run at most once by whichever worker gets it
+// pending is decremented once run returns, run may delete the task
+struct Task {
+	void (*run)(Task* task);
+	std::atomic<int>* pending;
+};
+
+// Chase-Lev work-stealing deque
+// Only the owning worker pushes and pops at the bottom, any thread may steal from the top, so the owner works
+// on its newest (cache-warm) tasks while thieves take the oldest, which are usually the biggest pieces of work
+// See Chase and Lev 2005, "Dynamic Circular Work-Stealing Deque" and Le et al. 2013, "Correct and Efficient Work-Stealing for Weak Memory Models"
+class WorkStealingDeque {
+private:
+	std::atomic<Task*> tasks[TASK_DEQUE_CAPACITY];
+	// Thieves advance top, the owner moves bottom, padded onto cache lines of their own
+	// (padding rather than alignas, so workers can be allocated with plain new)
+	char paddingBeforeTop[64];
+	std::atomic<long long> top;
+	char paddingBeforeBottom[64 - sizeof(std::atomic<long long>)];
+	std::atomic<long long> bottom;
+	char paddingAfterBottom[64 - sizeof(std::atomic<long long>)];
+
+public:
+	WorkStealingDeque() : top(0), bottom(0) {}
+
+	// Owner only, returns false if the deque is full
+	bool Push(Task* task);
+	// Owner only, newest task or NULL if empty
+	Task* Pop();
+	// Any thread, oldest task or NULL if empty or another thread won it
+	Task* Steal();
+};
+
+// Fixed set of worker threads that run tasks from each other's deques
+// The thread that creates the scheduler is worker 0 and works whenever it waits for tasks, so NUM_THREADS workers
+// use NUM_THREADS threads in total. A task may spawn more tasks and wait for them (nested parallelism),
+// waiting never blocks a worker: it runs other tasks until the ones it waits for are done, so a task must not
+// hold a lock or be partway through using per-thread state (like the renderer's samplers) while it waits
+// Loops and groups started from threads that aren't workers just run on that thread
+class TaskScheduler {
+private:
+	struct Worker {
+		WorkStealingDeque deque;
+		// State for picking victims to steal from
+		unsigned int random;
+	};
+	std::vector<Worker*> workers;
+	std::vector<std::thread> threads;
+
+	// Tasks pushed but not taken yet, sleeping workers are only woken when this is above 0
+	std::atomic<int> queuedTasks;
+	std::atomic<int> sleepingWorkers;
+	std::atomic<bool> stopping;
+	std::mutex sleepMutex;
+	std::condition_variable wakeUp;
+
+	// Worker count for Get
+	static int requestedThreads;
+
+	void workerLoop(int index);
+	// Pop from the worker's own deque, or steal from another
+	Task* findTask(int index);
+	void execute(Task* task);
+	void wakeWorkers();
+
+public:
+	TaskScheduler(int numThreads);
+	~TaskScheduler();
+
+	// Scheduler shared by the whole program, created by the first call
+	static TaskScheduler& Get();
+	// Number of workers Get creates the scheduler with (the hardware thread count if never called)
+	// Must be called before the first Get
+	static void SetNumThreads(int numThreads);
+
+	int NumThreads() const {
+		return (int)workers.size();
+	}
+
+	// Tasks waiting to be taken, a hint of how much work is left to share
+	int NumQueuedTasks() const {
+		return queuedTasks.load(std::memory_order_relaxed);
+	}
+
+	// Index of the calling thread's worker in this scheduler, -1 if it isn't one
+	int WorkerIndex() const;
+
+	// Queue task on the calling worker's deque, the caller must be a worker
+	// Runs it immediately if the deque is full
+	void Spawn(Task* task);
+
+	// Run tasks until pending drops to 0
+	// pending must only count tasks that are spawned or running, so they can all be finished by some worker
+	void WaitFor(std::atomic<int>& pending);
+
+	// Call body(i) for every i in [begin, end), in tasks of grainSize iterations, and wait for them all
+	template <typename F>
+	void ParallelFor(int begin, int end, int grainSize, const F& body);
+};
+
+// Tasks spawned from one thread that can be waited for together
+// Run may be called from inside tasks of the group or of other groups, and Wait helps run any task in the meantime
+class TaskGroup {
+private:
+	TaskScheduler& scheduler;
+	std::atomic<int> pending;
+
+	template <typename F>
+	struct FunctionTask : Task {
+		F function;
+		FunctionTask(const F& function) : function(function) {}
+		static void Run(Task* task) {
+			FunctionTask* self = static_cast<FunctionTask*>(task);
+			self->function();
+			delete self;
+		}
+	};
+
+public:
+	TaskGroup(TaskScheduler& scheduler = TaskScheduler::Get()) : scheduler(scheduler), pending(0) {}
+	~TaskGroup() {
+		Wait();
+	}
+
+	// Run function() as a task, or right away on threads that aren't workers
+	template <typename F>
+	void Run(const F& function) {
+		if (scheduler.WorkerIndex() < 0) {
+			function();
+			return;
+		}
+		FunctionTask<F>* task = new FunctionTask<F>(function);
+		task->run = &FunctionTask<F>::Run;
+		task->pending = &pending;
+		pending.fetch_add(1);
+		scheduler.Spawn(task);
+	}
+
+	// Wait for every task run so far
+	void Wait() {
+		if (pending.load(std::memory_order_acquire) > 0)
+			scheduler.WaitFor(pending);
+	}
+};
+
+template <typename F>
+struct ParallelForTask : Task {
+	const F* body;
+	int begin, end;
+	static void Run(Task* task) {
+		ParallelForTask* self = static_cast<ParallelForTask*>(task);
+		for (int i = self->begin; i < self->end; i++)
+			(*self->body)(i);
+	}
+};
+
+template <typename F>
+void TaskScheduler::ParallelFor(int begin, int end, int grainSize, const F& body) {
+	if (begin >= end)
+		return;
+	grainSize = grainSize > 0 ? grainSize : 1;
+	int numTasks = (end - begin + grainSize - 1) / grainSize;
+	//nothing to share, or nobody to share it with
+	if (numTasks == 1 || WorkerIndex() < 0) {
+		for (int i = begin; i < end; i++)
+			body(i);
+		return;
+	}
+
+	//all of the loop's tasks in one allocation, they live until the wait below returns
+	std::vector<ParallelForTask<F>> tasks(numTasks);
+	std::atomic<int> pending(numTasks);
+	//spawned last first, so this worker pops them in order and thieves take from the end of the range
+	for (int t = numTasks - 1; t >= 0; t--) {
+		ParallelForTask<F>& task = tasks[t];
+		task.run = &ParallelForTask<F>::Run;
+		task.pending = &pending;
+		task.body = &body;
+		task.begin = begin + t * grainSize;
+		task.end = (task.begin + grainSize < end) ? task.begin + grainSize : end;
+		Spawn(&task);
+	}
+	WaitFor(pending);
+}
@@ -45,6 +45,13 @@ public:
 		return ((double) total_time.QuadPart) /((double) freq.QuadPart);
 	}
 
+	// Time since startTimer() without stopping the timer
+	double getElapsedTime(void) const{
+		LARGE_INTEGER t_now;
+		QueryPerformanceCounter(&t_now);
+		return ((double) (t_now.QuadPart - t_start.QuadPart)) /((double) freq.QuadPart);
+	}
+
 };
 
 
@@ -79,25 +79,25 @@ public:
 	}
 
 	// Square Root
-	Vector3 SquareRoot() {
+	Vector3 SquareRoot() const {
 		return Vector3(sqrt(x), sqrt(y), sqrt(z));
 	}
 
 	// Exponential
-	Vector3 Exp() {
+	Vector3 Exp() const {
 		return Vector3(exp(x), exp(y), exp(z));
 	}
 
 	// Luminance
-	float Luminance() {
+	float Luminance() const {
 		return 0.2126f * x + 0.7152f * y + 0.0722 * z;
 	}
 
-	float MaxComponent() {
+	float MaxComponent() const {
 		return max(x, max(y, z));
 	}
 
-	float Get(int axis) {
+	float Get(int axis) const {
 		if (axis == 0)
 			return x;
 		if (axis == 1)
@@ -0,0 +1,150 @@
+#include "VisibilityCache.h"
+#include "FileUtil.h"
+#include <cstring>
+#include <mutex>
+
+VisibilityCache::VisibilityCache(const BoundingBox& sceneBounds, unsigned long long sceneHash) : batches(TaskScheduler::Get().NumThreads()), sceneHash(sceneHash) {
+	//cubic cells, with a margin so points on the bounds stay inside the grid
+	BoundingBox bounds = sceneBounds;
+	float sceneSize = (bounds.maxCorner - bounds.minCorner).MaxComponent();
+	cellSize = max(sceneSize, 1e-6f) * 1.01f / VISIBILITY_CACHE_RESOLUTION;
+	origin = bounds.GetMidpoint() - Vector3(1.0f, 1.0f, 1.0f) * (cellSize * VISIBILITY_CACHE_RESOLUTION * 0.5f);
+}
+
+unsigned long long VisibilityCache::cellKey(int light, int x, int y, int z) {
+	//18 bits per coordinate, the rest for the light
+	return ((unsigned long long)light << 54) | ((unsigned long long)(x & 0x3ffff) << 36) | ((unsigned long long)(y & 0x3ffff) << 18) | (unsigned long long)(z & 0x3ffff);
+}
+
+bool VisibilityCache::Lookup(int light, const Vector3& position, Vector3& shadowFactor) const {
+	Vector3 cell = (position - origin) / cellSize;
+	int x = (int)floor(cell.x), y = (int)floor(cell.y), z = (int)floor(cell.z);
+	if (x < 0 || y < 0 || z < 0 || x >= VISIBILITY_CACHE_RESOLUTION || y >= VISIBILITY_CACHE_RESOLUTION || z >= VISIBILITY_CACHE_RESOLUTION)
+		return false;
+
+	std::shared_lock<std::shared_timed_mutex> lock(mutex);
+	auto it = cells.find(cellKey(light, x, y, z));
+	if (it == cells.end())
+		return false;
+	const VisibilityCell& visibility = it->second;
+	if (visibility.partial > 0 || (visibility.lit > 0 && visibility.blocked > 0) || visibility.lit + visibility.blocked < VISIBILITY_CACHE_MIN_SAMPLES)
+		return false;
+	//only between the points already traced from, not beyond them
+	Vector3 padding = Vector3(1.0f, 1.0f, 1.0f) * (cellSize * 0.01f);
+	Vector3 low = visibility.sampledMin - padding, high = visibility.sampledMax + padding;
+	if (position.x < low.x || position.y < low.y || position.z < low.z || position.x > high.x || position.y > high.y || position.z > high.z)
+		return false;
+	bool lit = visibility.lit > 0;
+
+	//a neighbour that saw anything else means a shadow edge is close
+	static const int offsets[6][3] = { { -1, 0, 0 }, { 1, 0, 0 }, { 0, -1, 0 }, { 0, 1, 0 }, { 0, 0, -1 }, { 0, 0, 1 } };
+	for (int i = 0; i < 6; i++) {
+		auto neighbour = cells.find(cellKey(light, x + offsets[i][0], y + offsets[i][1], z + offsets[i][2]));
+		if (neighbour != cells.end() && (neighbour->second.partial > 0 || (lit ? neighbour->second.blocked : neighbour->second.lit) > 0))
+			return false;
+	}
+
+	shadowFactor = lit ? Vector3(1, 1, 1) : Vector3(0, 0, 0);
+	return true;
+}
+
+void VisibilityCache::Add(int light, const Vector3& position, const Vector3& shadowFactor) {
+	Vector3 cell = (position - origin) / cellSize;
+	int x = (int)floor(cell.x), y = (int)floor(cell.y), z = (int)floor(cell.z);
+	if (x < 0 || y < 0 || z < 0 || x >= VISIBILITY_CACHE_RESOLUTION || y >= VISIBILITY_CACHE_RESOLUTION || z >= VISIBILITY_CACHE_RESOLUTION)
+		return;
+	VisibilitySample sample = { cellKey(light, x, y, z), position, shadowFactor };
+
+	//threads that aren't workers have no batch, they add their rays right away
+	int worker = TaskScheduler::Get().WorkerIndex();
+	if (worker < 0) {
+		std::unique_lock<std::shared_timed_mutex> lock(mutex);
+		addToCell(sample);
+		return;
+	}
+	std::vector<VisibilitySample>& samples = batches[worker].samples;
+	samples.push_back(sample);
+	if (samples.size() >= VISIBILITY_CACHE_BATCH_SIZE)
+		addBatch(samples);
+}
+
+void VisibilityCache::addBatch(std::vector<VisibilitySample>& samples) {
+	std::unique_lock<std::shared_timed_mutex> lock(mutex);
+	for (int i = 0; i < samples.size(); i++)
+		addToCell(samples[i]);
+	samples.clear();
+}
+
+void VisibilityCache::addToCell(const VisibilitySample& sample) {
+	//inserts an empty cell the first time
+	VisibilityCell& visibility = cells[sample.key];
+	const Vector3& position = sample.position;
+	if (visibility.lit + visibility.blocked + visibility.partial == 0) {
+		visibility.sampledMin = visibility.sampledMax = position;
+	}
+	else {
+		visibility.sampledMin = Vector3(min(visibility.sampledMin.x, position.x), min(visibility.sampledMin.y, position.y), min(visibility.sampledMin.z, position.z));
+		visibility.sampledMax = Vector3(max(visibility.sampledMax.x, position.x), max(visibility.sampledMax.y, position.y), max(visibility.sampledMax.z, position.z));
+	}
+	const Vector3& shadowFactor = sample.shadowFactor;
+	if (shadowFactor.MaxComponent() <= 0.0f)
+		visibility.blocked++;
+	else if (shadowFactor.x >= 1.0f && shadowFactor.y >= 1.0f && shadowFactor.z >= 1.0f)
+		visibility.lit++;
+	else
+		visibility.partial++;
+}
+
+void VisibilityCache::Flush() {
+	for (int i = 0; i < batches.size(); i++)
+		addBatch(batches[i].samples);
+}
+
+bool VisibilityCache::Save(const char* path) const {
+	std::shared_lock<std::shared_timed_mutex> lock(mutex);
+	return FileUtil::WriteAtomically(path, "visibility cache", [&](FILE* file) {
+		long long numCells = cells.size();
+		bool ok = fwrite(VISIBILITY_CACHE_MAGIC, 1, 8, file) == 8;
+		ok = ok && fwrite(&sceneHash, sizeof(sceneHash), 1, file) == 1;
+		ok = ok && fwrite(&numCells, sizeof(numCells), 1, file) == 1;
+		for (auto it = cells.begin(); ok && it != cells.end(); it++) {
+			ok = fwrite(&it->first, sizeof(it->first), 1, file) == 1;
+			ok = ok && fwrite(&it->second, sizeof(it->second), 1, file) == 1;
+		}
+		return ok;
+	});
+}
+
+bool VisibilityCache::Load(const char* path) {
+	FILE* file = fopen(path, "rb");
+	if (file == NULL)
+		return false;
+	char magic[8];
+	unsigned long long fileHash;
+	long long numCells;
+	bool ok = fread(magic, 1, 8, file) == 8 && memcmp(magic, VISIBILITY_CACHE_MAGIC, 8) == 0;
+	ok = ok && fread(&fileHash, sizeof(fileHash), 1, file) == 1;
+	if (ok && fileHash != sceneHash) {
+		printf("Visibility cache '%s' is from a different scene, ignoring it\n", path);
+		fclose(file);
+		return false;
+	}
+	ok = ok && fread(&numCells, sizeof(numCells), 1, file) == 1 && numCells >= 0;
+
+	std::unordered_map<unsigned long long, VisibilityCell> loaded;
+	for (long long i = 0; ok && i < numCells; i++) {
+		unsigned long long key;
+		VisibilityCell visibility;
+		ok = fread(&key, sizeof(key), 1, file) == 1 && fread(&visibility, sizeof(visibility), 1, file) == 1;
+		if (ok)
+			loaded[key] = visibility;
+	}
+	fclose(file);
+	if (!ok) {
+		printf("Visibility cache '%s' is damaged, ignoring it\n", path);
+		return false;
+	}
+	std::unique_lock<std::shared_timed_mutex> lock(mutex);
+	cells.swap(loaded);
+	return true;
+}
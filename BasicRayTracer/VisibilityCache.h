@@ -0,0 +1,87 @@
+#pragma once
+#include "BoundingBox.h"
+#include "TaskScheduler.h"
+#include <unordered_map>
+#include <shared_mutex>
+#include <cstdio>
+
+// Identifies visibility cache files, change the version when the layout changes
+#define VISIBILITY_CACHE_MAGIC "RTVIS001"
+// Cells per axis of the grid over the scene
+#define VISIBILITY_CACHE_RESOLUTION 128
+// Exact shadow rays a cell needs, all agreeing, before it answers lookups
+#define VISIBILITY_CACHE_MIN_SAMPLES 8
+// Shadow rays each worker collects before adding them to the grid together
+#define VISIBILITY_CACHE_BATCH_SIZE 256
+
+// Shadow rays traced from points inside one cell toward one light
+struct VisibilityCell {
+	// Rays that reached the light unblocked, that were blocked completely, and that were partly blocked by transparent surfaces
+	int lit, blocked, partial;
+	// Bounds of the points the rays started from
+	Vector3 sampledMin, sampledMax;
+};
+
+// A shadow ray waiting to be added to the grid
+struct VisibilitySample {
+	unsigned long long key;
+	Vector3 position;
+	Vector3 shadowFactor;
+};
+
+// Shadow rays a worker traced since its last batch, padded so workers don't share a cache line
+struct VisibilityBatch {
+	std::vector<VisibilitySample> samples;
+	char padding[64 - sizeof(std::vector<VisibilitySample>)];
+};
+
+// Per-light visibility of the scene on a hashed world-space grid, filled with the results of exact shadow rays
+// A cell answers for a light once all of its rays agree that it is lit or in shadow, and only for points among those the rays started from
+// Cells that straddle a shadow edge (or see the light through transparent surfaces) keep tracing exact rays,
+// and so do cells next to them, in case the edge passes between the points sampled so far
+// Only valid while the geometry and lights are unchanged, so the cache is stored with a hash of them and can be reused by later renders from other views
+// Safe to use from all render threads: lookups share the grid, and each worker collects its additions and locks the grid once per batch
+class VisibilityCache {
+private:
+	std::unordered_map<unsigned long long, VisibilityCell> cells;
+	mutable std::shared_timed_mutex mutex;
+	// Additions not in the grid yet, one batch per worker of the task scheduler
+	std::vector<VisibilityBatch> batches;
+
+	// Grid placement
+	Vector3 origin;
+	float cellSize;
+	// Geometry and lights the cache was built for
+	unsigned long long sceneHash;
+
+	// Key of the cell at integer coordinates x,y,z for a light
+	static unsigned long long cellKey(int light, int x, int y, int z);
+	// Count a shadow ray in its cell, the caller must hold the lock exclusively
+	void addToCell(const VisibilitySample& sample);
+	// Add a batch to the grid and empty it
+	void addBatch(std::vector<VisibilitySample>& samples);
+
+public:
+	// Create an empty cache covering sceneBounds, for the scene identified by sceneHash
+	VisibilityCache(const BoundingBox& sceneBounds, unsigned long long sceneHash);
+
+	// Shadow factor toward the light number light at position, if its cell is known to be uniformly lit or in shadow
+	bool Lookup(int light, const Vector3& position, Vector3& shadowFactor) const;
+
+	// Record the shadow factor of an exact shadow ray toward the light number light from position
+	// Workers' rays only reach the grid (and lookups) once their batch is full, or at Flush
+	void Add(int light, const Vector3& position, const Vector3& shadowFactor);
+
+	// Add every worker's partial batch to the grid, must not be called while rays are being added
+	void Flush();
+
+	// Write the cache to a temporary file and move it over path, rays that weren't flushed are left out
+	bool Save(const char* path) const;
+
+	// Replace the contents with the cache at path, if it was built for the same scene
+	bool Load(const char* path);
+
+	int NumCells() const {
+		return cells.size();
+	}
+};
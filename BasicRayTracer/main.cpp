@@ -2,12 +2,19 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "Timer.h"
 #include "Framebuffer.h"
+#include "AccumulationBuffer.h"
+#include "Denoiser.h"
+#include "Checkpoint.h"
+#include "FileUtil.h"
 #include "Scene.h"
 #include "Renderer.h"
+#include "PathTracer.h"
 #include "Camera.h"
 #include <iostream>
-#include "ctpl_stl.h"
+#include <algorithm>
+#include "TaskScheduler.h"
 #include <mutex>
+#include <shared_mutex>
 
 // Arguments
 #define IMAGE_WIDTH		800
@@ -15,7 +22,64 @@
 #define SCENE_PATH "../Scenes/test1.scene"
 #define OUTPUT_NAME "phasepositive.bmp"
 #define NUM_THREADS 4
-#define SAMPLES_PER_PIXEL 1	// Must be a power of 2
+#define SAMPLES_PER_PIXEL 1	// Any count, powers of 2 are stratified best
+// Pass this on the command line to render with the path tracer instead of the Whitted ray tracer
+#define PATH_TRACER_ARG "-path"
+
+// Environment lighting
+// Pass this on the command line followed by a latitude-longitude image (.hdr for high dynamic range) to light the scene with it
+// Rays that leave the scene see the image, and both integrators sample it by brightness for direct lighting
+#define ENVIRONMENT_ARG "-env"
+// Scales the radiance of the environment map
+#define ENVIRONMENT_INTENSITY 1.0f
+
+// Lightmaps
+// Pass BAKE_ARG on the command line to bake the diffuse direct lighting, shadows and subsurface light of the scene into LIGHTMAP_FILE and exit
+// Pass LIGHTMAP_ARG to render with the baked lighting instead of tracing shadow rays for it, as long as the geometry and lights are unchanged
+#define BAKE_ARG "-bake"
+#define LIGHTMAP_ARG "-lightmap"
+#define LIGHTMAP_FILE "lightmap.bin"
+
+// Progressive rendering
+// Renders the image in passes of SAMPLES_PER_PIXEL samples each and saves the image as it converges
+// Comment out to render a single pass
+//#define PROGRESSIVE
+// Stop once this many samples per pixel have been taken
+#define PROGRESSIVE_TARGET_SPP 256
+// Stop once the average relative error of the pixels drops below this (0 to disable)
+#define PROGRESSIVE_NOISE_TARGET 0.0f
+// Stop after this many seconds (0 to disable)
+#define PROGRESSIVE_TIME_LIMIT 0.0
+// Save the current image at most once every this many seconds
+#define PROGRESSIVE_SAVE_INTERVAL 5.0
+
+// Deadline rendering
+// Pass this on the command line followed by a number of seconds to render until then (counted from program start)
+// instead of for a fixed number of samples. Noisy tiles get more samples than converged ones
+#define DEADLINE_ARG "-deadline"
+// Passes over the whole image used to measure the cost and noise of every tile (the first pass is always completed)
+#define DEADLINE_INITIAL_PASSES 2
+// Fraction of the remaining time to allocate in each round, later rounds use the updated noise estimates
+#define DEADLINE_ROUND_FRACTION 0.5
+// Stop rendering at this fraction of the budget, to leave time for denoising and saving
+#define DEADLINE_SAFETY 0.95
+
+// Checkpointing
+// Saves the accumulated samples every CHECKPOINT_INTERVAL seconds so an interrupted render can be resumed
+// A render that finds a checkpoint of the same scene and settings continues from it, and deletes it when done
+// Comment out to disable
+#define CHECKPOINT
+#define CHECKPOINT_NAME "checkpoint.bin"
+#define CHECKPOINT_INTERVAL 60.0
+
+// Denoising
+// Records first hit albedo, normal and depth for every pixel and filters the final image guided by them
+// Useful for low sample counts, especially with the path tracer
+//#define DENOISE
+// The unfiltered image is saved here
+#define DENOISE_RAW_OUTPUT_NAME "raw.bmp"
+// Also save the albedo, normal, depth and variance buffers as images
+//#define SAVE_FEATURE_BUFFERS
 
 // Depth of Field Arguments
 #define FOCAL_LENGTH 12.0f
@@ -24,14 +88,32 @@
 #define LENS_RADIUS 0.0f 
 
 // Multithreading
-// Image will be broken into TILE_SIZE x TILE_SIZE blocks
+// Image will be broken into TILE_SIZE x TILE_SIZE blocks, rendered in the order of a Hilbert curve over them so tiles
+// rendered one after the other are next to each other and see mostly the same geometry
 #define TILE_SIZE 32
-// The number of tiles that have been rendered
-int NumTilesRendered = 0;
-// Mutex to protect NumTilesRendered because each thread will increment it when they finish
+// Tiles are split into quarters (recursively, down to MIN_TILE_SIZE) so all threads finish together: at the end of a pass,
+// once fewer tiles are waiting than there are threads, and when a tile has taken TILE_SPLIT_FACTOR times as long as the
+// median tile of the pass, which splits off its remaining rows
+#define MIN_TILE_SIZE 8
+#define TILE_SPLIT_FACTOR 4.0
+// The number of pixels of the current pass that have been rendered
+int NumPixelsRendered = 0;
+// Mutex to protect the progress of the pass because each thread will update it when they finish a tile
 std::mutex tilesRenderedMutex;
-// The total number of tiles in the image
-int NumTiles = 0;
+// The total number of pixels in the image
+int NumPixels = 0;
+// Time per pixel of the tiles of the current pass rendered so far, and its median (0 until there are enough tiles)
+std::vector<double> TilePixelTimes;
+double MedianPixelTime = 0.0;
+// Timer for the whole render, used to stop progressive rendering at the time limit
+Timer render_timer;
+// Where to save checkpoints, NULL if checkpointing is disabled
+Checkpoint* RenderCheckpoint = NULL;
+// Tile passes hold this shared while they render, a checkpoint holds it exclusively so it only sees whole tile passes
+std::shared_timed_mutex checkpointMutex;
+// Time of the last checkpoint and a mutex to protect it
+double LastCheckpointTime = 0.0;
+std::mutex checkpointTimeMutex;
 
 // Defines a region of the screen to be rendered
 struct Tile {
@@ -39,29 +121,340 @@ struct Tile {
 	int min_y, max_y;
 };
 
-// Renders a portion of the image
-void renderTile(int id, Renderer* renderer, FrameBuffer* fb, Tile tile) {
-	//iterate over all pixels in this region
+// Renders one pass over the pixels of a tile that don't have it yet
+// Stops after the row during which render_timer passes stopTime (0 to never stop) if MIN_TILE_SIZE rows are left after it
+// Returns the first row that wasn't rendered
+int renderTilePass(Renderer* renderer, AccumulationBuffer* accumulationBuffer, const Tile& tile, int pass, double stopTime = 0.0) {
+	std::shared_lock<std::shared_timed_mutex> checkpointLock(checkpointMutex);
+
+	//trace the pixels of each row of this region together
+	int width = tile.max_x - tile.min_x;
+	std::vector<Vector3> colors(width);
+#ifdef DENOISE
+	std::vector<PixelFeatures> features(width);
+#endif
 	for (int j = tile.min_y; j < tile.max_y; j++) {
-		for (int i = tile.min_x; i < tile.max_x; i++) {	
-			//trace ray
-			Vector3 color;
-			renderer->ColorPixel(i, j, color);
+		for (int start = tile.min_x; start < tile.max_x; ) {
+			//a resumed render may have the pass for part of the row (tiles are split differently every time)
+			if (accumulationBuffer->GetPassCount(start, j) > pass) {
+				start++;
+				continue;
+			}
+			int end = start + 1;
+			while (end < tile.max_x && accumulationBuffer->GetPassCount(end, j) <= pass)
+				end++;
+#ifdef DENOISE
+			renderer->ColorPixels(start, end, j, colors.data(), pass, features.data());
+#else
+			renderer->ColorPixels(start, end, j, colors.data(), pass);
+#endif
+			for (int i = start; i < end; i++) {
+#ifdef DENOISE
+				accumulationBuffer->AddFeatures(i, j, features[i - start]);
+#endif
+				//add to this pixel's running average
+				accumulationBuffer->AddSample(i, j, colors[i - start]);
+			}
+			start = end;
+		}
+		if (stopTime > 0.0 && tile.max_y - (j + 1) >= MIN_TILE_SIZE && render_timer.getElapsedTime() > stopTime)
+			return j + 1;
+	}
+	return tile.max_y;
+}
 
-			//quantize and save color to framebuffer
-			fb->getPixelPtr(i, j)[0] = (u08)(255.0f * max(min(color.x, 1.0f), 0.0f));
-			fb->getPixelPtr(i, j)[1] = (u08)(255.0f * max(min(color.y, 1.0f), 0.0f));
-			fb->getPixelPtr(i, j)[2] = (u08)(255.0f * max(min(color.z, 1.0f), 0.0f));
+// Position of cell x,y along a Hilbert curve through an n x n grid, n a power of 2
+// See Wikipedia, "Hilbert curve"
+int hilbertIndex(int n, int x, int y) {
+	int d = 0;
+	for (int s = n / 2; s > 0; s /= 2) {
+		int rx = (x & s) > 0;
+		int ry = (y & s) > 0;
+		d += s * s * ((3 * rx) ^ ry);
+		//rotate the quadrant so the curve inside it starts and ends like the whole curve
+		if (ry == 0) {
+			if (rx == 1) {
+				x = n - 1 - x;
+				y = n - 1 - y;
+			}
+			std::swap(x, y);
 		}
 	}
+	return d;
+}
 
-	//update percent complete
-	//grab mutex
-	std::lock_guard<std::mutex> guard(tilesRenderedMutex);
-	//increase count and display
-	NumTilesRendered++;
-	printf("\r%.2f%% complete", (NumTilesRendered/(float)NumTiles) * 100.0f);
-	//mutex is automatically released when guard goes out of scope
+// Saves a checkpoint if CHECKPOINT_INTERVAL seconds have passed since the last one
+// Waits for the tile passes in progress to finish, so must not be called while rendering a tile
+void checkpointIfDue(const AccumulationBuffer* accumulationBuffer) {
+	if (RenderCheckpoint == NULL)
+		return;
+	{
+		std::lock_guard<std::mutex> guard(checkpointTimeMutex);
+		double elapsed = render_timer.getElapsedTime();
+		if (elapsed - LastCheckpointTime < CHECKPOINT_INTERVAL)
+			return;
+		LastCheckpointTime = elapsed;
+	}
+	std::unique_lock<std::shared_timed_mutex> lock(checkpointMutex);
+	RenderCheckpoint->Save(*accumulationBuffer);
+}
+
+void renderTile(Renderer* renderer, AccumulationBuffer* accumulationBuffer, Tile tile, int pass);
+
+// Renders the quarters of a tile (halves if it is too small to quarter) as separate tasks, and waits for them
+void renderTileParts(Renderer* renderer, AccumulationBuffer* accumulationBuffer, Tile tile, int pass) {
+	int mid_x = (tile.max_x - tile.min_x >= 2 * MIN_TILE_SIZE) ? (tile.min_x + tile.max_x) / 2 : tile.max_x;
+	int mid_y = (tile.max_y - tile.min_y >= 2 * MIN_TILE_SIZE) ? (tile.min_y + tile.max_y) / 2 : tile.max_y;
+	TaskGroup group;
+	for (int part = 0; part < 4; part++) {
+		Tile partTile;
+		partTile.min_x = (part & 1) ? mid_x : tile.min_x;
+		partTile.max_x = (part & 1) ? tile.max_x : mid_x;
+		partTile.min_y = (part & 2) ? mid_y : tile.min_y;
+		partTile.max_y = (part & 2) ? tile.max_y : mid_y;
+		if (partTile.min_x < partTile.max_x && partTile.min_y < partTile.max_y) {
+			group.Run([=]() {
+				renderTile(renderer, accumulationBuffer, partTile, pass);
+			});
+		}
+	}
+	group.Wait();
+}
+
+// Renders a portion of the image for one pass
+void renderTile(Renderer* renderer, AccumulationBuffer* accumulationBuffer, Tile tile, int pass) {
+#ifdef PROGRESSIVE
+	//out of time? leave the rest of the pass undone, pixels keep their previous passes
+	if (PROGRESSIVE_TIME_LIMIT > 0.0 && render_timer.getElapsedTime() > PROGRESSIVE_TIME_LIMIT)
+		return;
+#endif
+	int width = tile.max_x - tile.min_x, height = tile.max_y - tile.min_y;
+	//pixels still missing this pass, a resumed render may have some or all of them already
+	int missing = 0;
+	for (int j = tile.min_y; j < tile.max_y; j++) {
+		for (int i = tile.min_x; i < tile.max_x; i++)
+			missing += accumulationBuffer->GetPassCount(i, j) <= pass;
+	}
+
+	bool splittable = max(width, height) >= 2 * MIN_TILE_SIZE;
+	//the end of the pass: some threads have nothing left to take, so leave them part of this tile
+	TaskScheduler& scheduler = TaskScheduler::Get();
+	if (missing > 0 && splittable && scheduler.NumQueuedTasks() < scheduler.NumThreads() - 1) {
+		renderTileParts(renderer, accumulationBuffer, tile, pass);
+		return;
+	}
+
+	int endRow = tile.max_y;
+	if (missing > 0) {
+		//only a whole tile is timed, and may be split when it is slow
+		bool whole = missing == width * height;
+		double startTime = render_timer.getElapsedTime();
+		double stopTime = 0.0;
+		if (whole) {
+			std::lock_guard<std::mutex> guard(tilesRenderedMutex);
+			if (MedianPixelTime > 0.0 && height >= 2 * MIN_TILE_SIZE)
+				stopTime = startTime + TILE_SPLIT_FACTOR * MedianPixelTime * width * height;
+		}
+		endRow = renderTilePass(renderer, accumulationBuffer, tile, pass, stopTime);
+		double pixelTime = (render_timer.getElapsedTime() - startTime) / (width * (endRow - tile.min_y));
+		checkpointIfDue(accumulationBuffer);
+
+		std::lock_guard<std::mutex> guard(tilesRenderedMutex);
+		if (whole)
+			TilePixelTimes.push_back(pixelTime);
+		//wait for a few tiles before trusting the median
+		if (TilePixelTimes.size() >= (size_t)scheduler.NumThreads()) {
+			std::vector<double> times = TilePixelTimes;
+			std::nth_element(times.begin(), times.begin() + times.size() / 2, times.end());
+			MedianPixelTime = times[times.size() / 2];
+		}
+	}
+
+	{
+		//update percent complete
+		//grab mutex
+		std::lock_guard<std::mutex> guard(tilesRenderedMutex);
+		//increase count and display
+		NumPixelsRendered += width * (endRow - tile.min_y);
+		printf("\r%.2f%% complete", (NumPixelsRendered/(float)NumPixels) * 100.0f);
+		//mutex is automatically released when guard goes out of scope
+	}
+
+	//the tile took much longer than most, share the rest of it
+	if (endRow < tile.max_y) {
+		tile.min_y = endRow;
+		renderTileParts(renderer, accumulationBuffer, tile, pass);
+	}
+}
+
+// Renders numPasses passes of a tile, stopping early once render_timer passes deadline (0 for no deadline)
+// Counts the passes done in tilePasses and the time they took in tileTime
+void renderTilePasses(Renderer* renderer, AccumulationBuffer* accumulationBuffer, Tile tile, int numPasses, double deadline, int* tilePasses, double* tileTime) {
+	for (int n = 0; n < numPasses; n++) {
+		if (deadline > 0.0 && render_timer.getElapsedTime() > deadline)
+			return;
+		Timer timer;
+		timer.startTimer();
+		//pass numbers continue per tile, so every pass draws new samples
+		renderTilePass(renderer, accumulationBuffer, tile, *tilePasses);
+		timer.stopTimer();
+		(*tilePasses)++;
+		*tileTime += timer.getTime();
+		checkpointIfDue(accumulationBuffer);
+	}
+}
+
+// Sum over the pixels of a tile of the relative variance of a single pass, used to decide where more passes help most
+double tileVariance(const AccumulationBuffer& accumulationBuffer, const Tile& tile) {
+	double variance = 0.0;
+	for (int j = tile.min_y; j < tile.max_y; j++) {
+		for (int i = tile.min_x; i < tile.max_x; i++) {
+			float pixelVariance = accumulationBuffer.GetVariance(i, j);
+			if (pixelVariance < 0.0f)
+				continue;
+			//relative to brightness like AccumulationBuffer::GetRelativeError
+			float luminance = max(accumulationBuffer.GetColor(i, j).Luminance(), 0.01f);
+			variance += pixelVariance * accumulationBuffer.GetPassCount(i, j) / (luminance * luminance);
+		}
+	}
+	return variance;
+}
+
+// Renders the tiles until budget seconds after render_timer started
+// After a few passes over the whole image, the remaining time is spent in rounds. Each round gives tile t passes until it has
+// about lambda * sqrt(V_t / c_t) in total, with V_t its variance per pass and c_t its cost per pass, which minimizes the summed
+// variance sum(V_t / n_t) for the time available. lambda is found by bisection so the round takes its share of the time
+void renderToDeadline(Renderer* renderer, AccumulationBuffer* accumulationBuffer, const std::vector<Tile>& tiles, double budget) {
+	//preprocessing can overrun the deadline, a deadline of 0 would mean none to renderTilePasses
+	double deadline = max(budget * DEADLINE_SAFETY, 0.0);
+	int numTiles = tiles.size();
+	std::vector<int> tilePasses(numTiles, 0);
+	std::vector<double> tileTime(numTiles, 0.0);
+	//passes loaded from a checkpoint, they were not timed
+	std::vector<int> resumedPasses(numTiles, 0);
+	printf("Deadline: %.2lf secs of rendering\n", deadline);
+	//a resumed render continues after the passes it has
+	for (int t = 0; t < numTiles; t++)
+		tilePasses[t] = resumedPasses[t] = accumulationBuffer->GetPassCount(tiles[t].min_x, tiles[t].min_y);
+
+	//measure every tile, tiles resumed from a checkpoint still need one pass to measure their cost
+	TaskScheduler& scheduler = TaskScheduler::Get();
+	for (int pass = 0; pass < DEADLINE_INITIAL_PASSES; pass++) {
+		//the first pass always finishes so there is an image, the rest only while there is time
+		if (pass > 0 && render_timer.getElapsedTime() >= deadline)
+			break;
+		scheduler.ParallelFor(0, numTiles, 1, [&](int t) {
+			if (tilePasses[t] <= pass || (pass == DEADLINE_INITIAL_PASSES - 1 && tilePasses[t] == resumedPasses[t]))
+				renderTilePasses(renderer, accumulationBuffer, tiles[t], 1, pass == 0 ? 0.0 : deadline, &tilePasses[t], &tileTime[t]);
+		});
+	}
+
+	for (int round = 1; ; round++) {
+		double remaining = deadline - render_timer.getElapsedTime();
+		if (remaining <= 0.0)
+			break;
+		//time of all threads together
+		double roundBudget = remaining * DEADLINE_ROUND_FRACTION * NUM_THREADS;
+
+		//weights sqrt(V_t / c_t)
+		std::vector<double> cost(numTiles), weight(numTiles);
+		for (int t = 0; t < numTiles; t++) {
+			cost[t] = tileTime[t] / max(tilePasses[t] - resumedPasses[t], 1);
+			weight[t] = sqrt(tileVariance(*accumulationBuffer, tiles[t]) / max(cost[t], 1e-9));
+		}
+		double totalWeight = 0.0;
+		for (int t = 0; t < numTiles; t++)
+			totalWeight += weight[t];
+		if (totalWeight <= 0.0) {
+			printf("No noise left.\n");
+			break;
+		}
+
+		//find lambda so the new passes cost the round's budget
+		double low = 0.0, high = 1.0;
+		auto roundCost = [&](double lambda) {
+			double total = 0.0;
+			for (int t = 0; t < numTiles; t++)
+				total += cost[t] * max(lambda * weight[t] - tilePasses[t], 0.0);
+			return total;
+		};
+		for (int i = 0; i < 64 && roundCost(high) < roundBudget; i++)
+			high *= 2.0;
+		for (int i = 0; i < 32; i++) {
+			double mid = (low + high) * 0.5;
+			if (roundCost(mid) < roundBudget)
+				low = mid;
+			else
+				high = mid;
+		}
+		std::vector<int> newPasses(numTiles);
+		int totalNewPasses = 0;
+		for (int t = 0; t < numTiles; t++) {
+			newPasses[t] = (int)(max(low * weight[t] - tilePasses[t], 0.0) + 0.5);
+			totalNewPasses += newPasses[t];
+		}
+		//too little time left to round up to a whole pass anywhere, give one to the tile that gains the most from it
+		if (totalNewPasses == 0) {
+			int best = 0;
+			double bestGain = -1.0;
+			for (int t = 0; t < numTiles; t++) {
+				double gain = weight[t] * weight[t] / ((double)tilePasses[t] * (tilePasses[t] + 1));
+				if (gain > bestGain) {
+					bestGain = gain;
+					best = t;
+				}
+			}
+			newPasses[best] = 1;
+			totalNewPasses = 1;
+		}
+
+		scheduler.ParallelFor(0, numTiles, 1, [&](int t) {
+			if (newPasses[t] > 0)
+				renderTilePasses(renderer, accumulationBuffer, tiles[t], newPasses[t], deadline, &tilePasses[t], &tileTime[t]);
+		});
+		printf("Round %d: %d tile passes, %.2lf secs, error %.4f\n", round, totalNewPasses, render_timer.getElapsedTime(), accumulationBuffer->GetRelativeError());
+	}
+
+	//report the samples reached
+	int minPasses = tilePasses[0], maxPasses = tilePasses[0];
+	long long totalPixelPasses = 0;
+	for (int t = 0; t < numTiles; t++) {
+		minPasses = min(minPasses, tilePasses[t]);
+		maxPasses = max(maxPasses, tilePasses[t]);
+		totalPixelPasses += (long long)tilePasses[t] * (tiles[t].max_x - tiles[t].min_x) * (tiles[t].max_y - tiles[t].min_y);
+	}
+	int numPixels = accumulationBuffer->GetWidth() * accumulationBuffer->GetHeight();
+	printf("Samples per pixel reached: %.1f average, %d min, %d max\n", (double)totalPixelPasses * SAMPLES_PER_PIXEL / numPixels,
+		minPasses * SAMPLES_PER_PIXEL, maxPasses * SAMPLES_PER_PIXEL);
+}
+
+// Saves the auxiliary buffers of an accumulation buffer as images
+void saveFeatureBuffers(const AccumulationBuffer& buffer) {
+	int width = buffer.GetWidth(), height = buffer.GetHeight();
+	//scale depth and noise to fit
+	float maxDepth = 0.0f, maxDeviation = 0.0f;
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			maxDepth = max(maxDepth, buffer.GetFeatures(x, y).depth);
+			maxDeviation = max(maxDeviation, sqrt(max(buffer.GetVariance(x, y), 0.0f)));
+		}
+	}
+
+	FrameBuffer albedo(width, height), normal(width, height), depth(width, height), deviation(width, height);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			PixelFeatures features = buffer.GetFeatures(x, y);
+			albedo.SetColor(x, y, features.albedo);
+			normal.SetColor(x, y, features.normal * 0.5f + 0.5f);
+			depth.SetColor(x, y, Vector3(1.0f, 1.0f, 1.0f) * (maxDepth > 0.0f ? features.depth / maxDepth : 0.0f));
+			float pixelDeviation = sqrt(max(buffer.GetVariance(x, y), 0.0f));
+			deviation.SetColor(x, y, Vector3(1.0f, 1.0f, 1.0f) * (maxDeviation > 0.0f ? pixelDeviation / maxDeviation : 0.0f));
+		}
+	}
+	albedo.SaveToFile("albedo.bmp");
+	normal.SaveToFile("normal.bmp");
+	depth.SaveToFile("depth.bmp");
+	deviation.SaveToFile("variance.bmp");
 }
 
 int main(int argc, char *argv[]) {
@@ -69,6 +462,9 @@ int main(int argc, char *argv[]) {
 	Timer total_timer;
 	total_timer.startTimer();
 
+	//every parallel loop, from building the scene to denoising, shares these threads
+	TaskScheduler::SetNumThreads(NUM_THREADS);
+
 	//load scene data
 	printf("Loading scene data...\n");
 	Scene scene(SCENE_PATH, IMAGE_WIDTH, IMAGE_HEIGHT, FOCAL_LENGTH, LENS_RADIUS);
@@ -118,19 +514,73 @@ int main(int argc, char *argv[]) {
 	//scene.lights[0]->color = Vector3(2, 2, 2);
 
 	//create renderer
-	Renderer renderer(&scene, SAMPLES_PER_PIXEL);
+	bool usePathTracer = false;
+	double deadlineSeconds = 0.0;
+	const char* environmentPath = NULL;
+	bool bakeLightmap = false, useLightmap = false;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], PATH_TRACER_ARG) == 0)
+			usePathTracer = true;
+		else if (strcmp(argv[i], DEADLINE_ARG) == 0 && i + 1 < argc)
+			deadlineSeconds = atof(argv[++i]);
+		else if (strcmp(argv[i], ENVIRONMENT_ARG) == 0 && i + 1 < argc)
+			environmentPath = argv[++i];
+		else if (strcmp(argv[i], BAKE_ARG) == 0)
+			bakeLightmap = true;
+		else if (strcmp(argv[i], LIGHTMAP_ARG) == 0)
+			useLightmap = true;
+	}
+	if (environmentPath != NULL)
+		scene.SetEnvironment(new EnvironmentMap(environmentPath, ENVIRONMENT_INTENSITY));
+	printf("Integrator: %s\n", usePathTracer ? "path tracer" : "Whitted ray tracer");
+	Renderer* renderer = usePathTracer ? new PathTracer(&scene, SAMPLES_PER_PIXEL) : new Renderer(&scene, SAMPLES_PER_PIXEL);
+
+	//bake mode only writes the lightmap
+	if (bakeLightmap) {
+		renderer->BakeLightmap(LIGHTMAP_FILE);
+		delete renderer;
+		printf("Total time: %.5lf secs\n", total_timer.getElapsedTime());
+		return 0;
+	}
+	if (useLightmap && usePathTracer)
+		printf("The path tracer doesn't use lightmaps\n");
+	else if (useLightmap && !renderer->LoadLightmap(LIGHTMAP_FILE))
+		printf("Rendering without a lightmap\n");
+	renderer->Preprocess();
 
-	//create image buffer
+	//create image buffers
 	FrameBuffer frameBuffer(IMAGE_WIDTH, IMAGE_HEIGHT);
+	AccumulationBuffer accumulationBuffer(IMAGE_WIDTH, IMAGE_HEIGHT);
+#ifdef DENOISE
+	accumulationBuffer.EnableFeatures();
+#endif
+
+#ifdef CHECKPOINT
+	//identify the render by the scene file, the lights, materials and geometry after the changes above, the settings and the lightmap
+	unsigned long long sceneHash = FileUtil::HashFile(SCENE_PATH);
+	int settings[] = { IMAGE_WIDTH, IMAGE_HEIGHT, SAMPLES_PER_PIXEL, usePathTracer, useLightmap, (int)scene.GetPrimitives().size(), (int)scene.lights.size() };
+	sceneHash = FileUtil::Hash(settings, sizeof(settings), sceneHash);
+	float lens[] = { FOCAL_LENGTH, LENS_RADIUS };
+	sceneHash = FileUtil::Hash(lens, sizeof(lens), sceneHash);
+	sceneHash = scene.HashLighting(sceneHash);
+	if (useLightmap)
+		sceneHash = FileUtil::HashFile(LIGHTMAP_FILE, sceneHash);
+	Checkpoint checkpoint(CHECKPOINT_NAME, sceneHash);
+	if (checkpoint.Load(accumulationBuffer))
+		printf("Resuming from checkpoint '%s'\n", CHECKPOINT_NAME);
+	RenderCheckpoint = &checkpoint;
+#endif
 
-	Timer render_timer;
+	long long raysBeforeRender = scene.GetRaysTraced();
 	render_timer.startTimer();
 
-	//create thread pool
-	ctpl::thread_pool pool(NUM_THREADS);
-	
 	//divide image up into tiles
 	std::vector<Tile> tiles;
+	std::vector<std::pair<int, int>> tileOrder;
+	int tilesX = (IMAGE_WIDTH + TILE_SIZE - 1) / TILE_SIZE, tilesY = (IMAGE_HEIGHT + TILE_SIZE - 1) / TILE_SIZE;
+	int curveSize = 1;
+	while (curveSize < max(tilesX, tilesY))
+		curveSize *= 2;
 	for (int x = 0; x < IMAGE_WIDTH; x += TILE_SIZE) {
 		for (int y = 0; y < IMAGE_HEIGHT; y += TILE_SIZE) {
 			Tile tile;
@@ -138,28 +588,103 @@ int main(int argc, char *argv[]) {
 			tile.min_y = y;
 			tile.max_x = min(x + TILE_SIZE, IMAGE_WIDTH);
 			tile.max_y = min(y + TILE_SIZE, IMAGE_HEIGHT);
+			tileOrder.push_back(std::make_pair(hilbertIndex(curveSize, x / TILE_SIZE, y / TILE_SIZE), (int)tiles.size()));
 			tiles.push_back(tile);
 		}
 	}
+	//neighbours along the curve are rendered one after the other
+	std::sort(tileOrder.begin(), tileOrder.end());
+	std::vector<Tile> orderedTiles;
+	for (int i = 0; i < tileOrder.size(); i++)
+		orderedTiles.push_back(tiles[tileOrder[i].second]);
+	tiles.swap(orderedTiles);
+
+#ifdef PROGRESSIVE
+	int numPasses = max(PROGRESSIVE_TARGET_SPP / SAMPLES_PER_PIXEL, 1);
+	double lastSaveTime = 0.0;
+#else
+	int numPasses = 1;
+#endif
+
+	//with a deadline, passes are allocated to tiles instead
+	if (deadlineSeconds > 0.0) {
+		printf("Rendering...\n");
+		renderToDeadline(renderer, &accumulationBuffer, tiles, deadlineSeconds - total_timer.getElapsedTime());
+		numPasses = 0;
+	}
+
+	//render all tiles, once per pass
+	if (numPasses > 0)
+		printf("Rendering...\n");
+	for (int pass = 0; pass < numPasses; pass++) {
+		NumPixels = IMAGE_WIDTH * IMAGE_HEIGHT;
+		NumPixelsRendered = 0;
+		TilePixelTimes.clear();
+		MedianPixelTime = 0.0;
+		//a task per tile, idle threads steal tiles from busy ones, returns when this pass is finished
+		TaskScheduler::Get().ParallelFor(0, (int)tiles.size(), 1, [&](int i) {
+			renderTile(renderer, &accumulationBuffer, tiles[i], pass);
+		});
+
+#ifdef PROGRESSIVE
+		double elapsed = render_timer.getElapsedTime();
+		float error = accumulationBuffer.GetRelativeError();
+		printf("\rPass %d: %d spp, %.2lf secs, error %.4f\n", pass + 1, (pass + 1) * SAMPLES_PER_PIXEL, elapsed, error);
+
+		//check stopping conditions
+		bool done = (pass == numPasses - 1);
+		if (PROGRESSIVE_TIME_LIMIT > 0.0 && elapsed > PROGRESSIVE_TIME_LIMIT) {
+			printf("Time limit reached.\n");
+			done = true;
+		}
+		if (PROGRESSIVE_NOISE_TARGET > 0.0f && error >= 0.0f && error < PROGRESSIVE_NOISE_TARGET) {
+			printf("Noise target reached.\n");
+			done = true;
+		}
 
-	//render all tiles
-	NumTiles = tiles.size();
-	NumTilesRendered = 0;
-	printf("Rendering...\n");
-	for (int i = 0; i < tiles.size(); i++) {
-		//queue up a thread to render this tile
-		pool.push(renderTile, &renderer, &frameBuffer, tiles[i]);
+		//save intermediate image: always after the first pass so there is a quick preview
+		if (!done && (pass == 0 || elapsed - lastSaveTime >= PROGRESSIVE_SAVE_INTERVAL)) {
+			accumulationBuffer.Resolve(&frameBuffer);
+			frameBuffer.SaveToFile(OUTPUT_NAME);
+			lastSaveTime = elapsed;
+		}
+		if (done)
+			break;
+#endif
 	}
 
-	//wait for all threads to finish
-	pool.stop(true);
-	//all threads have ended
 	std::cout << std::endl;
 	render_timer.stopTimer();
 	printf("Render time: %.5lf secs\n", render_timer.getTime());
-	
+	long long raysRendered = scene.GetRaysTraced() - raysBeforeRender;
+	printf("Rays traced: %lld (%.2lf million rays/sec)\n", raysRendered, raysRendered / render_timer.getTime() / 1000000.0);
+	delete renderer;
+#ifdef CHECKPOINT
+	//the render is complete, nothing to resume
+	checkpoint.Remove();
+	RenderCheckpoint = NULL;
+#endif
+
+#ifdef DENOISE
+	//save the unfiltered image, then filter it
+	accumulationBuffer.Resolve(&frameBuffer);
+	frameBuffer.SaveToFile(DENOISE_RAW_OUTPUT_NAME);
+	Timer denoise_timer;
+	denoise_timer.startTimer();
+	Denoiser denoiser(accumulationBuffer);
+	denoiser.Denoise(accumulationBuffer, &frameBuffer);
+	denoise_timer.stopTimer();
+	printf("Denoise time: %.5lf secs\n", denoise_timer.getTime());
+#ifdef SAVE_FEATURE_BUFFERS
+	saveFeatureBuffers(accumulationBuffer);
+#endif
+#endif
+
 	//save output
 	printf("Saving to '%s'...\n", OUTPUT_NAME);
+#ifndef DENOISE
+	accumulationBuffer.Resolve(&frameBuffer);
+#endif
 	frameBuffer.SaveToFile(OUTPUT_NAME);
 	printf("Done.\n");
 	